@@ -4,10 +4,17 @@
 """
 
 import argparse
+import gzip
+import struct
 
 from ctypes import *
 
 
+# size_t (*subscriber)(void *, struct nanny_log *, uintmax_t, const char *,
+#                      size_t);
+NANNY_LOG_SUBSCRIBER = CFUNCTYPE(c_size_t, c_void_p, c_void_p, c_ulonglong,
+        c_void_p, c_size_t)
+
 # void (*f)(void *, time_t);
 NANNY_TIMER_CB = CFUNCTYPE(None, c_void_p, c_long)
 
@@ -36,25 +43,11 @@ class NANNY_GLOBALS(Structure):
                 ]
 
 class NANNY_LOG(Structure):
-    """ `struct nanny_log_t' wrapper (see nanny_log.c). Stores properties
-    related to stream loggers (STDOUT, STDERR, events). """
-    _fields_ = [("refcnt", c_int),
-                ("filename_base", c_char_p),
-                ("filname", c_char_p),
-                ("file_fd", c_int),
-                ("last_rotate", c_long),
-                ("last_rotate_bytes", c_ulonglong),
-                ("last_rotate_check", c_long),
-                ("total_bytes", c_ulonglong),
-                ("read_count", c_ulonglong),
-                ("error_count", c_ulonglong),
-                ("bytes_per_second", c_float),
-                ("bps_last_update_time", c_long),
-                ("buff", c_char_p),
-                ("buff_size", c_ulong),
-                ("buff_end", c_char_p),
-                ("buffp", c_char_p)
-                ]
+    """ `struct nanny_log' (see nanny/nanny_log.h). Stores properties
+    related to stream loggers (STDOUT, STDERR, events). The layout is
+    private to the C core, so this is only ever handled by pointer; use
+    the nanny_log_* functions to configure it. """
+    pass
 
 
 class NANNY_TIMER(Structure):
@@ -125,7 +118,10 @@ NANNY_CHILD._fields_ = [("older", POINTER(NANNY_CHILD)),
                 ("child_stderr", POINTER(NANNY_LOG)),
                 ("child_stdout", POINTER(NANNY_LOG)),
                 ("child_events", POINTER(NANNY_LOG)),
-                ("envp", POINTER(c_char_p))
+                ("envp", POINTER(c_char_p)),
+                ("generation", c_uint64),
+                ("metric_labels", c_char_p),
+                ("metrics", c_void_p)
                 ]
 
 class NANNY_HTTP_CONNECTION(Structure):
@@ -166,7 +162,10 @@ NANNY_HTTP_REQUEST._fields_ = [
             ("HTTPminor", c_int),
             ("header_processor", NANNY_HTTP_HEADER_PROCESSOR),
             ("body_processor", NANNY_HTTP_BODY_PROCESSOR),
-            ("data", c_void_p)
+            ("data", c_void_p),
+            ("range", c_char_p),
+            ("if_modified_since", c_long),
+            ("if_none_match", c_char_p)
 ]
 
 # The dispatch function can choose the request body and environment processors.
@@ -223,19 +222,21 @@ class NannyChild(object):
         self._nanny_so = nanny_so
         self._child_struct = child_struct
         self._as_parameter_ = child_struct
+        self._subscriptions = {}
+        self._ended = []
 
     @property
-    def child_stdout:
+    def child_stdout(self):
         """ STDOUT NANNY_LOG stream for child """
         return self._child_struct.contents.child_stdout
 
     @property
-    def child_stderr:
+    def child_stderr(self):
         """ STDERR NANNY_LOG stream for child """
-        return self._child_struct.contents.child_stdout
+        return self._child_struct.contents.child_stderr
 
     @property
-    def child_events:
+    def child_events(self):
         """ Events NANNY_LOG stream for child """
         return self._child_struct.contents.child_events
 
@@ -252,6 +253,161 @@ class NannyChild(object):
         logs from the child to. """
         self._nanny_so.nanny_log_set_filename(self.child_events, filename)
 
+    def set_log_rotation(self, max_bytes, interval):
+        """ Start a new log file once the current one holds max_bytes, and
+        whenever the clock passes a multiple of interval seconds (e.g. 3600
+        for the top of every hour). Zero disables either limit. Applies to
+        the STDOUT, STDERR and events logs. """
+        f = self._nanny_so.nanny_child_set_log_rotation
+        f.argtypes = [POINTER(NANNY_CHILD), c_ulonglong, c_long]
+        f(self._child_struct, max_bytes, interval)
+
+    def set_log_idle_close(self, seconds):
+        """ Close a log file once nothing has been written to it for this
+        many seconds. It is reopened by the next write. """
+        f = self._nanny_so.nanny_log_set_idle_close
+        f.argtypes = [POINTER(NANNY_LOG), c_long]
+        for log in (self.child_stdout, self.child_stderr, self.child_events):
+            f(log, seconds)
+
+    def set_log_stamps(self, enable=True):
+        """ Prefix every line written to the STDOUT and STDERR log files with
+        the time nanny received it. The events log is already timestamped. """
+        f = self._nanny_so.nanny_child_set_log_stamps
+        f.argtypes = [POINTER(NANNY_CHILD), c_int]
+        f(self._child_struct, 1 if enable else 0)
+
+    def set_log_ring(self, max_bytes, idle=600,
+            streams=('stdout', 'stderr', 'events')):
+        """ Keep up to max_bytes of recent output in memory for each of the
+        named streams. Memory is taken from a shared pool only as output
+        arrives, and all but the newest few KB are given back once a stream
+        has been quiet for idle seconds (0 never shrinks). """
+        f = self._nanny_so.nanny_log_set_ring
+        f.argtypes = [POINTER(NANNY_LOG), c_size_t, c_long]
+        for stream in streams:
+            f(getattr(self, 'child_' + stream), max_bytes, idle)
+
+    def set_log_history(self, max_bytes,
+            streams=('stdout', 'stderr', 'events')):
+        """ Keep output that falls out of the in-memory ring for the named
+        streams, compressed, up to max_bytes of memory each (0 disables).
+        Log pages read through it as if the ring were that much longer;
+        typical text output gets several times the history per byte. """
+        f = self._nanny_so.nanny_log_set_history
+        f.argtypes = [POINTER(NANNY_LOG), c_size_t]
+        for stream in streams:
+            f(getattr(self, 'child_' + stream), max_bytes)
+
+    def set_log_dedup(self, enable=True):
+        """ Collapse runs of identical lines in the STDOUT and STDERR logs
+        into a "last line repeated N times" marker, in memory and on disk.
+        In the events log, a crash loop or failing health check is shown
+        once per cycle followed by a count of the repeats. """
+        f = self._nanny_so.nanny_child_set_log_dedup
+        f.argtypes = [POINTER(NANNY_CHILD), c_int]
+        f(self._child_struct, 1 if enable else 0)
+
+    def add_metric(self, name, pattern, kind='count', stream='stdout'):
+        """ Extract a metric from lines of the child's stdout (or stderr)
+        as they arrive, served as JSON at /status/<id>/metrics. The
+        pattern is literal text where '*' matches anything and '#' a
+        number; a leading '^' anchors it to the start of the line.  kind
+        is 'count' (matching lines), 'sum', 'gauge' (last value) or
+        'histogram' of the first number, e.g.
+            child.add_metric('get_ms', '^GET * #ms', kind='histogram') """
+        f = self._nanny_so.nanny_child_add_metric
+        f.argtypes = [POINTER(NANNY_CHILD), c_char_p, c_char_p, c_char_p,
+                c_char_p]
+        if f(self._child_struct, stream, name, kind, pattern) < 0:
+            raise ValueError("bad metric rule: %s %r" % (kind, pattern))
+
+    def subscribe(self, callback, stream='stdout'):
+        """ Call callback(offset, data) with each new piece of the named
+        stream as nanny ingests it. The callback returns how many bytes it
+        took (None means all of them); the rest is offered again with the
+        next output, or after resume(). Output the ring overwrites before
+        it's taken is skipped and counted as lost. On the 'events' stream
+        each event comes as a whole line, taken only if all of it is.
+        Returns a handle for unsubscribe() and resume(). """
+        handle = []
+        def handler(data, log, offset, p, n):
+            if not p:
+                # The log was freed: release the handle.  The callback
+                # is still running, so it's kept until the next call.
+                self._ended.append(self._subscriptions.pop(handle[0]))
+                self._free_subscription(handle[0])
+                return 0
+            taken = callback(offset, string_at(p, n))
+            return n if taken is None else taken
+        self._ended = []
+        f = self._nanny_so.nanny_log_subscribe
+        f.argtypes = [POINTER(NANNY_LOG), NANNY_LOG_SUBSCRIBER, c_void_p]
+        f.restype = c_void_p
+        cb = NANNY_LOG_SUBSCRIBER(handler)
+        sub = f(getattr(self, 'child_' + stream), cb, None)
+        handle.append(sub)
+        # ctypes callbacks must outlive the subscription.
+        self._subscriptions[sub] = cb
+        return sub
+
+    def unsubscribe(self, sub):
+        """ Stop a subscription started with subscribe(); a no-op once
+        the child's log has been freed. """
+        self._ended = []
+        if self._subscriptions.pop(sub, None) is not None:
+            self._free_subscription(sub)
+
+    def _free_subscription(self, sub):
+        f = self._nanny_so.nanny_log_unsubscribe
+        f.argtypes = [c_void_p]
+        f(sub)
+
+    def resume(self, sub):
+        """ Offer a subscriber that held back everything pending now. """
+        if sub not in self._subscriptions:
+            return
+        f = self._nanny_so.nanny_log_subscriber_resume
+        f.argtypes = [c_void_p]
+        f(sub)
+
+    def set_log_limit(self, rate, burst=0, ring=False, sample=0):
+        """ Limit the STDOUT and STDERR logs to rate bytes per second, with
+        bursts of up to burst bytes (default: one second's worth). Whole
+        lines over the limit are dropped from the log files, and from the
+        in-memory ring too if ring is set; with sample=N, one in N of those
+        lines is kept anyway. Drops are counted and reported in the events
+        log. A rate of zero removes the limit. """
+        f = self._nanny_so.nanny_child_set_log_limit
+        f.argtypes = [POINTER(NANNY_CHILD), c_ulonglong, c_ulonglong, c_int,
+                c_int]
+        f(self._child_struct, rate, burst, 1 if ring else 0, sample)
+
+    def set_log_sync(self, mode, interval=5):
+        """ Choose when the log files are forced to disk: 'none' leaves it
+        to the kernel, 'periodic' runs fdatasync every interval seconds
+        while there is new output, and 'rotate' syncs each file as rotation
+        finishes it. Syncs happen on a background thread; their latency and
+        how far the disk lags behind are reported in the status output. """
+        modes = {'none': 0, 'periodic': 1, 'rotate': 2}
+        if mode not in modes:
+            raise ValueError("bad sync mode: %r" % (mode,))
+        f = self._nanny_so.nanny_child_set_log_sync
+        f.argtypes = [POINTER(NANNY_CHILD), c_int, c_long]
+        if f(self._child_struct, modes[mode], interval) < 0:
+            raise ValueError("bad sync mode: %r" % (mode,))
+
+    def set_log_cache(self, drop=True, extent=0):
+        """ Control how the log files use the page cache. With drop (the
+        default), output more than a megabyte behind the end of the file,
+        and the whole file once it's closed, is written back and dropped
+        from the cache so it doesn't push out the services' own data. A
+        nonzero extent preallocates files in blocks of that many bytes;
+        the unused end is released on rotation. """
+        f = self._nanny_so.nanny_child_set_log_cache
+        f.argtypes = [POINTER(NANNY_CHILD), c_int, c_ulonglong]
+        f(self._child_struct, 1 if drop else 0, extent)
+
     def set_health(self, health_cmd):
         """ Set the health check command for this child """
         self._nanny_so.nanny_child_set_health(self._child_struct, health_cmd)
@@ -288,6 +444,41 @@ class NannyChild(object):
         self._nanny_so.nanny_child_set_envp(self._child_struct,
                 environment_array)
 
+# One index record of a consolidated log file; see nanny_log_consolidate.c.
+# file_offset, stream_offset, time, id, length, stream
+CONSOLIDATE_INDEX = struct.Struct("=QQqII8s")
+
+def extract_consolidated(path, child_id, stream=None):
+    """ Yield (time, stream, data) for each record child_id wrote to the
+    consolidated log file at path (optionally only one stream), using the
+    index beside it to skip everybody else's output. Works on archived
+    (gzip'd) files too. """
+    if path.endswith('.gz'):
+        index_path = path[:-3] + '.idx'
+        data = gzip.open(path, 'rb')
+    else:
+        index_path = path + '.idx'
+        data = open(path, 'rb')
+    try:
+        index = open(index_path, 'rb')
+        try:
+            while True:
+                raw = index.read(CONSOLIDATE_INDEX.size)
+                if len(raw) < CONSOLIDATE_INDEX.size:
+                    break
+                (offset, _, when, cid, length,
+                        name) = CONSOLIDATE_INDEX.unpack(raw)
+                name = name.rstrip(b'\0').decode('ascii')
+                if cid != child_id or (stream is not None and name != stream):
+                    continue
+                data.seek(offset)
+                data.readline() # Frame header
+                yield when, name, data.read(length)
+        finally:
+            index.close()
+    finally:
+        data.close()
+
 def main():
 
     parser = argparse.ArgumentParser(
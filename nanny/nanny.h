@@ -32,6 +32,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <stdint.h>
 
 #if defined(__APPLE__)
 #define environ (*_NSGetEnviron())
@@ -69,6 +70,9 @@ int nanny_variable_compare(const char *key, const char *value);
  */
 void nanny_register_server(void (*handler)(void *), int s, void *data);
 void nanny_unregister_server(int fd);
+/* Like the above, but the handler runs when the socket is writable. */
+void nanny_register_writer(void (*handler)(void *), int s, void *data);
+void nanny_unregister_writer(int fd);
 void nanny_select(struct timeval *);
 
 /*
@@ -92,6 +96,11 @@ struct http_request {
   int (*body_processor)(struct http_request *);
 
   void *data;
+
+  /* Conditional and partial requests; set from the request headers. */
+  char *range;			/* "Range:" value, or NULL. */
+  time_t if_modified_since;	/* 0 if absent. */
+  char *if_none_match;		/* "If-None-Match:" value, or NULL. */
 };
 
 #define HTTP_METHOD_GET 1
@@ -104,10 +113,37 @@ struct http_request {
 void http_server_init(const struct sockaddr *,
 		      socklen_t namelen,
 		      void (*dispatcher)(struct http_request *));
+/* Finish a slow request in a forked process; nonzero in the process
+ * that should write the response. */
+int http_detach(struct http_request *);
+/* Fork a process per connection instead of serving from the event loop. */
+void http_server_set_forking(int);
+/* zlib level for compressed responses; 0 disables compression. */
+void http_server_set_compression(int);
+/* Report connection and compression counters as JSON. */
+int http_server_stats_body(struct http_request *);
+/* The same counters in Prometheus text format, without a header. */
+void http_server_metrics(struct http_request *);
 
 /* Write response data back. */
 void http_printf(struct http_request *, const char *fmt, ...);
 ssize_t http_write(struct http_request *, void *, size_t);
+/* Finish the response with 'len' bytes of 'fd' from 'offset', sent
+ * with sendfile().  The response takes ownership of the descriptor. */
+int http_sendfile(struct http_request *, int fd, off_t offset, size_t len);
+/* Serve a file, honoring Range and If-Modified-Since. */
+int http_serve_file(struct http_request *, const char *path,
+		    const char *content_type);
+/* Tag the response with an entity tag.  If the client already has
+ * it, this sends a 304 and returns 1:  the handler should stop. */
+int http_etag(struct http_request *, const char * /*etag*/);
+/* Format and parse RFC 1123 dates as used in HTTP headers. */
+const char *http_date(time_t);
+time_t http_parse_date(const char *);
+
+/* Copy the value of a URI query parameter into buff; NULL if absent. */
+const char *http_query(struct http_request *, const char * /*key*/,
+		       char * /*buff*/, size_t);
 
 /* Generate a dump of the current environment. */
 int nanny_http_environ_body(struct http_request *);
@@ -139,13 +175,154 @@ void udp_announce(char *fmt, ...);
 struct nanny_log;
 struct nanny_log *nanny_log_alloc(size_t);
 void nanny_log_set_filename(struct nanny_log *, const char *fmt, ...);
+/* Start a new file after max_bytes or on multiples of interval; 0 = never. */
+void nanny_log_set_rotation(struct nanny_log *, uintmax_t /*max_bytes*/,
+			    time_t /*interval*/);
+/* Prefix each line written to disk with its arrival time. */
+void nanny_log_set_file_stamps(struct nanny_log *, int);
+/* Keep up to max_bytes in memory; shrink after 'idle' quiet seconds. */
+void nanny_log_set_ring(struct nanny_log *, size_t /*max_bytes*/,
+			time_t /*idle*/);
+/* Keep up to max_bytes of compressed history behind the ring; 0 = none. */
+void nanny_log_set_history(struct nanny_log *, size_t /*max_bytes*/);
+/* Forward captured output to a collector ("unix:<path>", "udp:<h>:<p>"). */
+int nanny_log_forward_init(const char *);
+/* Tag forwarded output from this log; a NULL stream disables it. */
+void nanny_log_set_forward(struct nanny_log *, int /*id*/,
+			   const char * /*stream*/);
+/* Write all tagged logs to one shared file; returns its log for tuning. */
+struct nanny_log *nanny_log_consolidate(const char * /*path*/);
+/* Count, sum or histogram numbers found in lines; see nanny_log_metrics.c. */
+int nanny_log_add_metric(struct nanny_log *, const char * /*name*/,
+			 const char * /*kind*/, const char * /*pattern*/);
+void nanny_log_http_dump_metrics(struct http_request *, struct nanny_log *,
+				 const char * /*indent*/);
+/*
+ * Subscribe to a log:  the handler gets each new span of the stream
+ * at 'offset', straight from the ring, and returns how many bytes it
+ * took; the rest is offered again later.  When the log is freed, the
+ * handler gets one last call with an empty span (NULL, 0); the handle
+ * stays valid until it's unsubscribed.  An events log's records come
+ * as whole rendered lines, at the offset they happened.
+ */
+typedef size_t (nanny_log_subscriber)(void * /*data*/, struct nanny_log *,
+				      uintmax_t /*offset*/, const char *,
+				      size_t);
+struct nanny_log_subscription;
+struct nanny_log_subscription *nanny_log_subscribe(struct nanny_log *,
+						   nanny_log_subscriber *,
+						   void *);
+void nanny_log_unsubscribe(struct nanny_log_subscription *);
+void nanny_log_subscriber_resume(struct nanny_log_subscription *);
+uintmax_t nanny_log_subscriber_cursor(struct nanny_log_subscription *,
+				      uintmax_t * /*lag*/,
+				      uintmax_t * /*lost*/);
+/* Collapse runs of identical lines (or events) into a count. */
+void nanny_log_set_dedup(struct nanny_log *, int);
+/* Token-bucket limit in bytes/second for the disk and optionally ring. */
+void nanny_log_set_limit(struct nanny_log *, uintmax_t /*rate*/,
+			 uintmax_t /*burst*/, int /*ring*/, int /*sample*/);
+/* Send rate-limit reports to another log, tagged with a label. */
+void nanny_log_set_notify(struct nanny_log *, struct nanny_log *,
+			  const char *);
+/* When to fdatasync() the log file; syncs run on a background thread. */
+enum nanny_log_sync_mode {
+  NANNY_LOG_SYNC_NONE,		/* Leave it to the kernel. */
+  NANNY_LOG_SYNC_PERIODIC,	/* Every 'interval' seconds with new data. */
+  NANNY_LOG_SYNC_ROTATE,	/* Each file as rotation finishes it. */
+  NANNY_LOG_SYNC_MODES
+};
+/* Returns -1 for an unknown mode. */
+int nanny_log_set_sync(struct nanny_log *, enum nanny_log_sync_mode,
+		       time_t /*interval*/);
+/* Drop written log data from the page cache; preallocate in extents. */
+void nanny_log_set_cache(struct nanny_log *, int /*drop*/,
+			 uintmax_t /*extent*/);
+/* Close the log file after this many idle seconds; 0 = never. */
+void nanny_log_set_idle_close(struct nanny_log *, time_t);
+/* Gzip rotated files in the background at this level; 0 (default) disables. */
+void nanny_log_set_compression(struct nanny_log *, int /*level*/);
+/* Delete rotated files beyond any of these limits; 0 (default) = no limit. */
+void nanny_log_set_retention(struct nanny_log *, uintmax_t /*max_bytes*/,
+			     int /*max_files*/, time_t /*max_age*/);
+/* Throttle the background compressor to this many input bytes/second. */
+void nanny_log_archive_set_rate(uintmax_t);
 void nanny_log_retain(struct nanny_log *);
 void nanny_log_release(struct nanny_log *);
 void nanny_log_printf(struct nanny_log *, char *, ...);
 void nanny_log_from_fd(int fd, struct nanny_log *);
+/* Bytes/second averaged over the last 1, 5 and 15 minutes. */
+void nanny_log_rates(struct nanny_log *, double *, double *, double *);
 void nanny_log_http_dump_raw(struct http_request *, struct nanny_log *);
+/* Byte cursors: the log is a stream and total_bytes is its end offset. */
+uintmax_t nanny_log_cursor(struct nanny_log *);
+uintmax_t nanny_log_oldest(struct nanny_log *);
+/* Changes whenever the log's status does; see nanny_children_generation(). */
+uintmax_t nanny_log_generation(struct nanny_log *);
+/* Dump everything ingested at or after offset 'since'; returns new cursor. */
+uintmax_t nanny_log_http_dump_since(struct http_request *, struct nanny_log *,
+				    uintmax_t /*since*/);
+/* As above, whole lines only, filtered to arrival times within [from, to]. */
+uintmax_t nanny_log_http_dump_lines(struct http_request *, struct nanny_log *,
+				    uintmax_t /*since*/, time_t /*from*/,
+				    time_t /*to*/, int /*stamps*/);
+/* Report lines in the ring and rotated files that contain 'needle'. */
+/* List rotated files as JSON, or send the named one with sendfile(). */
+int nanny_log_http_files(struct http_request *, struct nanny_log *,
+			 const char * /*name*/);
+void nanny_log_http_search(struct http_request *, struct nanny_log *,
+			   const char * /*needle*/, size_t /*max_matches*/,
+			   long /*max_ms*/);
 void nanny_log_http_dump_json(struct http_request *, struct nanny_log *,
 			      const char * /*name*/, const char * /*indent*/);
+/* Counters exported on /metrics; see nanny_children_http_metrics(). */
+enum nanny_log_counter {
+  NANNY_LOG_BYTES,
+  NANNY_LOG_READS,
+  NANNY_LOG_ERRORS,
+  NANNY_LOG_SUPPRESSED_BYTES,
+  NANNY_LOG_SUPPRESSED_LINES,
+  NANNY_LOG_REPEATED_LINES,
+  NANNY_LOG_RING_BYTES,
+  NANNY_LOG_FORWARDED_BYTES,
+  NANNY_LOG_FORWARD_DROPPED,
+  NANNY_LOG_ARCHIVED_FILES,
+  NANNY_LOG_DELETED_FILES,
+  NANNY_LOG_COUNTERS
+};
+uintmax_t nanny_log_counter(struct nanny_log *, enum nanny_log_counter);
+
+/*
+ * Child lifecycle events, kept as binary records beside a log's text
+ * and only formatted when read.
+ */
+enum nanny_event_type {
+  NANNY_EVENT_STARTING,		/* pid, arg = start command */
+  NANNY_EVENT_RESTARTING,	/* pid, arg = start command */
+  NANNY_EVENT_STOPPING,		/* pid, arg = stop command, or signal */
+  NANNY_EVENT_STOPPED,		/* pid, status or signal */
+  NANNY_EVENT_SIGTERM,		/* pid */
+  NANNY_EVENT_SIGKILL,		/* pid */
+  NANNY_EVENT_GIVING_UP,	/* pid */
+  NANNY_EVENT_HEALTH_START,	/* pid */
+  NANNY_EVENT_HEALTH_KILL,	/* pid */
+  NANNY_EVENT_HEALTH_FAILED,	/* status or signal */
+  NANNY_EVENT_HEALTH_FAILURES,	/* status = consecutive failures */
+  NANNY_EVENT_REPEATED,		/* status = repeats suppressed */
+  NANNY_EVENT_TYPES
+};
+void nanny_log_event(struct nanny_log *, enum nanny_event_type, pid_t,
+		     int /*status*/, int /*signal*/, const char * /*arg*/);
+uintmax_t nanny_log_event_cursor(struct nanny_log *);
+/* The oldest event still held:  where a fetch without a cursor starts. */
+uintmax_t nanny_log_event_oldest(struct nanny_log *);
+/* Comma-separated type names ("stopped,sigkill") to a filter mask. */
+unsigned nanny_log_event_mask(const char *);
+/* Text interleaved with records, or just matching records (or JSON). */
+void nanny_log_http_dump_events(struct http_request *, struct nanny_log *,
+				uintmax_t /*since*/, uintmax_t /*esince*/,
+				unsigned /*mask*/, time_t /*from*/,
+				time_t /*to*/, int /*json*/);
 
 /*
  * Child process management.
@@ -209,16 +386,56 @@ struct nanny_child {
 
   /* Environment array for execve() */
   const char  **envp;
+
+  /* Bumped on every state or counter change; see nanny_child_generation(). */
+  uintmax_t generation;
+
+  /* Preformatted Prometheus labels, built on first use. */
+  char *metric_labels;
+  /* Rendered Prometheus samples, as of some generation. */
+  struct nanny_child_metrics *metrics;
 };
 
 /*
  * Create a new child object, set properties of the child.
  */
 struct nanny_child *nanny_child_new(const char *start);
+/*
+ * Change counters for the status pages:  one child (its state plus
+ * its logs) and all children.  Both only ever increase.
+ */
+uintmax_t nanny_child_generation(struct nanny_child *);
+uintmax_t nanny_children_generation(void);
 /* Set shell command to run at stop. */
 void nanny_child_set_stop(struct nanny_child *, const char *);
 /* Set path to log directory. */
 void nanny_child_set_logpath(struct nanny_child *, const char *);
+/* Set the rotation policy for all of the child's logs. */
+void nanny_child_set_log_rotation(struct nanny_child *, uintmax_t /*max_bytes*/,
+				  time_t /*interval*/);
+/* Timestamp each line of the child's stdout/stderr log files. */
+void nanny_child_set_log_stamps(struct nanny_child *, int);
+/* Set the in-memory history kept for each of the child's logs. */
+void nanny_child_set_log_ring(struct nanny_child *, size_t /*max_bytes*/,
+			      time_t /*idle*/);
+/* Set the compressed history kept for each of the child's logs. */
+void nanny_child_set_log_history(struct nanny_child *, size_t /*max_bytes*/);
+/* Collapse repeated lines and events in all of the child's logs. */
+void nanny_child_set_log_dedup(struct nanny_child *, int);
+/* Extract a metric from the child's "stdout" or "stderr"; -1 if invalid. */
+int nanny_child_add_metric(struct nanny_child *, const char * /*stream*/,
+			   const char * /*name*/, const char * /*kind*/,
+			   const char * /*pattern*/);
+/* Rate limit the child's stdout/stderr; see nanny_log_set_limit(). */
+void nanny_child_set_log_limit(struct nanny_child *, uintmax_t /*rate*/,
+			       uintmax_t /*burst*/, int /*ring*/,
+			       int /*sample*/);
+/* Set the durability mode for all of the child's logs. */
+int nanny_child_set_log_sync(struct nanny_child *,
+			     enum nanny_log_sync_mode, time_t /*interval*/);
+/* Set the page cache policy for all of the child's logs. */
+void nanny_child_set_log_cache(struct nanny_child *, int /*drop*/,
+			       uintmax_t /*extent*/);
 /* Set command to run for regular health checks. */
 void nanny_child_set_health(struct nanny_child *, const char *);
 /* Set true to automatically restart child. */
@@ -255,6 +472,8 @@ void nanny_oversee_children(void);
 int nanny_stop_all_children(void);
 /* Generate an HTTP page with child status information. */
 int nanny_children_http_status(struct http_request *request);
+/* Counters for all children in Prometheus text format. */
+int nanny_children_http_metrics(struct http_request *request);
 
 /*
  * Useful utility functions.
@@ -262,6 +481,8 @@ int nanny_children_http_status(struct http_request *request);
 const char *nanny_hostname(void);
 const char *nanny_username(void);
 const char *nanny_isotime(time_t);
+/* Parse epoch seconds, -<seconds ago> or YYYY-MM-DDTHH:MM:SS[Z]; 0 if bad. */
+time_t nanny_parse_time(const char *);
 
 /*
  * Counter server.
@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/uio.h>
@@ -103,11 +104,54 @@ struct timed_t {
 static struct nanny_child *live_children_oldest;
 static struct nanny_child *live_children_youngest;
 
+/*
+ * Bumped with every change to any child.  It also absorbs the log
+ * generations of children as they are freed, so that the sum in
+ * nanny_children_generation() never goes backwards.
+ */
+static uintmax_t children_generation;
+
+static void
+child_changed(struct nanny_child *child)
+{
+  ++child->generation;
+  ++children_generation;
+}
+
+static uintmax_t
+child_log_generation(struct nanny_child *child)
+{
+  return (nanny_log_generation(child->child_stdout)
+	  + nanny_log_generation(child->child_stderr)
+	  + nanny_log_generation(child->child_events));
+}
+
+uintmax_t
+nanny_child_generation(struct nanny_child *child)
+{
+  return (child->generation + child_log_generation(child));
+}
+
+uintmax_t
+nanny_children_generation(void)
+{
+  struct nanny_child *child;
+  uintmax_t generation = children_generation;
+
+  for (child = live_children_oldest; child != NULL; child = child->younger)
+    generation += child_log_generation(child);
+  return (generation);
+}
+
 static void
 child_free(struct nanny_child *child)
 {
   free(child->instance);
   child->instance = NULL;
+  free(child->metric_labels);
+  child->metric_labels = NULL;
+  free(child->metrics);
+  child->metrics = NULL;
   free(child->start_cmd);
   child->start_cmd = NULL;
   free(child->stop_cmd);
@@ -119,6 +163,7 @@ child_free(struct nanny_child *child)
   nanny_timer_delete(child->health_timer);
   child->health_timer = NULL;
 
+  children_generation += child_log_generation(child) + 1;
   nanny_log_release(child->child_stdout);
   nanny_log_release(child->child_stderr);
   nanny_log_release(child->child_events);
@@ -158,6 +203,7 @@ child_alloc(const char *start_cmd)
 
   /* 'start_cmd' may not be NULL, so don't bother checking. */
   child->start_cmd = strdup(start_cmd);
+  child_changed(child);
 
   return (child);
 }
@@ -194,24 +240,178 @@ nanny_child_set_envp(struct nanny_child *child, const char **envp)
  * Functions that generate status pages about the children.
  */
 
+/*
+ * Status pages are tagged with a generation count, so a client that
+ * already has the current one gets a 304 without our rendering it.
+ * Some fields change with time alone (the clock, throughput rates
+ * decaying after a burst, sync lag), so the tag also changes every
+ * CHILDREN_ETAG_PERIOD seconds:  a page is never staler than that.
+ */
+#define	CHILDREN_ETAG_PERIOD	5
+
+static int
+children_http_etag(struct http_request *request, uintmax_t generation)
+{
+  char etag[64];
+
+  snprintf(etag, sizeof(etag), "W/\"%d-%ju-%ld\"",
+	   nanny_globals.nanny_pid, generation,
+	   (long)(nanny_globals.now / CHILDREN_ETAG_PERIOD));
+  return (http_etag(request, etag));
+}
+
+/*
+ * With "?since=<offset>", only data that arrived after that offset is
+ * returned, preceded by headers carrying the cursor for the next poll.
+ * "?stamps=1" prefixes each line with its arrival time; "from=" and
+ * "to=" keep only lines that arrived in that range.
+ *
+ * The events log interleaves its text with event records, which have
+ * their own cursor:  "esince=" and X-Nanny-Event-Cursor.  "type=" (a
+ * comma-separated list such as "stopped,sigkill"), "from=" and "to="
+ * show only matching records; "format=json" returns them as JSON.
+ */
 static int
 nanny_children_http_child_log(struct http_request *request,
 			      struct nanny_child *child,
 			      struct nanny_log *iostore,
 			      const char *name)
 {
+  char arg[256];
+  uintmax_t since = 0, esince = 0;
+  time_t from = 0, to = 0;
+  unsigned types = 0;
+  int incremental, stamps, json = 0, events;
+
+  events = (iostore == child->child_events);
+  incremental = (http_query(request, "since", arg, sizeof(arg)) != NULL);
+  if (incremental)
+    since = strtoumax(arg, NULL, 10);
+  if (events) {
+    if (http_query(request, "esince", arg, sizeof(arg)) != NULL) {
+      esince = strtoumax(arg, NULL, 10);
+      incremental = 1;
+    } else
+      esince = nanny_log_event_oldest(iostore); /* Nothing to lose. */
+    if (http_query(request, "type", arg, sizeof(arg)) != NULL)
+      types = nanny_log_event_mask(arg);
+    if (http_query(request, "format", arg, sizeof(arg)) != NULL)
+      json = (strcmp(arg, "json") == 0);
+  }
+  /* A bare "stamps" turns them on; "0", "no" and "false" turn them off. */
+  stamps = (http_query(request, "stamps", arg, sizeof(arg)) != NULL
+	    && strcmp(arg, "0") != 0 && strcasecmp(arg, "no") != 0
+	    && strcasecmp(arg, "false") != 0);
+  if (http_query(request, "from", arg, sizeof(arg)) != NULL)
+    from = nanny_parse_time(arg);
+  if (http_query(request, "to", arg, sizeof(arg)) != NULL)
+    to = nanny_parse_time(arg);
+
+  http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+  http_printf(request, "Content-Type: %s\x0d\x0a",
+	      json ? "application/json" : "text/plain");
+  if (incremental) {
+    http_printf(request, "X-Nanny-Cursor: %ju\x0d\x0a",
+		nanny_log_cursor(iostore));
+    if (since < nanny_log_oldest(iostore))
+      http_printf(request, "X-Nanny-Lost: %ju\x0d\x0a",
+		  nanny_log_oldest(iostore) - since);
+  } else
+    since = nanny_log_oldest(iostore);
+  if (events)
+    http_printf(request, "X-Nanny-Event-Cursor: %ju\x0d\x0a",
+		nanny_log_event_cursor(iostore));
+  http_printf(request, "\x0d\x0a");
+  if (!incremental && !json)
+    http_printf(request, "# %s, child #%d, pid %d, time %s\n",
+		name, child->id, child->pid, nanny_isotime(0));
+  if (events)
+    nanny_log_http_dump_events(request, iostore, since, esince, types,
+			       from, to, json);
+  else if (stamps || from != 0 || to != 0)
+    nanny_log_http_dump_lines(request, iostore, since, from, to, stamps);
+  else if (incremental)
+    nanny_log_http_dump_since(request, iostore, since);
+  else
+    nanny_log_http_dump_raw(request, iostore);
+  return (0);
+}
+
+/*
+ * Search a log for lines containing ?q=<text>.  Optional &max=<n>
+ * limits the number of matching lines, &ms=<n> the time spent.
+ */
+static int
+nanny_children_http_child_search(struct http_request *request,
+				 struct nanny_child *child,
+				 struct nanny_log *iostore,
+				 const char *name)
+{
+  char q[256], num[32];
+  long max = 100, ms = 2000;
+
+  if (http_query(request, "q", q, sizeof(q)) == NULL || q[0] == '\0') {
+    http_printf(request, "HTTP/1.0 400 Bad Request\x0d\x0a");
+    http_printf(request, "Content-Type: text/plain\x0d\x0a");
+    http_printf(request, "\x0d\x0a");
+    http_printf(request, "Missing search text: use ?q=<text>\n");
+    return (0);
+  }
+  if (http_query(request, "max", num, sizeof(num)) != NULL)
+    max = strtol(num, NULL, 10);
+  /* Out of range clamps to the nearer limit, never the largest. */
+  if (max < 1)
+    max = 1;
+  else if (max > 10000)
+    max = 10000;
+  if (http_query(request, "ms", num, sizeof(num)) != NULL)
+    ms = strtol(num, NULL, 10);
+  if (ms < 1)
+    ms = 1;
+  else if (ms > 10000)
+    ms = 10000;
+  /* Reading old files can take a while; don't hold up the nanny. */
+  if (!http_detach(request))
+    return (0);
+
   http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
   http_printf(request, "Content-Type: text/plain\x0d\x0a");
   http_printf(request, "\x0d\x0a");
-  http_printf(request, "# %s, child #%d, pid %d, time %s\n",
+  http_printf(request, "# search %s, child #%d, pid %d, time %s\n",
 	      name, child->id, child->pid, nanny_isotime(0));
-  nanny_log_http_dump_raw(request, iostore);
+  nanny_log_http_search(request, iostore, q, max, ms);
+  return (0);
+}
+
+/*
+ * Metrics extracted from the child's output, as JSON.
+ */
+static int
+nanny_children_http_child_metrics(struct http_request *request,
+				  struct nanny_child *child)
+{
+  if (children_http_etag(request, nanny_child_generation(child)))
+    return (0);
+  http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+  http_printf(request, "Content-Type: application/json\x0d\x0a");
+  http_printf(request, "\x0d\x0a");
+  http_printf(request, "{\n \"id\": %d,\n \"stdout\": {\n", child->id);
+  nanny_log_http_dump_metrics(request, child->child_stdout, "  ");
+  http_printf(request, " },\n \"stderr\": {\n");
+  nanny_log_http_dump_metrics(request, child->child_stderr, "  ");
+  http_printf(request, " }\n}\n");
   return (0);
 }
 
 static int
 nanny_children_http_child(struct http_request *request, struct nanny_child *child)
 {
+  uintmax_t generation = nanny_child_generation(child);
+
+  /* Nothing to render if the client's copy is current. */
+  if (children_http_etag(request, generation))
+    return (0);
+
   /* Standard HTTP response header. */
   http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
   http_printf(request, "Content-Type: text/plain\x0d\x0a");
@@ -223,6 +423,7 @@ nanny_children_http_child(struct http_request *request, struct nanny_child *chil
 
   http_printf(request, "  {\n");
   http_printf(request, "   \"id\": %d,\n", child->id);
+  http_printf(request, "   \"generation\": %ju,\n", generation);
   http_printf(request, "   \"start_cmd\": \"%s\",\n", child->start_cmd);
   if (child->pid > 0)
     http_printf(request, "   \"pid\": %d,\n", child->pid);
@@ -243,7 +444,7 @@ nanny_children_http_child(struct http_request *request, struct nanny_child *chil
   http_printf(request, "   \"restartable\": %s,\n",
 	      child->restartable ? "true" : "false");
   http_printf(request, "   \"state\": \"%s\",\n", child->state);
-  http_printf(request, "   \"start_count\": %d\n", child->start_count);
+  http_printf(request, "   \"start_count\": %d,\n", child->start_count);
   if (child->last_start > 0)
     http_printf(request, "   \"last_start\": \"%s\",\n",
 		nanny_isotime(child->last_start));
@@ -258,8 +459,11 @@ nanny_children_http_child(struct http_request *request, struct nanny_child *chil
 		nanny_isotime(nanny_timer_expiration(child->health_timer)));
 
   nanny_log_http_dump_json(request, child->child_stdout, "stdout", "   ");
+  http_printf(request, ",\n");
   nanny_log_http_dump_json(request, child->child_stderr, "stderr", "   ");
+  http_printf(request, ",\n");
   nanny_log_http_dump_json(request, child->child_events, "events", "   ");
+  http_printf(request, "\n");
 
   http_printf(request, " }\n");
   http_printf(request, "}\n");
@@ -274,11 +478,18 @@ static int
 nanny_children_http(struct http_request *request, const char *prefix)
 {
   struct nanny_child *child;
+  uintmax_t generation = nanny_children_generation();
 
+  if (children_http_etag(request, generation))
+    return (0);
+  http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+  http_printf(request, "Content-Type: text/html\x0d\x0a");
+  http_printf(request, "\x0d\x0a");
   http_printf(request, "<HTML><HEAD><TITLE>All Children</TITLE></HEAD>\n");
   http_printf(request, "<BODY>\n");
   http_printf(request, "<PRE>\n");
   http_printf(request, "Current time: %s\n", nanny_isotime(0));
+  http_printf(request, "Generation: %ju\n", generation);
   http_printf(request, "<a href=\"http://%s:8123/\">Qbert</a>\n", nanny_hostname());
   http_printf(request, "\n");
   for (child = live_children_oldest; child != NULL; child = child->younger) {
@@ -317,16 +528,38 @@ nanny_children_http(struct http_request *request, const char *prefix)
   return (0);
 }
 
+/*
+ * Does the path component at 'p' match 'name'?
+ */
+static int
+detail_is(const char *p, const char *name)
+{
+  size_t len = strlen(name);
+
+  return (strncmp(p, name, len) == 0
+	  && (p[len] == '\0' || p[len] == '?'));
+}
+
 /*
  * Expects URI of form:
  *     <prefix>   - All-children summary
  *     <prefix>/<id>  - Summary for child #id
  *     <prefix>/<id>/<detail>  - detail for child #id.
+ *     <prefix>/<id>/<log>?since=<offset>  - incremental log read.
+ *     <prefix>/<id>/<log>?stamps=1&from=<time>&to=<time>  - lines with
+ *         arrival times, optionally limited to a time range.
+ *     <prefix>/<id>/events?type=<types>&format=json  - event records.
+ *     <prefix>/<id>/<log>/search?q=<text>  - search ring and rotated files.
+ *     <prefix>/<id>/<log>/files  - list the log's rotated files.
+ *     <prefix>/<id>/<log>/files/<name>  - fetch one; supports Range.
+ *     <prefix>/<id>/metrics  - values extracted from stdout/stderr.
  */
 int
 nanny_children_http_status(struct http_request *request)
 {
   struct nanny_child *child;
+  struct nanny_log *nlog = NULL;
+  const char *name = NULL;
   char prefix[64];
   char *p;
   int id;
@@ -359,22 +592,384 @@ nanny_children_http_status(struct http_request *request)
   /* We've identified a child. */
   if (*p == '\0')
     return nanny_children_http_child(request, child);
-  /* User is asking for child detail. */
+  /* User is asking for child detail; ignore any query string. */
   ++p;
-  if (strcmp(p, "stdout") == 0) {
-    return nanny_children_http_child_log(request, child,
-					 child->child_stdout, "STDOUT");
-  } else if (strcmp(p, "stderr") == 0) {
-    return nanny_children_http_child_log(request, child,
-					 child->child_stderr, "STDERR");
-  } else if (strcmp(p, "events") == 0) {
-    return nanny_children_http_child_log(request, child,
-					 child->child_events, "EVENTS");
+  if (strncmp(p, "stdout", 6) == 0) {
+    nlog = child->child_stdout;
+    name = "STDOUT";
+  } else if (strncmp(p, "stderr", 6) == 0) {
+    nlog = child->child_stderr;
+    name = "STDERR";
+  } else if (strncmp(p, "events", 6) == 0) {
+    nlog = child->child_events;
+    name = "EVENTS";
+  }
+  if (nlog != NULL) {
+    p += 6;
+    if (detail_is(p, ""))
+      return nanny_children_http_child_log(request, child, nlog, name);
+    if (detail_is(p, "/search"))
+      return nanny_children_http_child_search(request, child, nlog, name);
+    if (detail_is(p, "/files"))
+      return nanny_log_http_files(request, nlog, NULL);
+    if (strncmp(p, "/files/", 7) == 0)
+      return nanny_log_http_files(request, nlog, p + 7);
   }
+  if (detail_is(p, "metrics"))
+    return nanny_children_http_child_metrics(request, child);
   /* Didn't recognize detail request, just give child summary. */
   return nanny_children_http_child(request, child);
 }
 
+/*
+ * Prometheus metrics for all children.
+ *
+ * A family's samples must be contiguous, so the output runs over
+ * families and then children.  Each child's samples are rendered
+ * together, a run of lines per family, and kept until the child's
+ * generation moves on; a scrape re-renders only the children that
+ * changed and otherwise just copies runs, in large pieces, to
+ * http_write().  A sample is put together from the family name, the
+ * child's preformatted labels, a constant stream suffix and a
+ * hand-formatted number; no printf() per sample.  Health checks come
+ * and go with each check and are left out.
+ */
+
+struct metric_family {
+  const char *name;
+  const char *type;
+  const char *help;
+};
+
+enum child_metric {
+  CHILD_UP,
+  CHILD_STARTS,
+  CHILD_FAILURES,
+  CHILD_HEALTH_FAILURES,
+  CHILD_HEALTH_FAILURES_TOTAL,
+  CHILD_HEALTH_SUCCESSES_TOTAL,
+  CHILD_LAST_START,
+  CHILD_METRICS
+};
+
+static const struct metric_family child_families[CHILD_METRICS] = {
+  { "nanny_child_up", "gauge",
+    "Whether the child has a running process." },
+  { "nanny_child_starts_total", "counter",
+    "Times the child has been started." },
+  { "nanny_child_failures", "gauge",
+    "Consecutive runs that ended in failure." },
+  { "nanny_child_health_failures", "gauge",
+    "Consecutive failed health checks." },
+  { "nanny_child_health_failures_total", "counter",
+    "Failed health checks." },
+  { "nanny_child_health_successes_total", "counter",
+    "Successful health checks." },
+  { "nanny_child_last_start_seconds", "gauge",
+    "When the child was last started, in seconds since the epoch." },
+};
+
+/* Indexed by enum nanny_log_counter. */
+static const struct metric_family log_families[NANNY_LOG_COUNTERS] = {
+  { "nanny_log_bytes_total", "counter",
+    "Bytes of output added to the stream, after dedup and ring limiting." },
+  { "nanny_log_reads_total", "counter",
+    "Reads from the stream." },
+  { "nanny_log_errors_total", "counter",
+    "Errors reading the stream or writing its log file." },
+  { "nanny_log_suppressed_bytes_total", "counter",
+    "Bytes dropped by the rate limit." },
+  { "nanny_log_suppressed_lines_total", "counter",
+    "Lines dropped by the rate limit." },
+  { "nanny_log_repeated_lines_total", "counter",
+    "Repeated lines collapsed into a count." },
+  { "nanny_log_ring_bytes", "gauge",
+    "Memory held by the in-memory ring." },
+  { "nanny_log_forwarded_bytes_total", "counter",
+    "Bytes forwarded to the collector." },
+  { "nanny_log_forward_dropped_bytes_total", "counter",
+    "Bytes the collector could not take." },
+  { "nanny_log_archived_files_total", "counter",
+    "Rotated files compressed." },
+  { "nanny_log_deleted_files_total", "counter",
+    "Rotated files deleted by retention." },
+};
+
+/* Closes each sample's labels, with the stream for log families. */
+static const char *metric_streams[] = {
+  ",stream=\"stdout\"} ", ",stream=\"stderr\"} ", ",stream=\"events\"} "
+};
+
+#define	METRIC_FAMILIES	(CHILD_METRICS + NANNY_LOG_COUNTERS)
+
+/*
+ * Text on its way to the client, flushed when full; or, with no
+ * request, collected in memory, growing as needed.
+ */
+struct metric_buffer {
+  struct http_request *request;
+  size_t len;
+  size_t size;
+  char *buff;
+};
+
+/*
+ * A child's samples as of one generation:  each family's lines end to
+ * end, in the text that follows this header.
+ */
+struct nanny_child_metrics {
+  uintmax_t generation;
+  size_t size;			/* Of the text. */
+  size_t end[METRIC_FAMILIES];	/* Where each family's lines end. */
+};
+
+static void
+metric_flush(struct metric_buffer *mb)
+{
+  if (mb->len > 0)
+    http_write(mb->request, mb->buff, mb->len);
+  mb->len = 0;
+}
+
+/*
+ * Make room for 'n' more bytes, if the buffer can hold them at all.
+ */
+static void
+metric_reserve(struct metric_buffer *mb, size_t n)
+{
+  if (mb->len + n <= mb->size)
+    return;
+  if (mb->request != NULL) {
+    metric_flush(mb);
+    return;
+  }
+  while (mb->len + n > mb->size)
+    mb->size = (mb->size == 0) ? 16384 : 2 * mb->size;
+  if ((mb->buff = realloc(mb->buff, mb->size)) == NULL) {
+    fprintf(stderr, "Unable to allocate memory for metrics\n");
+    exit(1);
+  }
+}
+
+static void
+metric_append(struct metric_buffer *mb, const char *p, size_t n)
+{
+  metric_reserve(mb, n);
+  if (n > mb->size) {
+    http_write(mb->request, (void *)p, n);
+    return;
+  }
+  memcpy(mb->buff + mb->len, p, n);
+  mb->len += n;
+}
+
+static void
+metric_family_header(struct metric_buffer *mb,
+		     const struct metric_family *family)
+{
+  metric_append(mb, "# HELP ", 7);
+  metric_append(mb, family->name, strlen(family->name));
+  metric_append(mb, " ", 1);
+  metric_append(mb, family->help, strlen(family->help));
+  metric_append(mb, "\n# TYPE ", 8);
+  metric_append(mb, family->name, strlen(family->name));
+  metric_append(mb, " ", 1);
+  metric_append(mb, family->type, strlen(family->type));
+  metric_append(mb, "\n", 1);
+}
+
+/*
+ * One sample:  "<name>{<labels><close><value>\n", where 'close' ends
+ * the labels and is followed by the value.
+ */
+static void
+metric_sample(struct metric_buffer *mb, const char *name, size_t name_len,
+	      const char *labels, size_t labels_len,
+	      const char *close, size_t close_len, uintmax_t value)
+{
+  char digits[24], *p = digits + sizeof(digits), *q;
+  size_t n;
+
+  *--p = '\n';
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  n = name_len + 1 + labels_len + close_len + (digits + sizeof(digits) - p);
+  metric_reserve(mb, n);
+  if (n > mb->size) {
+    /* Only a very long instance name gets here. */
+    metric_append(mb, name, name_len);
+    metric_append(mb, "{", 1);
+    metric_append(mb, labels, labels_len);
+    metric_append(mb, close, close_len);
+    metric_append(mb, p, digits + sizeof(digits) - p);
+    return;
+  }
+  q = mb->buff + mb->len;
+  memcpy(q, name, name_len);
+  q += name_len;
+  *q++ = '{';
+  memcpy(q, labels, labels_len);
+  q += labels_len;
+  memcpy(q, close, close_len);
+  q += close_len;
+  memcpy(q, p, digits + sizeof(digits) - p);
+  mb->len += n;
+}
+
+/*
+ * 'id="<id>",instance="<instance>"', escaped as the format requires.
+ * Neither changes over the child's life, so it's built once.
+ */
+static const char *
+child_metric_labels(struct nanny_child *child)
+{
+  const char *s;
+  char *p;
+  size_t len;
+
+  if (child->metric_labels != NULL)
+    return (child->metric_labels);
+  len = 32;
+  if (child->instance != NULL)
+    len += 16 + 2 * strlen(child->instance);
+  if ((child->metric_labels = malloc(len)) == NULL) {
+    fprintf(stderr, "Unable to allocate memory for metric labels\n");
+    exit(1);
+  }
+  p = child->metric_labels;
+  p += sprintf(p, "id=\"%d\"", child->id);
+  if (child->instance != NULL) {
+    p += sprintf(p, ",instance=\"");
+    for (s = child->instance; *s != '\0'; s++) {
+      if (*s == '\\' || *s == '"')
+	*p++ = '\\';
+      if (*s == '\n') {
+	*p++ = '\\';
+	*p++ = 'n';
+      } else
+	*p++ = *s;
+    }
+    *p++ = '"';
+  }
+  *p = '\0';
+  return (child->metric_labels);
+}
+
+static uintmax_t
+child_metric(struct nanny_child *child, enum child_metric metric)
+{
+  switch (metric) {
+  case CHILD_UP:		return (child->pid > 0);
+  case CHILD_STARTS:		return (child->start_count);
+  case CHILD_FAILURES:		return (child->failures);
+  case CHILD_HEALTH_FAILURES:	return (child->health_failures_consecutive);
+  case CHILD_HEALTH_FAILURES_TOTAL: return (child->health_failures_total);
+  case CHILD_HEALTH_SUCCESSES_TOTAL: return (child->health_successes_total);
+  case CHILD_LAST_START:	return (child->last_start);
+  default:			return (0);
+  }
+}
+
+/*
+ * The child's samples, rendered afresh if it has changed since last
+ * time.  'scratch' is where they're put together.
+ */
+static struct nanny_child_metrics *
+child_metrics(struct nanny_child *child, struct metric_buffer *scratch)
+{
+  struct nanny_child_metrics *cm = child->metrics;
+  struct nanny_log *nlog[3];
+  uintmax_t generation = nanny_child_generation(child);
+  size_t end[METRIC_FAMILIES], labels_len, f, i, s;
+  const char *labels, *name;
+
+  if (cm != NULL && cm->generation == generation)
+    return (cm);
+  labels = child_metric_labels(child);
+  labels_len = strlen(labels);
+  scratch->len = 0;
+  for (f = 0; f < CHILD_METRICS; f++) {
+    name = child_families[f].name;
+    metric_sample(scratch, name, strlen(name), labels, labels_len,
+		  "} ", 2, child_metric(child, f));
+    end[f] = scratch->len;
+  }
+  nlog[0] = child->child_stdout;
+  nlog[1] = child->child_stderr;
+  nlog[2] = child->child_events;
+  for (i = 0; i < NANNY_LOG_COUNTERS; i++) {
+    name = log_families[i].name;
+    for (s = 0; s < 3; s++)
+      metric_sample(scratch, name, strlen(name), labels, labels_len,
+		    metric_streams[s], strlen(metric_streams[s]),
+		    nanny_log_counter(nlog[s], i));
+    end[CHILD_METRICS + i] = scratch->len;
+  }
+
+  if (cm == NULL || cm->size < scratch->len) {
+    if ((cm = realloc(cm, sizeof(*cm) + scratch->len)) == NULL) {
+      fprintf(stderr, "Unable to allocate memory for metrics\n");
+      exit(1);
+    }
+    cm->size = scratch->len;
+    child->metrics = cm;
+  }
+  cm->generation = generation;
+  memcpy(cm->end, end, sizeof(end));
+  memcpy(cm + 1, scratch->buff, scratch->len);
+  return (cm);
+}
+
+int
+nanny_children_http_metrics(struct http_request *request)
+{
+  static struct metric_buffer scratch;
+  struct nanny_child_metrics **cms;
+  struct metric_buffer mb;
+  struct nanny_child *child;
+  char buff[16384];
+  const char *text;
+  size_t n, c, f, start;
+
+  http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+  http_printf(request, "Content-Type: text/plain; version=0.0.4\x0d\x0a");
+  http_printf(request, "\x0d\x0a");
+
+  /* Bring every child up to date first, then copy out by family. */
+  n = 0;
+  for (child = live_children_oldest; child != NULL; child = child->younger)
+    if (child->main == NULL)
+      n++;
+  if ((cms = malloc((n + 1) * sizeof(*cms))) == NULL) {
+    fprintf(stderr, "Unable to allocate memory for metrics\n");
+    exit(1);
+  }
+  c = 0;
+  for (child = live_children_oldest; child != NULL; child = child->younger)
+    if (child->main == NULL)
+      cms[c++] = child_metrics(child, &scratch);
+
+  mb.request = request;
+  mb.len = 0;
+  mb.size = sizeof(buff);
+  mb.buff = buff;
+  for (f = 0; f < METRIC_FAMILIES; f++) {
+    metric_family_header(&mb, f < CHILD_METRICS ? &child_families[f]
+			 : &log_families[f - CHILD_METRICS]);
+    for (c = 0; c < n; c++) {
+      text = (const char *)(cms[c] + 1);
+      start = (f == 0) ? 0 : cms[c]->end[f - 1];
+      metric_append(&mb, text + start, cms[c]->end[f] - start);
+    }
+  }
+  metric_flush(&mb);
+  free(cms);
+  http_server_metrics(request);
+  return (0);
+}
+
 /*
  *
  * UTILITIES
@@ -508,14 +1103,12 @@ health_check_ended(struct nanny_child *check, int stat, struct rusage *rusage)
   /* Report this failure. */
   if (WIFEXITED(stat)) {
     /* Health check finished with non-zero status. */
-    nanny_log_printf(child->child_events,
-		       "%s: Health check failed with exit code %d\n",
-		       nanny_isotime(0), WEXITSTATUS(stat));
+    nanny_log_event(child->child_events, NANNY_EVENT_HEALTH_FAILED,
+		    0, WEXITSTATUS(stat), 0, NULL);
   } else if (WIFSIGNALED(stat)) {
     /* Health check failed with an error. */
-    nanny_log_printf(child->child_events,
-		     "%s: Health check exited on signal %d\n",
-		     nanny_isotime(0), WTERMSIG(stat));
+    nanny_log_event(child->child_events, NANNY_EVENT_HEALTH_FAILED,
+		    0, 0, WTERMSIG(stat), NULL);
   } else {
     /* Yuck. */
   }
@@ -524,10 +1117,8 @@ health_check_ended(struct nanny_child *check, int stat, struct rusage *rusage)
   child->health_successes_consecutive = 0;
   child->health_failures_consecutive++;
   child->health_failures_total++;
-  nanny_log_printf(child->child_events,
-		     "%s: %d consecutive failures\n",
-		     nanny_isotime(0),
-		     child->health_failures_consecutive);
+  nanny_log_event(child->child_events, NANNY_EVENT_HEALTH_FAILURES,
+		  0, child->health_failures_consecutive, 0, NULL);
   if (child->health_failures_consecutive > 4) {
     /* Force a restart. */
     child->state_handler = main_child_goal_restart;
@@ -548,6 +1139,7 @@ health_check_goal(void *_check, time_t now)
   struct nanny_child *check = _check;
   struct nanny_child *child = check->main;
   check->state_timer = NULL;
+  child_changed(check);
 
   /*
    * The health check is either "NEW" or "STARTING."  If it's "NEW",
@@ -559,9 +1151,8 @@ health_check_goal(void *_check, time_t now)
     check->pid = run(check->pid, check->envp,
 		     check->child_stdout, check->child_stderr,
 		     check->start_cmd);
-    nanny_log_printf(child->child_events,
-		       "%s: Started health check, pid=%d\n",
-		       nanny_isotime(0), check->pid);
+    nanny_log_event(child->child_events, NANNY_EVENT_HEALTH_START,
+		    check->pid, 0, 0, NULL);
     check->ended = health_check_ended;
     check->running = 1;
     check->last_start = now;
@@ -570,9 +1161,8 @@ health_check_goal(void *_check, time_t now)
 				   check->state_handler, check);
     return;
   } else {
-    nanny_log_printf(child->child_events,
-		       "%s: Killing health check, pid=%d\n",
-		       nanny_isotime(0), check->pid);
+    nanny_log_event(child->child_events, NANNY_EVENT_HEALTH_KILL,
+		    check->pid, 0, 0, NULL);
     kill(check->pid, SIGKILL); /* Just kill it. */
     return;
   }
@@ -628,18 +1218,16 @@ main_child_ended(struct nanny_child *child, int stat, struct rusage *rusage)
 		 child->id, pid, status,
 		 child->instance != NULL ? child->instance : "",
 		 child->start_cmd);
-    nanny_log_printf(child->child_events,
-		       "%s: STOPPED\tPID=%d\tSTATUS=%d\n",
-		       nanny_isotime(0), pid, status);
+    nanny_log_event(child->child_events, NANNY_EVENT_STOPPED,
+		    pid, status, 0, NULL);
   } else if (WIFSIGNALED(stat)) {
     int sig = WTERMSIG(stat);
     udp_announce("STOPPED\tID=%d\tPID=%d\tSIGNAL=%d\tINSTANCE=%s\tCMD=%s",
 		 child->id, pid, sig,
 		 child->instance != NULL ? child->instance : "",
 		 child->start_cmd);
-    nanny_log_printf(child->child_events,
-		       "%s: STOPPED\tPID=%d\tSIGNAL=%d\n",
-		       nanny_isotime(0), pid, sig);
+    nanny_log_event(child->child_events, NANNY_EVENT_STOPPED,
+		    pid, 0, sig, NULL);
   } else {
     /* TODO: Huh?  The child doesn't have an exit status and didn't
      * die from a signal.  I think the only other option is "stopped",
@@ -656,6 +1244,7 @@ main_child_health_check(void *_child, time_t now)
 
   /* Erase the fired timer. */
   child->health_timer = NULL;
+  child_changed(child);
   if (child->health_cmd == NULL) {
     /* Nonexistent health check always succeeds. */
     ++child->health_successes_total;
@@ -692,6 +1281,7 @@ main_child_goal_running(void *_child, time_t now)
 
   /* Forget the timer that started us. */
   child->state_timer = NULL;
+  child_changed(child);
 
   /*
    * Trying to start the process.
@@ -727,12 +1317,10 @@ main_child_goal_running(void *_child, time_t now)
 		 child->state == NEW ? "STARTING" : "RESTARTING",
 		 child->pid,
 		 child->start_cmd);
-    nanny_log_printf(child->child_events,
-		       "%s: %s\tPID=%d\tCMD=%s\n",
-		       nanny_isotime(0),
-		       child->state == NEW ? "STARTING" : "RESTARTING",
-		       child->pid,
-		       child->start_cmd);
+    nanny_log_event(child->child_events,
+		    child->state == NEW
+		    ? NANNY_EVENT_STARTING : NANNY_EVENT_RESTARTING,
+		    child->pid, 0, 0, child->start_cmd);
 
     child->state = STARTING; /* Child is on probation. */
     child->state_timer = nanny_timer_add(now + HEALTH_PERIOD * 5,
@@ -768,6 +1356,7 @@ main_child_goal_stopped(void *_child, time_t now)
 {
   struct nanny_child *child = _child;
   child->state_timer = NULL;
+  child_changed(child);
 
   printf("main_child_goal_stopped\n");
 
@@ -791,9 +1380,8 @@ main_child_goal_stopped(void *_child, time_t now)
   if (child->state == STOPPING1) {
     child->state = STOPPING2;
     kill(child->pid, SIGTERM);
-    nanny_log_printf(child->child_events,
-		       "%s: SENDING SIGTERM to PID=%d\n",
-		       nanny_isotime(0), child->pid);
+    nanny_log_event(child->child_events, NANNY_EVENT_SIGTERM,
+		    child->pid, 0, SIGTERM, NULL);
     child->state_timer = nanny_timer_add(now + 15, child->state_handler, child);
     return;
   }
@@ -802,9 +1390,8 @@ main_child_goal_stopped(void *_child, time_t now)
   if (child->state == STOPPING2) {
     child->state = STOPPING3;
     kill(child->pid, SIGKILL);
-    nanny_log_printf(child->child_events,
-		       "%s: SENDING SIGKILL to PID=%d\n",
-		       nanny_isotime(0), child->pid);
+    nanny_log_event(child->child_events, NANNY_EVENT_SIGKILL,
+		    child->pid, 0, SIGKILL, NULL);
     child->state_timer = nanny_timer_add(now + 15, child->state_handler, child);
     return;
   }
@@ -815,12 +1402,10 @@ main_child_goal_stopped(void *_child, time_t now)
 		 child->pid, child->instance, child->start_cmd);
     /* TODO: Log this. */
     kill(child->pid, SIGKILL); /* Send one last shot. */
-    nanny_log_printf(child->child_events,
-		       "%s: SENDING SIGKILL to PID=%d\n",
-		       nanny_isotime(0), child->pid);
-    nanny_log_printf(child->child_events,
-		       "%s: GIVING UP ON PID=%d\n",
-		       nanny_isotime(0), child->pid);
+    nanny_log_event(child->child_events, NANNY_EVENT_SIGKILL,
+		    child->pid, 0, SIGKILL, NULL);
+    nanny_log_event(child->child_events, NANNY_EVENT_GIVING_UP,
+		    child->pid, 0, 0, NULL);
     child->state = STOPPED;  /* Pretend it succeeded. */
     child->pid = 0;
     return;
@@ -844,18 +1429,16 @@ main_child_goal_stopped(void *_child, time_t now)
     run(0, child->envp, child->child_events, child->child_events,
 	child->stop_cmd);
     /* Report that we're stopping it. */
-    nanny_log_printf(child->child_events,
-		       "%s: STOPPING\tPID=%d\tCMD=%s\n",
-		       nanny_isotime(0), child->pid, child->stop_cmd);
+    nanny_log_event(child->child_events, NANNY_EVENT_STOPPING,
+		    child->pid, 0, 0, child->stop_cmd);
     child->state = STOPPING1;
   } else {
     /* If there's no custom script, use SIGTERM. */
     child->state = STOPPING2;
     kill(child->pid, SIGTERM);
     /* Report that we're stopping it. */
-    nanny_log_printf(child->child_events,
-		       "%s: STOPPING\tPID=%d\tSIGNAL=%d\n",
-		       nanny_isotime(0), child->pid, SIGTERM);
+    nanny_log_event(child->child_events, NANNY_EVENT_STOPPING,
+		    child->pid, 0, SIGTERM, NULL);
   }
   /* Give the child a generous amount of time to shutdown. */
   /* TODO: Make this probation period customizable. */
@@ -873,6 +1456,7 @@ main_child_goal_restart(void *_child, time_t now)
 {
   struct nanny_child *child = _child;
 
+  child_changed(child);
   if (child->state == STOPPED) {
     child->state = RESTARTING;
     child->state_handler = main_child_goal_running;
@@ -912,6 +1496,11 @@ nanny_child_new(const char *start_cmd)
   child->child_stdout = nanny_log_alloc(65536);
   child->child_stderr = nanny_log_alloc(65536);
   child->child_events = nanny_log_alloc(65536);
+  nanny_log_set_notify(child->child_stdout, child->child_events, "STDOUT");
+  nanny_log_set_notify(child->child_stderr, child->child_events, "STDERR");
+  nanny_log_set_forward(child->child_stdout, child->id, "stdout");
+  nanny_log_set_forward(child->child_stderr, child->id, "stderr");
+  nanny_log_set_forward(child->child_events, child->id, "events");
 
   return (child);
 }
@@ -924,6 +1513,87 @@ nanny_child_set_logpath(struct nanny_child *child, const char *path)
   nanny_log_set_filename(child->child_events, "%s/nanny_event.log", path);
 }
 
+void
+nanny_child_set_log_stamps(struct nanny_child *child, int enable)
+{
+  nanny_log_set_file_stamps(child->child_stdout, enable);
+  nanny_log_set_file_stamps(child->child_stderr, enable);
+}
+
+void
+nanny_child_set_log_ring(struct nanny_child *child, size_t max_bytes,
+			 time_t idle)
+{
+  nanny_log_set_ring(child->child_stdout, max_bytes, idle);
+  nanny_log_set_ring(child->child_stderr, max_bytes, idle);
+  nanny_log_set_ring(child->child_events, max_bytes, idle);
+}
+
+void
+nanny_child_set_log_history(struct nanny_child *child, size_t max_bytes)
+{
+  nanny_log_set_history(child->child_stdout, max_bytes);
+  nanny_log_set_history(child->child_stderr, max_bytes);
+  nanny_log_set_history(child->child_events, max_bytes);
+}
+
+void
+nanny_child_set_log_dedup(struct nanny_child *child, int enable)
+{
+  nanny_log_set_dedup(child->child_stdout, enable);
+  nanny_log_set_dedup(child->child_stderr, enable);
+  nanny_log_set_dedup(child->child_events, enable);
+}
+
+int
+nanny_child_add_metric(struct nanny_child *child, const char *stream,
+		       const char *name, const char *kind,
+		       const char *pattern)
+{
+  if (strcmp(stream, "stdout") == 0)
+    return (nanny_log_add_metric(child->child_stdout, name, kind, pattern));
+  if (strcmp(stream, "stderr") == 0)
+    return (nanny_log_add_metric(child->child_stderr, name, kind, pattern));
+  return (-1);
+}
+
+void
+nanny_child_set_log_limit(struct nanny_child *child, uintmax_t rate,
+			  uintmax_t burst, int ring, int sample)
+{
+  nanny_log_set_limit(child->child_stdout, rate, burst, ring, sample);
+  nanny_log_set_limit(child->child_stderr, rate, burst, ring, sample);
+}
+
+int
+nanny_child_set_log_sync(struct nanny_child *child,
+			 enum nanny_log_sync_mode mode, time_t interval)
+{
+  if (nanny_log_set_sync(child->child_stdout, mode, interval) < 0)
+    return (-1);
+  nanny_log_set_sync(child->child_stderr, mode, interval);
+  nanny_log_set_sync(child->child_events, mode, interval);
+  return (0);
+}
+
+void
+nanny_child_set_log_cache(struct nanny_child *child, int drop,
+			  uintmax_t extent)
+{
+  nanny_log_set_cache(child->child_stdout, drop, extent);
+  nanny_log_set_cache(child->child_stderr, drop, extent);
+  nanny_log_set_cache(child->child_events, drop, extent);
+}
+
+void
+nanny_child_set_log_rotation(struct nanny_child *child, uintmax_t max_bytes,
+			     time_t interval)
+{
+  nanny_log_set_rotation(child->child_stdout, max_bytes, interval);
+  nanny_log_set_rotation(child->child_stderr, max_bytes, interval);
+  nanny_log_set_rotation(child->child_events, max_bytes, interval);
+}
+
 void
 nanny_oversee_children(void)
 {
@@ -943,6 +1613,9 @@ nanny_oversee_children(void)
     while (child != NULL) {
       next = child->younger;
       if (child->pid == pid) {
+	child_changed(child);
+	if (child->main != NULL)
+	  child_changed(child->main);
 	if (child->ended != NULL)
 	  (child->ended)(child, stat, &rusage);
 	break;
@@ -986,6 +1659,7 @@ nanny_stop_all_children(void)
     nanny_timer_delete(child->health_timer);
     child->health_timer = NULL;
     /* Switch this child to the "stopping" state machine. */
+    child_changed(child);
     child->state_handler = main_child_goal_stopped;
     child->state_timer = nanny_timer_add(0, child->state_handler, child);
   }
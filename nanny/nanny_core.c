@@ -47,29 +47,45 @@
  */
 struct nanny_globals_t nanny_globals;
 
-struct {
+struct nanny_server_slot {
   int socket;
   void (*handler)(void *);
   void *data;
-} listener[512];
+};
+
+static struct nanny_server_slot listener[512];
+/* Handlers waiting for a socket to become writable. */
+static struct nanny_server_slot writer[512];
+
+#define	NSLOTS	(sizeof(listener)/sizeof(listener[0]))
+
+static int
+nanny_select_fill(struct nanny_server_slot *slot, fd_set *fds, int limit)
+{
+  size_t i;
+
+  FD_ZERO(fds);
+  for (i = 0; i < NSLOTS; ++i) {
+    if (slot[i].socket > 0) {
+      FD_SET(slot[i].socket, fds);
+      if (slot[i].socket >= limit)
+	limit = slot[i].socket + 1;
+    }
+  }
+  return (limit);
+}
 
 void
 nanny_select(struct timeval *tv)
 {
-  fd_set readfds;
-  int limit = 0;
+  fd_set readfds, writefds;
+  int limit;
   int r;
   size_t i;
 
-  FD_ZERO(&readfds);
-  for (i = 0; i < sizeof(listener)/sizeof(listener[0]); ++i) {
-    if (listener[i].socket > 0) {
-      FD_SET(listener[i].socket, &readfds);
-      if (listener[i].socket > limit)
-	limit = listener[i].socket + 1;
-    }
-  }
-  r = select(limit, &readfds, NULL, NULL, tv);
+  limit = nanny_select_fill(listener, &readfds, 0);
+  limit = nanny_select_fill(writer, &writefds, limit);
+  r = select(limit, &readfds, &writefds, NULL, tv);
   nanny_globals.now = time(NULL);
 
   if (r < 0) {
@@ -80,53 +96,91 @@ nanny_select(struct timeval *tv)
   if (r == 0)
     return;
 
-  for (i = 0; i < sizeof(listener)/sizeof(listener[0]); ++i) {
+  /*
+   * A handler may unregister other sockets (closing an HTTP
+   * connection drops both its reader and writer), so re-check the
+   * slot before each call.
+   */
+  for (i = 0; i < NSLOTS; ++i) {
+    if (writer[i].socket > 0
+	&& FD_ISSET(writer[i].socket, &writefds)) {
+      FD_CLR(writer[i].socket, &writefds);
+      writer[i].handler(writer[i].data);
+    }
+  }
+  for (i = 0; i < NSLOTS; ++i) {
     if (listener[i].socket > 0
 	&& FD_ISSET(listener[i].socket, &readfds)) {
       /* printf("Data ready on fd %d\n", listener[i].socket); */
+      FD_CLR(listener[i].socket, &readfds);
       listener[i].handler(listener[i].data);
     }
   }
 }
 
-void
-nanny_unregister_server(int fd)
+static void
+nanny_slot_clear(struct nanny_server_slot *slot, int fd)
 {
   size_t i;
 
-  for (i = 0; i < sizeof(listener)/sizeof(listener[0]); ++i) {
-    if (listener[i].socket == fd) {
-      listener[i].handler = NULL;
-      listener[i].data = NULL;
-      listener[i].socket = 0;
+  for (i = 0; i < NSLOTS; ++i) {
+    if (slot[i].socket == fd) {
+      slot[i].handler = NULL;
+      slot[i].data = NULL;
+      slot[i].socket = 0;
     }
   }
 }
 
-void
-nanny_register_server(void (*handler)(void *), int s, void *data)
+static void
+nanny_slot_set(struct nanny_server_slot *slot, void (*handler)(void *),
+	       int s, void *data)
 {
   size_t i;
-  for (i = 0; i < sizeof(listener)/sizeof(listener[0]); ++i) {
-    if (listener[i].socket == s) {
+  for (i = 0; i < NSLOTS; ++i) {
+    if (slot[i].socket == s) {
       fprintf(stderr, "INTERNAL ERROR: Re-registering server on fd %d\n", s);
-      listener[i].handler = NULL;
-      listener[i].data = NULL;
-      listener[i].socket = 0;
+      slot[i].handler = NULL;
+      slot[i].data = NULL;
+      slot[i].socket = 0;
       break;
     }
   }
-  for (i = 0; i < sizeof(listener)/sizeof(listener[0]); ++i) {
-    if (listener[i].handler == NULL) {
-      listener[i].handler = handler;
-      listener[i].socket = s;
-      listener[i].data = data;
+  for (i = 0; i < NSLOTS; ++i) {
+    if (slot[i].handler == NULL) {
+      slot[i].handler = handler;
+      slot[i].socket = s;
+      slot[i].data = data;
       return;
     }
   }
   fprintf(stderr, "INTERNAL ERROR: Ran out of slots for fd handlers.\n");
 }
 
+void
+nanny_unregister_server(int fd)
+{
+  nanny_slot_clear(listener, fd);
+}
+
+void
+nanny_register_server(void (*handler)(void *), int s, void *data)
+{
+  nanny_slot_set(listener, handler, s, data);
+}
+
+void
+nanny_unregister_writer(int fd)
+{
+  nanny_slot_clear(writer, fd);
+}
+
+void
+nanny_register_writer(void (*handler)(void *), int s, void *data)
+{
+  nanny_slot_set(writer, handler, s, data);
+}
+
 
 /*
  * Copied and mangled from several examples.
@@ -25,33 +25,52 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE /* strcasestr() */
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "nanny.h"
+#include "nanny_timer.h"
 
 /*
- * A very basic forking web server.
+ * A very basic web server.
  *
- * The forking design here is a very deliberate design choice that
- * emphasizes simplicity and robustness over performance.  (Although
- * the performance may be better than you expect!)
+ * Originally this forked for every connection, a very deliberate
+ * design choice that emphasizes simplicity and robustness over
+ * performance.  But a fork copies the page tables of the whole nanny,
+ * log rings included, and monitoring scrapes /status often.  So by
+ * default connections are now served from the main select() loop:
+ * each one reads until it has a complete request header, then the
+ * response is generated directly from live state into a memory
+ * buffer, which is written out as the socket accepts it.  Nothing
+ * blocks, so a slow client can't stall the children.
+ *
+ * The forking mode is still available with http_server_set_forking(),
+ * and is used anyway if we run out of connection slots.
  */
 
 /*
  * The server has three layers:  a listening "server," client "connections,"
- * and "requests" on those connections.  The server forks for each connection.
+ * and "requests" on those connections.
  */
 
 /* A server is just a listening TCP socket and a connection dispatcher. */
@@ -61,6 +80,51 @@ struct http_server {
   void (*dispatcher)(struct http_request *);
 };
 
+/*
+ * A response is collected in memory until the handler returns, so
+ * that we can supply a Content-Length and hand it to the kernel with
+ * a few writev() calls.  The header and body are kept apart so the
+ * Content-Length can be added without moving the body.
+ */
+struct http_response {
+  struct http_response *next;
+  int state;
+#define	HTTP_RESPONSE_HEAD	0	/* Still collecting header lines. */
+#define	HTTP_RESPONSE_BODY	1	/* Header complete, collecting body. */
+#define	HTTP_RESPONSE_RAW	2	/* No HTTP header; just bytes. */
+  char *head;
+  size_t head_len;
+  size_t head_size;
+  char *body;
+  size_t body_len;
+  size_t body_size;
+  /* Bytes of head+body already sent. */
+  size_t sent;
+
+  /*
+   * Compression.  Once the body passes HTTP_COMPRESS_CHUNK it is
+   * deflated into 'zbody' a chunk at a time, and 'body' only stages
+   * the next chunk.
+   */
+  int encoding;
+#define	HTTP_ENCODING_NONE	0
+#define	HTTP_ENCODING_GZIP	1
+#define	HTTP_ENCODING_DEFLATE	2
+  z_stream *zs;
+  char *zbody;
+  size_t zbody_len;
+  size_t zbody_size;
+  size_t raw_len;	/* Uncompressed body size. */
+
+  /* Entity tag, added to the header when the handler is done. */
+  char etag[64];
+
+  /* A file to send after the body, straight from the page cache. */
+  int file_fd;
+  off_t file_offset;
+  size_t file_len;
+};
+
 /*
  * A "connection" is a socket with some I/O buffering machinery and a
  * small amount of other connection-level state.
@@ -76,8 +140,58 @@ struct http_connection {
   /* The start and end of live data within the input buffer. */
   char *start;
   char *end;
+
+  /* Responses waiting to be sent; the last is being generated. */
+  struct http_response *responses;
+  struct http_response *response;
+
+  /* Everything below is only used by event-driven connections. */
+  struct http_server *server;
+  int nonblocking;
+  int reading;		/* Registered for read events. */
+  int writing;		/* Registered for write events. */
+  int eof;		/* Client has finished sending. */
+  int detached;		/* See http_detach(). */
+  int requests;		/* Requests answered so far. */
+  /* Idle connections are dropped. */
+  struct timer *timer;
+  time_t last_active;
 };
 
+#define	HTTP_DETACHED_CHILD	1
+#define	HTTP_DETACHED_PARENT	2
+
+/* Event-driven connections beyond this many are forked instead. */
+#define	HTTP_MAX_CONNECTIONS	64
+/* Seconds a connection may sit without making progress. */
+#define	HTTP_IDLE_TIMEOUT	30
+
+/* Bodies smaller than this are sent as-is. */
+#define	HTTP_COMPRESS_MIN	1024
+/* How much body to stage between calls to deflate(). */
+#define	HTTP_COMPRESS_CHUNK	16384
+
+static int http_forking = 0;
+static int http_connections = 0;
+static int http_compress_level = Z_BEST_SPEED;
+
+/*
+ * Server counters.  These live in a shared mapping so that forked
+ * connections can update them too.
+ */
+static struct http_stats {
+  uintmax_t connections;
+  uintmax_t forked;
+  uintmax_t requests;
+  uintmax_t compressed;
+  uintmax_t compress_bytes_in;
+  uintmax_t compress_bytes_out;
+  uintmax_t compress_cpu_usec;
+} *http_stats, http_stats_private;
+
+#define	HTTP_STAT_ADD(field, n)	\
+  __sync_fetch_and_add(&http_stats->field, (uintmax_t)(n))
+
 /*
  * Custom character classification bitmap:
  *   0x10 = character allowed in URI
@@ -90,7 +204,7 @@ static const char uri_map[] = {
   0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
   0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00, /* 10-1F */
   0x00, 0x00, 0x00, 0x00,  0x00, 0x00, 0x00, 0x00,
-  0x00, 0x10, 0x00, 0x00,  0x10, 0x00, 0x10, 0x10, /* 20-2F */
+  0x00, 0x10, 0x00, 0x00,  0x10, 0x10, 0x10, 0x10, /* 20-2F */
   0x10, 0x10, 0x00, 0x10,  0x10, 0x50, 0x50, 0x10,
   0x70, 0x71, 0x72, 0x73,  0x74, 0x75, 0x76, 0x77, /* 30-3F */
   0x78, 0x79, 0x10, 0x10,  0x00, 0x10, 0x00, 0x10,
@@ -107,23 +221,633 @@ static const char uri_map[] = {
 /* Is character allowed in a URI? */
 #define uri_okay(c)	(c > 0 && c < 127 && (uri_map[(int)c] & 0x10))
 
+static int body404(struct http_request *);
+
+/* Make room for 'n' more bytes in a response buffer. */
+static char *
+http_response_reserve(char **buff, size_t *size, size_t len, size_t n)
+{
+  size_t newsize;
+  char *p;
+
+  if (len + n > *size) {
+    newsize = *size < 1024 ? 1024 : *size;
+    while (newsize < len + n)
+      newsize *= 2;
+    if ((p = realloc(*buff, newsize)) == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+    *buff = p;
+    *size = newsize;
+  }
+  return (*buff + len);
+}
+
+static struct http_response *
+http_response_new(struct http_connection *connection)
+{
+  struct http_response *response, **pp;
+
+  if ((response = malloc(sizeof(*response))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(response, 0, sizeof(*response));
+  response->file_fd = -1;
+  for (pp = &connection->responses; *pp != NULL; pp = &(*pp)->next)
+    ;
+  *pp = response;
+  connection->response = response;
+  return (response);
+}
+
+static void
+http_response_free(struct http_response *response)
+{
+  if (response->zs != NULL) {
+    deflateEnd(response->zs);
+    free(response->zs);
+  }
+  free(response->head);
+  free(response->body);
+  free(response->zbody);
+  if (response->file_fd >= 0)
+    close(response->file_fd);
+  free(response);
+}
+
+static uintmax_t
+http_cpu_usec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ((uintmax_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Deflate the staged body onto 'zbody', starting the stream if
+ * needed.  With Z_FINISH this completes the compressed body.
+ */
+static void
+http_response_deflate(struct http_response *response, int flush)
+{
+  z_stream *zs = response->zs;
+  uintmax_t start = http_cpu_usec();
+  size_t avail;
+  int r;
+
+  if (zs == NULL) {
+    if ((zs = malloc(sizeof(*zs))) == NULL) {
+      perror("malloc");
+      exit(1);
+    }
+    memset(zs, 0, sizeof(*zs));
+    /* Adding 16 to the window bits selects a gzip wrapper. */
+    if (deflateInit2(zs, http_compress_level, Z_DEFLATED,
+		     response->encoding == HTTP_ENCODING_GZIP ? 15 + 16 : 15,
+		     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      fprintf(stderr, "deflateInit2 failed\n");
+      free(zs);
+      response->encoding = HTTP_ENCODING_NONE;
+      return;
+    }
+    response->zs = zs;
+  }
+
+  response->raw_len += response->body_len;
+  zs->next_in = (Bytef *)response->body;
+  zs->avail_in = response->body_len;
+  do {
+    http_response_reserve(&response->zbody, &response->zbody_size,
+			  response->zbody_len, 4096);
+    avail = response->zbody_size - response->zbody_len;
+    zs->next_out = (Bytef *)response->zbody + response->zbody_len;
+    zs->avail_out = avail;
+    r = deflate(zs, flush);
+    response->zbody_len += avail - zs->avail_out;
+  } while (zs->avail_out == 0 || (flush == Z_FINISH && r == Z_OK));
+  response->body_len = 0;
+  HTTP_STAT_ADD(compress_cpu_usec, http_cpu_usec() - start);
+}
+
+/* Compress the body as it grows, so big responses never sit in memory. */
+#define	http_response_stream(response)				\
+  do {								\
+    if ((response)->encoding != HTTP_ENCODING_NONE		\
+	&& (response)->state == HTTP_RESPONSE_BODY		\
+	&& (response)->body_len >= HTTP_COMPRESS_CHUNK)		\
+      http_response_deflate((response), Z_NO_FLUSH);		\
+  } while (0)
+
+/* Does the response header already include 'name'? */
+static int
+http_response_has(struct http_response *response, const char *name)
+{
+  size_t i, n = strlen(name);
+
+  for (i = 0; i + n < response->head_len; ++i) {
+    if (response->head[i] == '\x0a'
+	&& strncasecmp(response->head + i + 1, name, n) == 0)
+      return (1);
+  }
+  return (0);
+}
+
 ssize_t
-http_write(struct http_request *request, void *buff, size_t s)
+http_write(struct http_request *request, void *_buff, size_t s)
 {
-  return write(request->connection->sock, buff, s);
+  struct http_response *response = request->connection->response;
+  const char *buff = _buff;
+  size_t i, scan, len = s;
+
+  if (response->state == HTTP_RESPONSE_HEAD) {
+    /* Handlers that don't send a status line get their bytes as-is. */
+    if (response->head_len == 0 && s > 0
+	&& (s < 5 || memcmp(buff, "HTTP/", 5) != 0))
+      response->state = HTTP_RESPONSE_RAW;
+    else {
+      memcpy(http_response_reserve(&response->head, &response->head_size,
+				   response->head_len, s), buff, s);
+      scan = response->head_len < 3 ? 0 : response->head_len - 3;
+      response->head_len += s;
+      /* Anything past the blank line belongs to the body. */
+      for (i = scan; i + 4 <= response->head_len; ++i) {
+	if (memcmp(response->head + i, "\x0d\x0a\x0d\x0a", 4) == 0) {
+	  response->state = HTTP_RESPONSE_BODY;
+	  /* Never re-encode what the handler already encoded. */
+	  if (http_response_has(response, "Content-Encoding:"))
+	    response->encoding = HTTP_ENCODING_NONE;
+	  buff = response->head + i + 4;
+	  s = response->head_len - (i + 4);
+	  response->head_len = i + 4;
+	  break;
+	}
+      }
+      if (response->state == HTTP_RESPONSE_HEAD)
+	return (len);
+    }
+  }
+  memcpy(http_response_reserve(&response->body, &response->body_size,
+			       response->body_len, s), buff, s);
+  response->body_len += s;
+  http_response_stream(response);
+  return (len);	/* All of it, however it was split. */
 }
 
 void
 http_printf(struct http_request *request, const char *fmt, ...)
 {
+  struct http_response *response = request->connection->response;
   char msg[8192];
+  char *p;
+  size_t avail;
+  va_list ap, aq;
+  int n;
+
+  va_start(ap, fmt);
+  if (response->state == HTTP_RESPONSE_HEAD) {
+    /* The header goes through http_write(), which splits it. */
+    n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(msg))
+      n = sizeof(msg) - 1;
+    if (n > 0)
+      http_write(request, msg, n);
+    return;
+  }
+
+  /* Format straight into the body. */
+  p = http_response_reserve(&response->body, &response->body_size,
+			    response->body_len, 256);
+  avail = response->body_size - response->body_len;
+  va_copy(aq, ap);
+  n = vsnprintf(p, avail, fmt, ap);
+  va_end(ap);
+  if (n >= 0 && (size_t)n >= avail) {
+    p = http_response_reserve(&response->body, &response->body_size,
+			      response->body_len, n + 1);
+    vsnprintf(p, n + 1, fmt, aq);
+  }
+  va_end(aq);
+  if (n > 0)
+    response->body_len += n;
+  http_response_stream(response);
+}
+
+
+/* Add a header line just before the blank line ending the header. */
+static void
+http_response_add(struct http_response *response, const char *fmt, ...)
+{
+  char line[128];
+  char *p;
   va_list ap;
+  int n;
 
   va_start(ap, fmt);
-  vsnprintf(msg, sizeof(msg), fmt, ap);
+  n = vsnprintf(line, sizeof(line) - 4, fmt, ap);
   va_end(ap);
+  if (n < 0 || n >= (int)sizeof(line) - 4)
+    return;
+  memcpy(line + n, "\x0d\x0a\x0d\x0a", 4);
+  n += 4;
+  /* Overwrite the blank line, then add a new one. */
+  p = http_response_reserve(&response->head, &response->head_size,
+			    response->head_len - 2, n);
+  memcpy(p, line, n);
+  response->head_len += n - 2;
+}
+
+/*
+ * The handler is done: add a Content-Length unless it set its own,
+ * match the protocol version to the request, and say whether the
+ * connection will stay open.  A response we can't delimit always
+ * ends the connection.
+ */
+static void
+http_response_finish(struct http_request *request,
+		     struct http_response *response)
+{
+  struct http_connection *connection = request->connection;
+  int http11 = request->HTTPmajor > 1
+    || (request->HTTPmajor == 1 && request->HTTPminor >= 1);
+
+  if (response->state != HTTP_RESPONSE_BODY) {
+    connection->keepalive = 0;
+    return;
+  }
+  /* Files go out as they are on disk. */
+  if (response->file_fd >= 0)
+    response->encoding = HTTP_ENCODING_NONE;
+  if (response->encoding != HTTP_ENCODING_NONE
+      && (response->zs != NULL || response->body_len >= HTTP_COMPRESS_MIN)) {
+    http_response_deflate(response, Z_FINISH);
+    if (response->zs != NULL) {
+      /* The compressed body replaces the staging buffer. */
+      free(response->body);
+      response->body = response->zbody;
+      response->body_len = response->zbody_len;
+      response->body_size = response->zbody_size;
+      response->zbody = NULL;
+      response->zbody_len = response->zbody_size = 0;
+      http_response_add(response, "Content-Encoding: %s",
+	  response->encoding == HTTP_ENCODING_GZIP ? "gzip" : "deflate");
+      HTTP_STAT_ADD(compressed, 1);
+      HTTP_STAT_ADD(compress_bytes_in, response->raw_len);
+      HTTP_STAT_ADD(compress_bytes_out, response->body_len);
+    }
+  }
+  if (response->encoding != HTTP_ENCODING_NONE)
+    http_response_add(response, "Vary: Accept-Encoding");
+  if (response->etag[0] != '\0' && !http_response_has(response, "ETag:"))
+    http_response_add(response, "ETag: %s", response->etag);
+  /* A 304 has no body, and mustn't claim an empty one. */
+  if (!http_response_has(response, "Content-Length:")
+      && !(response->head_len > 12 && memcmp(response->head + 8, " 304", 4) == 0))
+    http_response_add(response, "Content-Length: %zu",
+		      response->body_len + response->file_len);
+  if (http11 && memcmp(response->head, "HTTP/1.0 ", 9) == 0)
+    response->head[7] = '1';
+  if (http_response_has(response, "Connection:"))
+    return;
+  if (connection->keepalive && !http11)
+    http_response_add(response, "Connection: keep-alive");
+  else if (!connection->keepalive && http11)
+    http_response_add(response, "Connection: close");
+}
+
+const char *
+http_date(time_t t)
+{
+  static char buff[64];
+
+  strftime(buff, sizeof(buff), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+  return (buff);
+}
 
-  http_write(request, msg, strlen(msg));
+/* Returns 0 if the date can't be parsed. */
+time_t
+http_parse_date(const char *s)
+{
+  struct tm tm;
+
+  memset(&tm, 0, sizeof(tm));
+  if (strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL)
+    return (0);
+  return (timegm(&tm));
+}
+
+int
+http_sendfile(struct http_request *request, int fd, off_t offset, size_t len)
+{
+  struct http_response *response = request->connection->response;
+
+  /* The file must follow a complete header, and only one per response. */
+  if (response->state != HTTP_RESPONSE_BODY || response->file_fd >= 0) {
+    close(fd);
+    return (-1);
+  }
+  response->file_fd = fd;
+  response->file_offset = offset;
+  response->file_len = len;
+  return (0);
+}
+
+/*
+ * Does an If-None-Match list include 'etag'?  Comparison is weak:
+ * a W/ prefix on either side is ignored.
+ */
+static int
+http_etag_match(const char *list, const char *etag)
+{
+  const char *p;
+  size_t len;
+
+  if (strncmp(etag, "W/", 2) == 0)
+    etag += 2;
+  len = strlen(etag);
+  for (p = list; *p != '\0'; ) {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      ++p;
+    if (*p == '*')
+      return (1);
+    if (strncmp(p, "W/", 2) == 0)
+      p += 2;
+    if (strncmp(p, etag, len) == 0
+	&& (p[len] == '\0' || p[len] == ',' || p[len] == ' '))
+      return (1);
+    while (*p != '\0' && *p != ',')
+      ++p;
+  }
+  return (0);
+}
+
+int
+http_etag(struct http_request *request, const char *etag)
+{
+  struct http_response *response = request->connection->response;
+
+  strlcpy(response->etag, etag, sizeof(response->etag));
+  if (request->if_none_match == NULL
+      || !http_etag_match(request->if_none_match, etag))
+    return (0);
+  http_printf(request, "HTTP/1.0 304 Not Modified\x0d\x0a");
+  http_printf(request, "\x0d\x0a");
+  return (1);
+}
+
+/*
+ * Parse a single "bytes=first-last" range against a file of 'size'
+ * bytes.  Returns 1 for a usable range, 0 to ignore the header (we
+ * don't do multiple ranges), and -1 if it can't be satisfied.
+ */
+static int
+http_parse_range(const char *p, off_t size, off_t *first, off_t *last)
+{
+  char *end;
+
+  if (strncmp(p, "bytes=", 6) != 0 || strchr(p, ',') != NULL)
+    return (0);
+  p += 6;
+  if (*p == '-') {
+    /* The final N bytes. */
+    *last = size - 1;
+    *first = size - strtoll(p + 1, &end, 10);
+    if (end == p + 1 || *end != '\0')
+      return (0);
+    if (*first < 0)
+      *first = 0;
+  } else {
+    *first = strtoll(p, &end, 10);
+    if (end == p || *end != '-')
+      return (0);
+    p = end + 1;
+    *last = size - 1;
+    if (*p != '\0') {
+      *last = strtoll(p, &end, 10);
+      if (*end != '\0' || *last < *first)
+	return (0);
+      if (*last >= size)
+	*last = size - 1;
+    }
+  }
+  if (size == 0 || *first >= size || *first > *last)
+    return (-1);
+  return (1);
+}
+
+int
+http_serve_file(struct http_request *request, const char *path,
+		const char *content_type)
+{
+  struct stat st;
+  off_t first, last;
+  char etag[64];
+  int fd, r = 0;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return body404(request);
+  }
+  snprintf(etag, sizeof(etag), "\"%jx-%jx\"",
+	   (intmax_t)st.st_size, (intmax_t)st.st_mtime);
+  if (http_etag(request, etag)) {
+    close(fd);
+    return (0);
+  }
+  if (request->if_none_match == NULL && request->if_modified_since != 0
+      && st.st_mtime <= request->if_modified_since) {
+    close(fd);
+    http_printf(request, "HTTP/1.0 304 Not Modified\x0d\x0a");
+    http_printf(request, "Last-Modified: %s\x0d\x0a", http_date(st.st_mtime));
+    http_printf(request, "\x0d\x0a");
+    return (0);
+  }
+  first = 0;
+  last = st.st_size - 1;
+  if (request->range != NULL)
+    r = http_parse_range(request->range, st.st_size, &first, &last);
+  if (r < 0) {
+    close(fd);
+    http_printf(request, "HTTP/1.0 416 Range Not Satisfiable\x0d\x0a");
+    http_printf(request, "Content-Range: bytes */%jd\x0d\x0a",
+		(intmax_t)st.st_size);
+    http_printf(request, "\x0d\x0a");
+    return (0);
+  }
+  if (r > 0)
+    http_printf(request, "HTTP/1.0 206 Partial Content\x0d\x0a");
+  else
+    http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+  http_printf(request, "Content-Type: %s\x0d\x0a", content_type);
+  http_printf(request, "Last-Modified: %s\x0d\x0a", http_date(st.st_mtime));
+  http_printf(request, "Accept-Ranges: bytes\x0d\x0a");
+  if (r > 0)
+    http_printf(request, "Content-Range: bytes %jd-%jd/%jd\x0d\x0a",
+		(intmax_t)first, (intmax_t)last, (intmax_t)st.st_size);
+  http_printf(request, "\x0d\x0a");
+  if (st.st_size == 0) {
+    close(fd);
+    return (0);
+  }
+  return (http_sendfile(request, fd, first, last - first + 1));
+}
+
+/*
+ * sendfile() has no MSG_NOSIGNAL, so hold off SIGPIPE around it and
+ * discard any that a vanished client raised.
+ */
+static ssize_t
+http_sendfile_nosignal(int sock, int fd, off_t *offset, size_t len)
+{
+  static const struct timespec zero = { 0, 0 };
+  sigset_t pipe, old;
+  ssize_t r;
+  int saved;
+
+  sigemptyset(&pipe);
+  sigaddset(&pipe, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipe, &old);
+  r = sendfile(sock, fd, offset, len);
+  saved = errno;
+  if (r < 0 && errno == EPIPE)
+    sigtimedwait(&pipe, NULL, &zero);
+  sigprocmask(SIG_SETMASK, &old, NULL);
+  errno = saved;
+  return (r);
+}
+
+/*
+ * Write as many queued responses as the socket will take.  Headers
+ * and bodies are gathered, up to 16 buffers per call, with sendmsg()
+ * rather than writev() so that a vanished client can't raise SIGPIPE
+ * in the nanny; attached files go out with sendfile().  Returns 0
+ * once everything has been sent, 1 if the socket would block, and -1
+ * on error.
+ */
+static int
+http_connection_send(struct http_connection *connection)
+{
+  struct iovec iov[16];
+  struct msghdr msg;
+  struct http_response *response;
+  size_t off, len;
+  off_t pos;
+  ssize_t r;
+  int n, file;
+
+  while ((response = connection->responses) != NULL) {
+    off = response->head_len + response->body_len;
+    file = (response->sent >= off && response->file_len > 0);
+    if (file) {
+      /* Only the file is left. */
+      pos = response->file_offset + (response->sent - off);
+      r = http_sendfile_nosignal(connection->sock, response->file_fd, &pos,
+				 response->file_len - (response->sent - off));
+    } else {
+      n = 0;
+      for (; response != NULL && n + 2 <= (int)(sizeof(iov)/sizeof(iov[0]));
+	   response = response->next) {
+	off = response->sent;
+	if (off < response->head_len) {
+	  iov[n].iov_base = response->head + off;
+	  iov[n].iov_len = response->head_len - off;
+	  ++n;
+	  off = 0;
+	} else
+	  off -= response->head_len;
+	if (off < response->body_len) {
+	  iov[n].iov_base = response->body + off;
+	  iov[n].iov_len = response->body_len - off;
+	  ++n;
+	}
+	/* A file has to follow its own header. */
+	if (response->file_len > 0)
+	  break;
+      }
+      r = 0;
+      if (n > 0) {
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	r = sendmsg(connection->sock, &msg, MSG_NOSIGNAL);
+      }
+    }
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return (1);
+    /* A file that got shorter can't fill its Content-Length. */
+    if (r < 0 || (file && r == 0))
+      return (-1);
+    if (r > 0)
+      connection->last_active = nanny_globals.now;
+
+    /* Retire whatever was completely sent. */
+    while ((response = connection->responses) != NULL) {
+      len = response->head_len + response->body_len + response->file_len
+	- response->sent;
+      if ((size_t)r < len) {
+	response->sent += r;
+	break;
+      }
+      r -= len;
+      connection->responses = response->next;
+      if (connection->response == response)
+	connection->response = NULL;
+      http_response_free(response);
+    }
+  }
+  return (0);
+}
+
+/*
+ * Look up 'key' in the query string of the request URI and copy its
+ * value into 'buff', decoding %XX escapes and '+'.  Returns NULL if
+ * the key is not present.
+ */
+const char *
+http_query(struct http_request *request, const char *key,
+	   char *buff, size_t size)
+{
+  const char *p, *q;
+  size_t keylen = strlen(key);
+  size_t n;
+
+  if (request->uri == NULL || size < 1
+      || (p = strchr(request->uri, '?')) == NULL)
+    return (NULL);
+
+  while (p != NULL) {
+    ++p; /* Skip the '?' or '&' */
+    if (strncmp(p, key, keylen) == 0
+	&& (p[keylen] == '=' || p[keylen] == '&' || p[keylen] == '\0')) {
+      p += keylen;
+      if (*p == '=')
+	++p;
+      n = 0;
+      while (*p != '\0' && *p != '&' && n < size - 1) {
+	if (*p == '+') {
+	  buff[n++] = ' ';
+	  ++p;
+	} else if (p[0] == '%' && isxdigit((unsigned char)p[1])
+		   && isxdigit((unsigned char)p[2])) {
+	  buff[n++] = ((uri_map[(int)p[1]] & 0x0f) << 4)
+	    | (uri_map[(int)p[2]] & 0x0f);
+	  p += 3;
+	} else
+	  buff[n++] = *p++;
+      }
+      buff[n] = '\0';
+      return (buff);
+    }
+    q = strchr(p, '&');
+    p = q;
+  }
+  return (NULL);
 }
 
 /* Standard 404 handler is invoked unless dispatcher overrides. */
@@ -155,15 +879,22 @@ http_connection_readline(struct http_connection *connection, char **start, char
   }
 
   p = *end = *start = connection->start;
-  while (*p != '\n') {
-    ++p;
+  for (;;) {
+    /* Don't look at the buffer past the data we've actually read. */
     if (p >= connection->end) {
-      ssize_t bytes = read(connection->sock, connection->end,
+      ssize_t bytes;
+      /* Event-driven connections have the whole header buffered. */
+      if (connection->nonblocking)
+	return -1;
+      bytes = read(connection->sock, connection->end,
 		   connection->buff_end - connection->end);
       if (bytes <= 0)
 	return -1;
       connection->end += bytes;
     }
+    if (*p == '\n')
+      break;
+    ++p;
   }
   connection->start = p + 1; /* Next input starts just after '\n' */
   *end = p;
@@ -221,7 +952,9 @@ http_request(struct http_request *request)
 {
   char *p, *end, *start;
 
-  http_connection_readline(request->connection, &p, &end);
+  /* The peer closed the connection or went quiet. */
+  if (http_connection_readline(request->connection, &p, &end) < 0)
+    return (-1);
 
   /* Method is one of a small set of possible strings. */
   switch (p[0]) {
@@ -274,12 +1007,53 @@ http_request(struct http_request *request)
   return (0);
 }
 
+/*
+ * Pick a content coding from an Accept-Encoding header.  We prefer
+ * gzip, and honor "q=0" to refuse a coding.
+ */
+static void
+http_accept_encoding(struct http_response *response, const char *p)
+{
+  const char *name, *q;
+  size_t len;
+  int encoding;
+
+  if (http_compress_level <= 0)
+    return;
+  while (*p != '\0') {
+    while (*p == ' ' || *p == '\t' || *p == ',')
+      ++p;
+    name = p;
+    while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ')
+      ++p;
+    len = p - name;
+    q = p;
+    while (*p != '\0' && *p != ',')
+      ++p;
+    /* A quality of zero means "not acceptable". */
+    while (q < p && (*q == ';' || *q == ' '))
+      ++q;
+    if (q + 2 < p && strncmp(q, "q=", 2) == 0 && atof(q + 2) <= 0)
+      continue;
+    encoding = HTTP_ENCODING_NONE;
+    if (len == 4 && strncasecmp(name, "gzip", 4) == 0)
+      encoding = HTTP_ENCODING_GZIP;
+    else if (len == 7 && strncasecmp(name, "deflate", 7) == 0)
+      encoding = HTTP_ENCODING_DEFLATE;
+    if (encoding == HTTP_ENCODING_GZIP
+	|| (encoding != HTTP_ENCODING_NONE
+	    && response->encoding == HTTP_ENCODING_NONE))
+      response->encoding = encoding;
+  }
+}
+
 static int
 http_request_header(struct http_request *request)
 {
   char *p, *end, *header;
 
-  http_connection_readline(request->connection, &p, &end);
+  if (http_connection_readline(request->connection, &p, &end) < 0)
+    return (0);
   if (p < end)
     *end = '\0';
   else {
@@ -302,14 +1076,96 @@ http_request_header(struct http_request *request)
   while (p < end && (*p == ' ' || *p == '\t'))
     ++p;
 
+  /*
+   * Headers that matter for the connection itself.  We never read
+   * request bodies, so a request with one can't be followed by
+   * another on the same connection.
+   */
+  if (strcmp(header, "CONNECTION") == 0) {
+    if (strcasestr(p, "close") != NULL)
+      request->connection->keepalive = 0;
+    else if (strcasestr(p, "keep-alive") != NULL)
+      request->connection->keepalive = 1;
+  } else if (strcmp(header, "ACCEPT-ENCODING") == 0)
+    http_accept_encoding(request->connection->response, p);
+  else if (strcmp(header, "CONTENT-LENGTH") == 0 && atol(p) > 0)
+    request->connection->keepalive = -1;
+  else if (strcmp(header, "TRANSFER-ENCODING") == 0)
+    request->connection->keepalive = -1;
+  else if (strcmp(header, "RANGE") == 0 && request->range == NULL)
+    request->range = strdup(p);
+  else if (strcmp(header, "IF-MODIFIED-SINCE") == 0)
+    request->if_modified_since = http_parse_date(p);
+  else if (strcmp(header, "IF-NONE-MATCH") == 0 && request->if_none_match == NULL)
+    request->if_none_match = strdup(p);
+
   if (request->header_processor)
     (request->header_processor)(request, header, p);
   return (1);
 }
 
 /*
- * Read a request header, invoke the appropriate request
- * handler and loop until socket is closed.
+ * Read a request header and invoke the appropriate request handler.
+ * Returns nonzero if there was no request or the request line was bad.
+ */
+static int
+http_connection_request(struct http_server *server,
+			struct http_connection *connection)
+{
+  /* Stack allocation works for small structures. */
+  struct http_request _request;
+  struct http_request *request = &_request;
+  int r;
+
+  memset(request, 0, sizeof(*request));
+  request->connection = connection;
+  http_response_new(connection);
+
+  if ((r = http_request(request)) != 0) {
+    /* TODO: Generate an HTTP response for this. */
+    if (r > 0)
+      fprintf(stderr, "invalid request line\n");
+    free(request->uri);
+    return (1);
+  }
+  HTTP_STAT_ADD(requests, 1);
+
+  /* HTTP/1.1 connections persist unless the client says otherwise. */
+  connection->keepalive = request->HTTPmajor > 1
+    || (request->HTTPmajor == 1 && request->HTTPminor >= 1);
+
+  /* Dispatch the request. */
+  server->dispatcher(request);
+
+  /* Read the headers. */
+  while (http_request_header(request))
+    ;
+
+  if (request->body_processor)
+    (request->body_processor)(request);
+  else
+    body404(request);
+  if (connection->keepalive < 0)
+    connection->keepalive = 0;
+  http_response_finish(request, connection->response);
+  free(request->uri);
+  free(request->range);
+  free(request->if_none_match);
+  if (connection->detached == HTTP_DETACHED_CHILD) {
+    /* Send everything queued on this connection, then go away. */
+    fcntl(connection->sock, F_SETFL,
+	  fcntl(connection->sock, F_GETFL) & ~O_NONBLOCK);
+    http_connection_send(connection);
+    _exit(0);
+  }
+  /* The parent's share of a detached connection is just to close it. */
+  if (connection->detached == HTTP_DETACHED_PARENT)
+    return (1);
+  return (0);
+}
+
+/*
+ * Handle requests and loop until socket is closed.
  */
 static void
 http_connection(struct http_server *server, int sock)
@@ -317,8 +1173,7 @@ http_connection(struct http_server *server, int sock)
   /* Stack allocation works for small structures. */
   struct http_connection _connection;
   struct http_connection *connection = &_connection;
-  struct http_request _request;
-  struct http_request *request = &_request;
+  struct timeval tv;
 
   /* Initialize the connection I/O buffers. */
   memset(connection, 0, sizeof(*connection));
@@ -328,30 +1183,17 @@ http_connection(struct http_server *server, int sock)
   connection->start = connection->end = connection->buff;
   connection->sock = sock;
   connection->keepalive = 0;
+  /* Don't let an idle persistent connection hold the process forever. */
+  tv.tv_sec = HTTP_IDLE_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
   /* Handle one or more requests over this connection. */
   do {
-    memset(request, 0, sizeof(*request));
-    request->connection = connection;
-
-    if (http_request(request)) {
-      /* TODO: Generate an HTTP response for this. */
-      fprintf(stderr, "invalid request line\n");
+    if (http_connection_request(server, connection))
+      return;
+    if (http_connection_send(connection) != 0)
       return;
-    }
-
-    /* Dispatch the request. */
-    server->dispatcher(request);
-
-    /* Read the headers. */
-    while (http_request_header(request))
-      ;
-
-    if (request->body_processor)
-      (request->body_processor)(request);
-    else
-      body404(request);
-
     /* If keepalive is enabled, get the next request. */
   } while (connection->keepalive);
 
@@ -359,14 +1201,10 @@ http_connection(struct http_server *server, int sock)
 }
 
 static void
-http_server_accept(void *_server)
+http_server_fork(struct http_server *server, int s)
 {
-  struct http_server *server = _server;
-  struct sockaddr_in addr;
-  socklen_t len = sizeof(addr);
-  int s, r;
+  int r;
 
-  s = accept(server->sock, (struct sockaddr *)&addr, &len);
   r = fork();
   switch (r) {
   case 0:
@@ -378,6 +1216,7 @@ http_server_accept(void *_server)
   case -1:
     /* TODO: Log this. */
     perror("fork");
+    close(s);
     return;
   default:
     close(s);
@@ -385,6 +1224,340 @@ http_server_accept(void *_server)
   }
 }
 
+/*
+ * Event-driven connections.
+ */
+static void
+http_connection_close(struct http_connection *connection)
+{
+  struct http_response *response;
+
+  nanny_unregister_server(connection->sock);
+  nanny_unregister_writer(connection->sock);
+  nanny_timer_delete(connection->timer);
+  close(connection->sock);
+  free(connection->buff);
+  while ((response = connection->responses) != NULL) {
+    connection->responses = response->next;
+    http_response_free(response);
+  }
+  free(connection);
+  --http_connections;
+}
+
+static void
+http_connection_expire(void *_connection, time_t now)
+{
+  struct http_connection *connection = _connection;
+
+  connection->timer = NULL;
+  if (now < connection->last_active + HTTP_IDLE_TIMEOUT) {
+    connection->timer = nanny_timer_add(connection->last_active
+	+ HTTP_IDLE_TIMEOUT, http_connection_expire, connection);
+    return;
+  }
+  http_connection_close(connection);
+}
+
+/* Does the input buffer hold a complete request header? */
+static int
+http_connection_complete(struct http_connection *connection)
+{
+  char *p;
+
+  for (p = connection->start; p < connection->end; ++p) {
+    if (*p != '\n')
+      continue;
+    if (p + 1 < connection->end && p[1] == '\n')
+      return (1);
+    if (p + 2 < connection->end && p[1] == '\r' && p[2] == '\n')
+      return (1);
+  }
+  return (0);
+}
+
+/* Wait for the socket to become readable, writable, or neither. */
+static void http_connection_readable(void *);
+static void http_connection_writable(void *);
+
+static void
+http_connection_wait(struct http_connection *connection, int reading,
+		     int writing)
+{
+  if (reading != connection->reading) {
+    if (reading)
+      nanny_register_server(http_connection_readable, connection->sock,
+			    connection);
+    else
+      nanny_unregister_server(connection->sock);
+    connection->reading = reading;
+  }
+  if (writing != connection->writing) {
+    if (writing)
+      nanny_register_writer(http_connection_writable, connection->sock,
+			    connection);
+    else
+      nanny_unregister_writer(connection->sock);
+    connection->writing = writing;
+  }
+}
+
+/*
+ * Drive a connection as far as it can go without blocking:  send
+ * pending responses, then answer any complete requests already in
+ * the input buffer (pipelining), then wait for more input.  We stop
+ * reading while the client isn't taking our output, so a client that
+ * pipelines without reading can't make us buffer without limit.
+ */
+static void
+http_connection_run(struct http_connection *connection)
+{
+  int r;
+
+  for (;;) {
+    if ((r = http_connection_send(connection)) < 0) {
+      http_connection_close(connection);
+      return;
+    }
+    if (r > 0) {
+      http_connection_wait(connection, 0, 1);
+      return;
+    }
+    if (connection->requests > 0 && !connection->keepalive) {
+      http_connection_close(connection);
+      return;
+    }
+    if (!http_connection_complete(connection))
+      break;
+    if (http_connection_request(connection->server, connection)) {
+      http_connection_close(connection);
+      return;
+    }
+    ++connection->requests;
+  }
+
+  if (connection->eof) {
+    http_connection_close(connection);
+    return;
+  }
+
+  /* Make room for the rest of a partial request. */
+  if (connection->start > connection->buff) {
+    memmove(connection->buff, connection->start,
+	    connection->end - connection->start);
+    connection->end = connection->buff + (connection->end - connection->start);
+    connection->start = connection->buff;
+  }
+  if (connection->end >= connection->buff_end) {
+    fprintf(stderr, "HTTP request header too large\n");
+    http_connection_close(connection);
+    return;
+  }
+  http_connection_wait(connection, 1, 0);
+}
+
+static void
+http_connection_writable(void *_connection)
+{
+  http_connection_run(_connection);
+}
+
+static void
+http_connection_readable(void *_connection)
+{
+  struct http_connection *connection = _connection;
+  ssize_t bytes;
+
+  bytes = read(connection->sock, connection->end,
+	       connection->buff_end - connection->end);
+  if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+		    || errno == EINTR))
+    return;
+  if (bytes < 0) {
+    http_connection_close(connection);
+    return;
+  }
+  /* Still answer anything sent before a half-close. */
+  if (bytes == 0)
+    connection->eof = 1;
+  connection->end += bytes;
+  connection->last_active = nanny_globals.now;
+  http_connection_run(connection);
+}
+
+static void
+http_server_accept(void *_server)
+{
+  struct http_server *server = _server;
+  struct http_connection *connection;
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int s;
+
+  s = accept(server->sock, (struct sockaddr *)&addr, &len);
+  if (s < 0) {
+    perror("accept");
+    return;
+  }
+
+  HTTP_STAT_ADD(connections, 1);
+  if (http_forking || http_connections >= HTTP_MAX_CONNECTIONS
+      || s >= FD_SETSIZE) {
+    HTTP_STAT_ADD(forked, 1);
+    http_server_fork(server, s);
+    return;
+  }
+
+  if ((connection = malloc(sizeof(*connection))) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  memset(connection, 0, sizeof(*connection));
+  connection->buff_size = 16384;
+  if ((connection->buff = malloc(connection->buff_size)) == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  connection->buff_end = connection->buff + connection->buff_size;
+  connection->start = connection->end = connection->buff;
+  connection->sock = s;
+  connection->server = server;
+  connection->nonblocking = 1;
+  connection->last_active = time(NULL);
+  connection->timer = nanny_timer_add(connection->last_active
+      + HTTP_IDLE_TIMEOUT, http_connection_expire, connection);
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  ++http_connections;
+  http_connection_wait(connection, 1, 0);
+}
+
+/*
+ * For handlers that may take a while (searching rotated files, say):
+ * move the rest of this connection into a forked process so the
+ * event loop isn't held up.  Like fork(), returns nonzero in the
+ * process that should generate the response and zero in the one
+ * that should just return.  Connections that are already in their
+ * own process are left alone.  If the fork fails, the client gets a
+ * 503 rather than stalling the loop, and the caller just returns.
+ */
+int
+http_detach(struct http_request *request)
+{
+  struct http_connection *connection = request->connection;
+  int r;
+
+  if (!connection->nonblocking || connection->detached)
+    return (1);
+  HTTP_STAT_ADD(forked, 1);
+  r = fork();
+  if (r < 0) {
+    perror("fork");
+    http_printf(request, "HTTP/1.0 503 Service Unavailable\x0d\x0a");
+    http_printf(request, "Content-Type: text/plain\x0d\x0a");
+    http_printf(request, "\x0d\x0a");
+    http_printf(request, "Busy, try again later\n");
+    return (0);
+  }
+  if (r == 0) {
+    connection->detached = HTTP_DETACHED_CHILD;
+    return (1);
+  }
+  connection->detached = HTTP_DETACHED_PARENT;
+  return (0);
+}
+
+/*
+ * Select between serving connections from the event loop (the
+ * default) and forking a process for each.
+ */
+void
+http_server_set_forking(int forking)
+{
+  http_forking = forking;
+}
+
+/*
+ * Set the zlib level used for clients that accept gzip or deflate;
+ * zero disables compression.
+ */
+void
+http_server_set_compression(int level)
+{
+  if (level > Z_BEST_COMPRESSION)
+    level = Z_BEST_COMPRESSION;
+  http_compress_level = level < 0 ? 0 : level;
+}
+
+/*
+ * Server counters as JSON.
+ */
+int
+http_server_stats_body(struct http_request *request)
+{
+  struct http_stats st = *http_stats;
+
+  http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+  http_printf(request, "Content-Type: application/json\x0d\x0a");
+  http_printf(request, "\x0d\x0a");
+  http_printf(request, "{\n");
+  http_printf(request, " \"mode\": \"%s\",\n",
+	      http_forking ? "forking" : "event");
+  http_printf(request, " \"connections\": %ju,\n", st.connections);
+  http_printf(request, " \"connections_open\": %d,\n", http_connections);
+  http_printf(request, " \"connections_forked\": %ju,\n", st.forked);
+  http_printf(request, " \"requests\": %ju,\n", st.requests);
+  http_printf(request, " \"compress_level\": %d,\n", http_compress_level);
+  http_printf(request, " \"compressed_responses\": %ju,\n", st.compressed);
+  http_printf(request, " \"compress_bytes_in\": %ju,\n",
+	      st.compress_bytes_in);
+  http_printf(request, " \"compress_bytes_out\": %ju,\n",
+	      st.compress_bytes_out);
+  http_printf(request, " \"compress_ratio\": %.2f,\n",
+	      st.compress_bytes_out == 0 ? 0.0
+	      : (double)st.compress_bytes_in / st.compress_bytes_out);
+  http_printf(request, " \"compress_cpu_seconds\": %.6f\n",
+	      st.compress_cpu_usec / 1000000.0);
+  http_printf(request, "}\n");
+  return (0);
+}
+
+static void
+http_metric(struct http_request *request, const char *name,
+	    const char *type, const char *help, uintmax_t value)
+{
+  http_printf(request, "# HELP %s %s\n# TYPE %s %s\n%s %ju\n",
+	      name, help, name, type, name, value);
+}
+
+/*
+ * Server counters for /metrics.
+ */
+void
+http_server_metrics(struct http_request *request)
+{
+  struct http_stats st = *http_stats;
+
+  http_metric(request, "nanny_http_connections_total", "counter",
+	      "Connections accepted.", st.connections);
+  http_metric(request, "nanny_http_connections_open", "gauge",
+	      "Connections served from the event loop.", http_connections);
+  http_metric(request, "nanny_http_connections_forked_total", "counter",
+	      "Connections handed to a forked process.", st.forked);
+  http_metric(request, "nanny_http_requests_total", "counter",
+	      "Requests parsed.", st.requests);
+  http_metric(request, "nanny_http_compressed_responses_total", "counter",
+	      "Responses sent compressed.", st.compressed);
+  http_metric(request, "nanny_http_compress_in_bytes_total", "counter",
+	      "Response bytes before compression.", st.compress_bytes_in);
+  http_metric(request, "nanny_http_compress_out_bytes_total", "counter",
+	      "Response bytes after compression.", st.compress_bytes_out);
+  http_printf(request, "# HELP nanny_http_compress_cpu_seconds_total"
+	      " CPU time spent compressing.\n"
+	      "# TYPE nanny_http_compress_cpu_seconds_total counter\n"
+	      "nanny_http_compress_cpu_seconds_total %.6f\n",
+	      st.compress_cpu_usec / 1000000.0);
+}
+
 /*
  * Register with the central dispatcher.
  */
@@ -398,6 +1571,14 @@ void http_server_init(const struct sockaddr *name,
 
   if ((server = malloc(sizeof(*server))) == NULL)
     perror("malloc");
+  if (http_stats == NULL) {
+    http_stats = mmap(NULL, sizeof(*http_stats), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (http_stats == MAP_FAILED) {
+      perror("mmap");
+      http_stats = &http_stats_private;
+    }
+  }
   memset(server, 0, sizeof(*server));
   server->dispatcher = dispatcher;
 
@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -38,27 +39,8 @@
 #include <time.h>
 
 #include "nanny.h"
-
-struct nanny_log {
-  int refcnt;
-  char *filename_base;
-  char *filename;
-  int file_fd;
-  time_t last_rotate;
-  uintmax_t last_rotate_bytes;
-  time_t last_rotate_check;
-
-  uintmax_t total_bytes;
-  uintmax_t read_count;
-  uintmax_t error_count;
-  float	bytes_per_second;
-  time_t bps_last_update_time;
-  uintmax_t bps_last_update_bytes;
-  char *buff;
-  size_t buff_size;
-  char *buff_end;
-  char *buffp;
-};
+#include "nanny_log.h"
+#include "nanny_timer.h"
 
 /*
  * Used to tie stdout/stderr for a subprocess to a buffer that
@@ -82,27 +64,26 @@ nanny_log_alloc(size_t buffsize)
 
   nlog->file_fd = -1;
   nlog->refcnt = 1;
-  nlog->buff_size = buffsize;
-  nlog->buff = malloc(nlog->buff_size);
-  if (nlog->buff == NULL)
-    nlog->buff_size = 0;
-  else
-    memset(nlog->buff, 0, nlog->buff_size);
-  nlog->buff_end = nlog->buff + nlog->buff_size;
-  nlog->buffp = nlog->buff;
+  nlog->rotate_bytes = 1000000;
+  nlog->rotate_interval = 3600;
+  nlog->idle_close = 600;
+  nlog->file_bol = 1;
+  nlog->cache_drop = 1;
+  nanny_log_set_ring(nlog, buffsize, 600);
   return nlog;
 }
 
+static void nanny_log_close_file(struct nanny_log *, int);
+
 void
 nanny_log_set_filename(struct nanny_log *nlog, const char *fmt, ...)
 {
   char filename[512];
   va_list ap;
 
+  nanny_log_close_file(nlog, 1);
   free(nlog->filename_base);
   nlog->filename_base = NULL;
-  free(nlog->filename);
-  nlog->filename = NULL;
 
   if (fmt == NULL)
     return;
@@ -117,17 +98,92 @@ nanny_log_set_filename(struct nanny_log *nlog, const char *fmt, ...)
 
 }
 
-
 /*
- * Decide whether we need to rotate logs.
+ * Log file rotation.
  *
- * XXX TODO: Set up a timer to go off once an hour and
- * proactively close the open log files.  The current code
- * leaves log files open until the next write, which is
- * less than ideal. XXX
+ * A log file is finished once it holds 'rotate_bytes' bytes or when
+ * the clock passes a multiple of 'rotate_interval' (the top of the
+ * hour, by default).  The size check is a single comparison on the
+ * write path; everything time-based is driven by a per-log timer,
+ * which also closes files that have been idle for 'idle_close'
+ * seconds.  An idle-closed file is simply reopened by the next write.
+ */
+
+static void nanny_log_timer(void *, time_t);
+
+/*
+ * (Re)arm the log's timer for the next interval boundary, idle file
+ * close or idle ring shrink, whichever comes first.
+ */
+void
+nanny_log_schedule(struct nanny_log *nlog)
+{
+  time_t next = 0, ring;
+
+  nanny_timer_delete(nlog->timer);
+  nlog->timer = NULL;
+  if (nlog->filename != NULL) {
+    if (nlog->rotate_interval > 0)
+      next = nlog->last_rotate - (nlog->last_rotate % nlog->rotate_interval)
+	+ nlog->rotate_interval;
+    if (nlog->file_fd >= 0 && nlog->idle_close > 0
+	&& (next == 0 || nlog->last_write + nlog->idle_close < next))
+      next = nlog->last_write + nlog->idle_close;
+  }
+  ring = nanny_log_ring_deadline(nlog);
+  if (ring > 0 && (next == 0 || ring < next))
+    next = ring;
+  if (next > 0)
+    nlog->timer = nanny_timer_add(next, nanny_log_timer, nlog);
+}
+
+/*
+ * Close the current log file.  When rotating, the file is finished:
+ * forget its name so the next write starts a new one and let the
+ * archiver at the old files.  Otherwise just release the descriptor.
  */
 static void
-nanny_log_rotate(struct nanny_log *nlog)
+nanny_log_close_file(struct nanny_log *nlog, int rotate)
+{
+  ++nlog->generation;
+  if (nlog->file_fd >= 0) {
+    nanny_log_sync_close(nlog, rotate);
+    nanny_log_cache_close(nlog, rotate);
+    close(nlog->file_fd);
+    nlog->file_fd = -1;
+  }
+  if (rotate && nlog->filename != NULL) {
+    free(nlog->filename);
+    nlog->filename = NULL;
+    nanny_log_archive(nlog);
+  }
+  nanny_log_schedule(nlog);
+}
+
+static void
+nanny_log_timer(void *_nlog, time_t now)
+{
+  struct nanny_log *nlog = _nlog;
+
+  nlog->timer = NULL;
+  nanny_log_ring_idle(nlog, now);
+  if (nlog->filename != NULL && nlog->rotate_interval > 0
+      && now >= nlog->last_rotate - (nlog->last_rotate % nlog->rotate_interval)
+      + nlog->rotate_interval)
+    nanny_log_close_file(nlog, 1);
+  else if (nlog->file_fd >= 0 && nlog->idle_close > 0
+	   && now >= nlog->last_write + nlog->idle_close)
+    nanny_log_close_file(nlog, 0);
+  else
+    nanny_log_schedule(nlog);
+}
+
+/*
+ * Open the log file:  either reopen the current file after an idle
+ * close, or start a new timestamped file and point the symlink at it.
+ */
+void
+nanny_log_open_file(struct nanny_log *nlog)
 {
   char filename[1024];
   const char *p;
@@ -135,93 +191,144 @@ nanny_log_rotate(struct nanny_log *nlog)
   time_t creation;
   int l;
 
-
-  if (nlog->file_fd >= 0) {
-    /* Last top-of-hour. */
-    time_t last_hour = nanny_globals.now - (nanny_globals.now % 3600);
-
-    /* Close the old log file if: */
-    if (  /* Passed top of hour */
-	(nlog->last_rotate > 0 && nlog->last_rotate < last_hour)
-	|| /* Logged more than 10MB to this file. */
-	(nlog->total_bytes - nlog->last_rotate_bytes > 1000000)
-	  )
-      {
-	close(nlog->file_fd);
-	nlog->file_fd = -1;
-	free(nlog->filename);
-	nlog->filename = NULL;
-      }
+  if (nlog->filename != NULL) {
+    nlog->file_fd = open(nlog->filename, O_WRONLY | O_APPEND);
+    if (nlog->file_fd >= 0)
+      return;
+    /* Somebody removed it; start afresh. */
+    nanny_log_close_file(nlog, 1);
   }
 
+  /* Select a timestamp for the file. */
   /*
-   * If there's no configured log dir, we can't log, so don't try.
+   * If there was an hour or minute boundary between the last write
+   * and now, round the time to that boundary.  This makes the
+   * filenames prettier.
    */
-  if (nlog->filename_base == NULL)
-    return;
-
-  /* If there's no log, open a new one. */
+  creation = nanny_globals.now;
+  if (nlog->last_write > 0) {
+    if (creation - (creation % 3600) > nlog->last_write)
+      creation -= creation % 3600;
+    else if (creation - (creation % 60) > nlog->last_write)
+      creation -= creation % 60;
+  }
+  /* Append a timestamp to the filename. */
+  tm = gmtime(&creation);
+  strlcpy(filename, nlog->filename_base, sizeof(filename));
+  strlcat(filename, ".", sizeof(filename));
+  strftime(filename + strlen(filename),
+	   sizeof(filename) - strlen(filename) - 1,
+	   "%Y-%m-%dT%H.%M.%S", tm);
+
+  /* Open the new log file. */
+  nlog->file_fd =
+    open(filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+  /* If it fails (because we're logging so much that we've overrun
+     the rotation within a single second) try once more with
+     microseconds. */
   if (nlog->file_fd < 0) {
-    /* Select a timestamp for the file. */
-    /*
-     * If there was an hour or minute boundary between the last write
-     * and now, round the time to that boundary.  This makes the
-     * filenames prettier.
-     */
-    creation = nanny_globals.now;
-    if (nlog->last_rotate_check > 0) {
-      if (creation - (creation % 3600) > nlog->last_rotate_check)
-	creation -= creation % 3600;
-      else if (creation - (creation % 60) > nlog->last_rotate_check)
-	creation -= creation % 60;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    l = snprintf(filename + strlen(filename),
+        sizeof(filename) - strlen(filename), ".%06ld", (long)tv.tv_usec);
+    if (l == -1 || l >= (int)(sizeof(filename) - strlen(filename))) {
+        fprintf(stderr, "nanny_log_open_file: snprintf truncation\n");
+        exit(1);
     }
-    /* Append a timestamp to the filename. */
-    tm = gmtime(&creation);
-    strlcpy(filename, nlog->filename_base, sizeof(filename));
-    strlcat(filename, ".", sizeof(filename));
-    strftime(filename + strlen(filename),
-	     sizeof(filename) - strlen(filename) - 1,
-	     "%Y-%m-%dT%H.%M.%S", tm);
-
-    /* Open the new log file. */
+
     nlog->file_fd =
       open(filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
-    /* If it fails (because we're logging so much that we've overrun
-       the rotation within a single second) try once more with
-       microseconds. */
-    if (nlog->file_fd < 0) {
-      struct timeval tv;
-      gettimeofday(&tv, NULL);
-      l = snprintf(filename + strlen(filename),
-          sizeof(filename) - strlen(filename), ".%06d", tv.tv_usec);
-      if (l == -1 || l >= (int)(sizeof(filename) - strlen(filename))) {
-          fprintf(stderr, "nanny_log_rotate: snprintf truncation\n");
-          exit(1);
-      }
-
-      nlog->file_fd =
-	open(filename, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
-    }
+  }
 
-    /* If we succeeded in opening a new file, record the new name and
-     * update the symlink. */
-    if (nlog->file_fd >= 0) {
-      if ((nlog->filename = strdup(filename)) == NULL) {
-          fprintf(stderr, "nanny_log_rotate: strdup failure\n");
-          exit(1);
-      }
-      unlink(nlog->filename_base); /* Remove old symlink, if any. */
-      p = strrchr(nlog->filename, '/');
-      if (p != NULL)
-	symlink(p + 1, nlog->filename_base);
-
-      /* Record log stats as of the last rotation. */
-      nlog->last_rotate = nanny_globals.now;
-      nlog->last_rotate_bytes = nlog->total_bytes;
+  /* If we succeeded in opening a new file, record the new name and
+   * update the symlink. */
+  if (nlog->file_fd >= 0) {
+    if ((nlog->filename = strdup(filename)) == NULL) {
+        fprintf(stderr, "nanny_log_open_file: strdup failure\n");
+        exit(1);
     }
+    unlink(nlog->filename_base); /* Remove old symlink, if any. */
+    p = strrchr(nlog->filename, '/');
+    if (p != NULL)
+      symlink(p + 1, nlog->filename_base);
+
+    /* Record log stats as of the last rotation. */
+    nlog->last_rotate = nanny_globals.now;
+    nlog->file_bytes = 0;
+    nlog->file_start = nlog->total_bytes;
+    nlog->last_write = nanny_globals.now;
+    nanny_log_cache_open(nlog);
+    nanny_log_schedule(nlog);
   }
+}
+
+/*
+ * Append data to the current log file, opening one if necessary.
+ * This is where captured output leaves the ring's world, so it is
+ * also offered to the collector, if any.
+ */
+void
+nanny_log_write_file(struct nanny_log *nlog, const char *p, size_t n)
+{
+  ssize_t w;
+
+  nanny_log_forward(nlog, p, n);
+  if (nanny_log_consolidate_write(nlog, p, n))
+    return;
+  if (nlog->file_fd < 0) {
+    /* If there's no configured log dir, we can't log, so don't try. */
+    if (nlog->filename_base == NULL)
+      return;
+    nanny_log_open_file(nlog);
+    if (nlog->file_fd < 0)
+      return;
+  }
+  nanny_log_cache_reserve(nlog, n);
+  if (nlog->file_stamps)
+    w = nanny_log_write_stamped(nlog, p, n);
+  else
+    w = write(nlog->file_fd, p, n);
+  if (w > 0) {
+    nlog->file_bytes += w;
+    if (nlog->disk_bytes == nlog->synced_bytes)
+      nlog->unsynced_since = nanny_globals.now;
+    nlog->disk_bytes += w;
+    nanny_log_cache_written(nlog);
+  }
+  nlog->last_write = nanny_globals.now;
+  if (nlog->rotate_bytes > 0 && nlog->file_bytes >= nlog->rotate_bytes)
+    nanny_log_close_file(nlog, 1);
+}
+
+/*
+ * Set the rotation policy.  Zero disables either limit.
+ */
+void
+nanny_log_set_rotation(struct nanny_log *nlog, uintmax_t max_bytes,
+		       time_t interval)
+{
+  nlog->rotate_bytes = max_bytes;
+  nlog->rotate_interval = interval;
+  nanny_log_schedule(nlog);
+}
+
+/*
+ * Prefix each line written to disk with its arrival time.
+ */
+void
+nanny_log_set_file_stamps(struct nanny_log *nlog, int enable)
+{
+  nlog->file_stamps = enable;
+}
 
-  nlog->last_rotate_check = nanny_globals.now;
+/*
+ * Close the log file after this many seconds without a write.
+ */
+void
+nanny_log_set_idle_close(struct nanny_log *nlog, time_t idle)
+{
+  nlog->idle_close = idle;
+  nanny_log_schedule(nlog);
 }
 
 /*
@@ -243,8 +350,21 @@ nanny_log_release(struct nanny_log *nlog)
   if (nlog->refcnt < 0)
     fprintf(stderr, "REFCNT ERROR!!!\n");
   if (nlog->refcnt == 0) {
-    free(nlog->buff);
-    nlog->buff = NULL;
+    nanny_log_ring_shrink(nlog, 0);
+    nanny_log_history_free(nlog);
+    nanny_log_dedup_free(nlog);
+    nanny_log_metrics_free(nlog);
+    nanny_log_subscribers_free(nlog);
+    free(nlog->chunks);
+    nanny_log_events_free(nlog);
+    free(nlog->stamps);
+    nanny_timer_delete(nlog->timer);
+    nanny_timer_delete(nlog->limit_timer);
+    nanny_timer_delete(nlog->sync_timer);
+    if (nlog->notify != NULL)
+      nanny_log_release(nlog->notify);
+    free(nlog->label);
+    free(nlog->forward_stream);
     if (nlog->file_fd >= 0)
       close(nlog->file_fd);
     free(nlog->filename);
@@ -254,81 +374,141 @@ nanny_log_release(struct nanny_log *nlog)
 }
 
 /*
- * Update the bps statistics counters.
+ * Throughput is kept as exponentially-weighted moving averages over
+ * 1, 5 and 15 minutes, like the load average.  Bytes are tallied for
+ * the current second and folded into the averages when the clock
+ * moves on, so ingest costs an addition or two; a silent log decays
+ * by the idle time when it is next written or read.
  */
+static const double nanny_log_rate_window[NANNY_LOG_RATES] = {
+  60.0, 300.0, 900.0
+};
+
 static void
-nanny_log_update_statistics(struct nanny_log *nlog)
+nanny_log_fold_rates(const struct nanny_log *nlog, double *rates)
 {
-  if (nlog->bps_last_update_time == nanny_globals.now)
+  time_t idle;
+  double decay;
+  int i;
+
+  for (i = 0; i < NANNY_LOG_RATES; i++)
+    rates[i] = nlog->bps_rate[i];
+  if (nlog->bps_last_update_time == 0
+      || nlog->bps_last_update_time >= nanny_globals.now)
     return;
+  /* One second at the pending rate, then silence. */
+  idle = nanny_globals.now - nlog->bps_last_update_time - 1;
+  for (i = 0; i < NANNY_LOG_RATES; i++) {
+    decay = exp(-1.0 / nanny_log_rate_window[i]);
+    rates[i] = rates[i] * decay + nlog->bps_pending * (1.0 - decay);
+    if (idle > 0)
+      rates[i] *= exp(-idle / nanny_log_rate_window[i]);
+  }
+}
 
-  if (nlog->bps_last_update_time == 0)
-    nlog->bytes_per_second = 0.0;
-  else
-    /* TODO: a little smoothing may be in order here. */
-    /* TODO: Create a function to read the bytes_per_second value
-     * that applies a smoothing decay so that you can see the value
-     * decay if no input occurs for a long time. */
-    nlog->bytes_per_second =
-      (nlog->total_bytes - nlog->bps_last_update_bytes)
-      / (nanny_globals.now - nlog->bps_last_update_time);
-
-  nlog->bps_last_update_time = nanny_globals.now;
-  nlog->bps_last_update_bytes = nlog->total_bytes;
+/*
+ * Update the statistics counters for an ingest of 'n' bytes.
+ */
+static void
+nanny_log_update_statistics(struct nanny_log *nlog, size_t n)
+{
+  size_t size;
+  int bucket;
+
+  nlog->read_count += 1;
+  ++nlog->generation;
+  for (size = n, bucket = 0;
+       size > 1 && bucket < NANNY_LOG_READ_BUCKETS - 1; bucket++)
+    size >>= 1;
+  nlog->read_sizes[bucket] += 1;
+
+  if (nlog->bps_last_update_time != nanny_globals.now) {
+    nanny_log_fold_rates(nlog, nlog->bps_rate);
+    nlog->bps_last_update_time = nanny_globals.now;
+    nlog->bps_pending = 0;
+  }
+  nlog->bps_pending += n;
+}
+
+/*
+ * Current 1, 5 and 15 minute rates in bytes/second, decayed to now.
+ */
+void
+nanny_log_rates(struct nanny_log *nlog, double *one, double *five,
+		double *fifteen)
+{
+  double rates[NANNY_LOG_RATES];
+
+  nanny_log_fold_rates(nlog, rates);
+  *one = rates[0];
+  *five = rates[1];
+  *fifteen = rates[2];
 }
 
 /*
  * Useful to write status/progress messages into the child's event log.
+ *
+ * Messages are formatted straight into the free space at the end of
+ * the ring, and the disk writer takes them from there.  Only when a
+ * message won't fit in what's left of the current chunk (or there's
+ * no ring) is it formatted again into a scratch buffer and copied in.
  */
 void
 nanny_log_printf(struct nanny_log *nlog, char *fmt, ...)
 {
-  char msg[8192];
-  char *p;
+  static char msg[8192];
+  char *tail;
+  size_t avail, len;
   va_list ap;
-  ptrdiff_t towrite;
+  int n;
+
+  tail = nanny_log_ring_tail(nlog, &avail);
+  if (tail != NULL) {
+    va_start(ap, fmt);
+    n = vsnprintf(tail, avail, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if ((size_t)n < avail) {
+      nanny_log_write_file(nlog, tail, n);
+      nanny_log_ring_commit(nlog, n);
+      nanny_log_update_statistics(nlog, n);
+      return;
+    }
+  }
 
   va_start(ap, fmt);
-  vsnprintf(msg, sizeof(msg), fmt, ap);
+  n = vsnprintf(msg, sizeof(msg), fmt, ap);
   va_end(ap);
-
-  nanny_log_rotate(nlog);
-  if (nlog->file_fd >= 0)
-    write(nlog->file_fd, msg, strlen(msg));
-
-  p = msg;
-  while (*p != '\0') {
-    towrite = strlen(p);
-    if (towrite > nlog->buff_end - nlog->buffp)
-      towrite = nlog->buff_end - nlog->buffp;
-    memcpy(nlog->buffp, p, towrite);
-    p += towrite;
-    nlog->buffp += towrite;
-    nlog->total_bytes += towrite;
-    nlog->read_count += 1;
-    if (nlog->buffp >= nlog->buff_end)
-      nlog->buffp = nlog->buff;
-  }
-  nanny_log_update_statistics(nlog);
+  if (n < 0)
+    return;
+  len = ((size_t)n < sizeof(msg)) ? (size_t)n : sizeof(msg) - 1;
+  nanny_log_write_file(nlog, msg, len);
+  nanny_log_ring_append(nlog, msg, len);
+  nanny_log_update_statistics(nlog, len);
 }
 
 /*
  * Registered as a server so it gets select()-based read events
- * when data is available on the pipe.  The overhead of this
- * very simple circular buffer is extraordinarily low.
- * Note that if we read and hit the end of the buffer, we'll
- * get another select() event at the next poll, so we don't
- * need to bother trying to handle wrap around apart from
- * resetting the pointer.
+ * when data is available on the pipe.  Each read lands in one
+ * shared staging buffer, so a busy pipe is drained in large reads
+ * whatever the state of the ring; from there metrics are extracted,
+ * repeats are collapsed, it is rate limited, written to disk and
+ * copied into the ring's chunks.
  */
+static char input_staging[65536];
+
 static void
 nanny_log_input_server(void *_io)
 {
   ssize_t bytesread;
+  size_t kept, len;
+  const char *p;
+  char *buff;
   struct nanny_log_io *io = (struct nanny_log_io *)_io;
   struct nanny_log *nlog = io->buff;
 
-  bytesread = read(io->fd, nlog->buffp, nlog->buff_end - nlog->buffp);
+  bytesread = read(io->fd, input_staging, sizeof(input_staging));
   if (bytesread == 0) {
     /* Close the fd */
     close(io->fd);
@@ -343,6 +523,7 @@ nanny_log_input_server(void *_io)
   }
   if (bytesread < 0) {
     nlog->error_count += 1;
+    ++nlog->generation;
     if (errno == EINTR) /* Interrupted by some signal; try again later. */
       return;
     if (errno == EAGAIN) { /* No data available; try again later. */
@@ -356,17 +537,23 @@ nanny_log_input_server(void *_io)
     return;
   }
 
-  nanny_log_rotate(nlog);
-  if (nlog->file_fd >= 0)
-    write(nlog->file_fd, nlog->buffp, bytesread);
-
-  nlog->buffp += bytesread;
-  nlog->read_count += 1;
-  nlog->total_bytes += bytesread;
-  nanny_log_update_statistics(nlog);
+  nanny_log_update_statistics(nlog, bytesread);
+  if (nlog->metrics != NULL)
+    nanny_log_metrics(nlog, input_staging, bytesread);
+  buff = input_staging;
+  len = bytesread;
+  if (nlog->dedup)
+    buff = nanny_log_dedup(nlog, input_staging, &len);
+  kept = len;
+  p = buff;
+  if (nlog->limit_rate > 0) {
+    p = nanny_log_admit(nlog, buff, &kept, nlog->limit_ring);
+    if (nlog->limit_ring)
+      len = kept;
+  }
 
-  if (nlog->buffp >= nlog->buff_end)
-    nlog->buffp = nlog->buff;
+  nanny_log_write_file(nlog, p, kept);
+  nanny_log_ring_append(nlog, buff, len);
 }
 
 /*
@@ -399,24 +586,108 @@ void
 nanny_log_http_dump_raw(struct http_request *request, struct nanny_log *nlog)
 {
   const char *p;
+  uintmax_t offset = nanny_log_oldest(nlog);
+  size_t n;
 
-  /* Emit from buffp -> buff end */
-  p = nlog->buffp;
-  while (p < nlog->buff_end) {
-    if (*p != '\0')
-      http_printf(request, "%c", *p);
-    ++p;
+  while ((n = nanny_log_ring_peek(nlog, offset, &p)) > 0) {
+    http_write(request, (void *)p, n);
+    offset += n;
   }
+}
+
+/*
+ * Log data is a stream:  every byte ever ingested has an offset, and
+ * total_bytes is the offset of the next byte to arrive.  The ring
+ * always holds the most recent bytes; nanny_log_ring_peek() finds the
+ * byte at offset 'n' for as long as it survives.
+ */
+uintmax_t
+nanny_log_cursor(struct nanny_log *nlog)
+{
+  return (nlog->total_bytes);
+}
+
+/*
+ * A counter that changes whenever anything shown in the log's status
+ * does:  new data, reads, events, rotation, archiving.
+ */
+uintmax_t
+nanny_log_generation(struct nanny_log *nlog)
+{
+  return (nlog == NULL ? 0 : nlog->generation);
+}
 
-  /* Emit from buff start -> buffp */
-  p = nlog->buff;
-  while (p < nlog->buffp) {
-    if (*p != '\0')
-      http_printf(request, "%c", *p);
-    ++p;
+/*
+ * One of the log's counters, for /metrics.
+ */
+uintmax_t
+nanny_log_counter(struct nanny_log *nlog, enum nanny_log_counter counter)
+{
+  if (nlog == NULL)
+    return (0);
+  switch (counter) {
+  case NANNY_LOG_BYTES:		return (nlog->total_bytes);
+  case NANNY_LOG_READS:		return (nlog->read_count);
+  case NANNY_LOG_ERRORS:	return (nlog->error_count);
+  case NANNY_LOG_SUPPRESSED_BYTES: return (nlog->suppressed_bytes);
+  case NANNY_LOG_SUPPRESSED_LINES: return (nlog->suppressed_lines);
+  case NANNY_LOG_REPEATED_LINES: return (nlog->dedup_lines);
+  case NANNY_LOG_RING_BYTES:
+    return (nlog->nchunks * (uintmax_t)NANNY_LOG_CHUNK);
+  case NANNY_LOG_FORWARDED_BYTES: return (nlog->forwarded_bytes);
+  case NANNY_LOG_FORWARD_DROPPED: return (nlog->forward_dropped);
+  case NANNY_LOG_ARCHIVED_FILES: return (nlog->archived_files);
+  case NANNY_LOG_DELETED_FILES:	return (nlog->deleted_files);
+  default:			return (0);
   }
 }
 
+/*
+ * Dump only the data that arrived at or after 'since'.  If some of
+ * that data has already been overwritten, say so in-line so the
+ * client knows its copy has a hole in it.  Returns the new cursor,
+ * which the client should pass as 'since' on its next request.
+ */
+uintmax_t
+nanny_log_clamp_cursor(struct http_request *request, struct nanny_log *nlog,
+		       uintmax_t since)
+{
+  uintmax_t end = nanny_log_cursor(nlog);
+  uintmax_t oldest = nanny_log_oldest(nlog);
+
+  if (since > end) {
+    /* Cursor from the future:  nanny probably restarted. */
+    http_printf(request, "# nanny: cursor %ju is past end of log %ju;"
+		" restarting from %ju\n", since, end, oldest);
+    since = oldest;
+  } else if (since < oldest) {
+    http_printf(request, "# nanny: %ju bytes lost to ring wraparound\n",
+		oldest - since);
+    since = oldest;
+  }
+  return (since);
+}
+
+uintmax_t
+nanny_log_http_dump_since(struct http_request *request,
+			  struct nanny_log *nlog,
+			  uintmax_t since)
+{
+  const char *p;
+  uintmax_t end = nanny_log_cursor(nlog);
+  size_t n;
+
+  since = nanny_log_clamp_cursor(request, nlog, since);
+  while (since < end) {
+    n = nanny_log_ring_peek(nlog, since, &p);
+    if (n == 0)
+      break;
+    http_write(request, (void *)p, n);
+    since += n;
+  }
+  return (since);
+}
+
 /*
  * Correctly quote a single character into a JSON response.
  */
@@ -465,8 +736,11 @@ nanny_log_http_dump_json(struct http_request *request,
 			 const char *name,
 			 const char *indent)
 {
-  const char *p;
-  int lines, chars;
+  const char *p, *sep;
+  double rate1, rate5, rate15;
+  uintmax_t offset;
+  size_t n;
+  int lines, chars, i;
 
   http_printf(request, "%s\"%s\": {\n", indent, name);
   if (nlog->filename_base)
@@ -477,31 +751,93 @@ nanny_log_http_dump_json(struct http_request *request,
 		indent, nlog->filename);
   http_printf(request, "%s  \"total_bytes\": %jd,\n",
 	      indent, nlog->total_bytes);
-  http_printf(request, "%s  \"read_count\": %d,\n",
+  http_printf(request, "%s  \"generation\": %ju,\n",
+	      indent, nlog->generation);
+  http_printf(request, "%s  \"read_count\": %ju,\n",
 	      indent, nlog->read_count);
-  http_printf(request, "%s  \"error_count\": %d,\n",
+  http_printf(request, "%s  \"error_count\": %ju,\n",
 	      indent, nlog->error_count);
-  http_printf(request, "%s  \"bytes_per_second\": %f,\n",
-	      indent, nlog->bytes_per_second);
+  nanny_log_rates(nlog, &rate1, &rate5, &rate15);
+  http_printf(request, "%s  \"bytes_per_second\": %f,\n", indent, rate1);
+  http_printf(request, "%s  \"rate_1m\": %f,\n", indent, rate1);
+  http_printf(request, "%s  \"rate_5m\": %f,\n", indent, rate5);
+  http_printf(request, "%s  \"rate_15m\": %f,\n", indent, rate15);
+  /* Keyed by the smallest size that lands in each bucket. */
+  http_printf(request, "%s  \"read_sizes\": {", indent);
+  for (i = 0, sep = ""; i < NANNY_LOG_READ_BUCKETS; i++) {
+    if (nlog->read_sizes[i] == 0)
+      continue;
+    http_printf(request, "%s\"%lu\": %ju", sep, 1UL << i,
+		nlog->read_sizes[i]);
+    sep = ", ";
+  }
+  http_printf(request, "},\n");
+  if (nlog->limit_rate > 0) {
+    http_printf(request, "%s  \"limit_rate\": %ju,\n",
+		indent, nlog->limit_rate);
+    http_printf(request, "%s  \"limit_burst\": %ju,\n",
+		indent, nlog->limit_burst);
+  }
+  http_printf(request, "%s  \"suppressed_bytes\": %ju,\n",
+	      indent, nlog->suppressed_bytes);
+  http_printf(request, "%s  \"suppressed_lines\": %ju,\n",
+	      indent, nlog->suppressed_lines);
+  http_printf(request, "%s  \"sampled_lines\": %ju,\n",
+	      indent, nlog->sampled_lines);
+  if (nlog->subscribers != NULL)
+    nanny_log_json_subscribers(request, nlog, indent);
+  if (nlog->dedup) {
+    http_printf(request, "%s  \"repeated_lines\": %ju,\n",
+		indent, nlog->dedup_lines);
+    http_printf(request, "%s  \"repeated_bytes_saved\": %jd,\n",
+		indent, (intmax_t)(nlog->dedup_bytes - nlog->dedup_marker_bytes));
+  }
+  http_printf(request, "%s  \"ring_bytes\": %zu,\n",
+	      indent, nlog->nchunks * (size_t)NANNY_LOG_CHUNK);
+  http_printf(request, "%s  \"ring_max_bytes\": %zu,\n",
+	      indent, nlog->max_chunks * (size_t)NANNY_LOG_CHUNK);
+  if (nlog->history_max > 0) {
+    http_printf(request, "%s  \"history_bytes\": %zu,\n",
+		indent, nlog->history_bytes);
+    http_printf(request, "%s  \"history_max_bytes\": %zu,\n",
+		indent, nlog->history_max);
+    http_printf(request, "%s  \"history_raw_bytes\": %ju,\n",
+		indent, nlog->history_raw + nlog->history_pending_len);
+    if (nlog->history_bytes > 0)
+      http_printf(request, "%s  \"history_ratio\": %.2f,\n",
+		  indent, (double)nlog->history_raw / nlog->history_bytes);
+  }
+  if (nanny_log_forwarding(nlog)) {
+    http_printf(request, "%s  \"forwarded_bytes\": %ju,\n",
+		indent, nlog->forwarded_bytes);
+    http_printf(request, "%s  \"forward_dropped_bytes\": %ju,\n",
+		indent, nlog->forward_dropped);
+  }
+  nanny_log_json_sync(request, nlog, indent);
+  http_printf(request, "%s  \"archived_files\": %ju,\n",
+	      indent, nlog->archived_files);
+  if (nlog->archived_bytes_out > 0)
+    http_printf(request, "%s  \"compression_ratio\": %.2f,\n",
+		indent, (double)nlog->archived_bytes_in
+		/ nlog->archived_bytes_out);
+  http_printf(request, "%s  \"deleted_files\": %ju,\n",
+	      indent, nlog->deleted_files);
+  http_printf(request, "%s  \"bytes_reclaimed\": %ju,\n",
+	      indent, nlog->reclaimed_bytes);
+  if (nanny_log_event_cursor(nlog) > 0)
+    nanny_log_json_events(request, nlog, indent);
   http_printf(request, "%s  \"lines\": [\n", indent);
 
-  /* Emit from buffp -> buff end */
-  p = nlog->buffp;
   lines = chars = 0;
-  while (p < nlog->buff_end) {
-    http_status_buff_char(request, *p, &lines, &chars);
-    ++p;
-  }
-
-  /* Emit from buff start -> buffp */
-  p = nlog->buff;
-  while (p < nlog->buffp) {
-    http_status_buff_char(request, *p, &lines, &chars);
-    ++p;
+  offset = nanny_log_ring_oldest(nlog);
+  while ((n = nanny_log_ring_peek(nlog, offset, &p)) > 0) {
+    offset += n;
+    while (n-- > 0)
+      http_status_buff_char(request, *p++, &lines, &chars);
   }
   if (chars > 0 || lines > 0)
     http_printf(request, "\"\n"); /* Finish the unfinished line. */
 
   http_printf(request, "%s  ]\n", indent);
-  http_printf(request, "%s}\n", indent);
+  http_printf(request, "%s}", indent);
 }
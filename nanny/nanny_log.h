@@ -0,0 +1,277 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Internals of the log machinery, shared by the nanny_log*.c files.
+ * Everything else should treat a struct nanny_log as opaque.
+ */
+
+#define	NANNY_LOG_CHUNK		4096	/* Ring allocation unit. */
+#define	NANNY_LOG_RATES		3	/* 1, 5 and 15 minute averages. */
+#define	NANNY_LOG_READ_BUCKETS	17	/* log2 of ingest size, 1 .. 64k+. */
+#define	NANNY_LOG_EVENT_RECENT	4	/* Events compared for repeats. */
+
+struct nanny_log_event {
+  uintmax_t offset;	/* Text offset at which it happened. */
+  time_t time;
+  pid_t pid;
+  short type;
+  short arg;		/* Index into event_args, or -1. */
+  int status;
+  int signal;
+};
+
+struct nanny_log {
+  int refcnt;
+  char *filename_base;
+  char *filename;
+  int file_fd;
+  time_t last_rotate;
+  time_t last_write;
+  uintmax_t file_bytes; /* Written to the current file. */
+  uintmax_t file_start; /* Stream offset the current file began at. */
+
+  /* Rotation policy; see nanny_log_write_file(). */
+  uintmax_t rotate_bytes;
+  time_t rotate_interval;
+  time_t idle_close;
+  struct timer *timer;
+
+  uintmax_t total_bytes;
+  /* Bumped on anything that changes what the status pages show. */
+  uintmax_t generation;
+  uintmax_t read_count;
+  uintmax_t error_count;
+  /* Throughput; see nanny_log_update_statistics(). */
+  time_t bps_last_update_time;
+  uintmax_t bps_pending;	/* Arrived during bps_last_update_time. */
+  double bps_rate[NANNY_LOG_RATES];
+  uintmax_t read_sizes[NANNY_LOG_READ_BUCKETS];
+
+  /* The ring:  pooled chunks; see nanny_log_ring.c. */
+  char **chunks;	/* Circular, max_chunks long. */
+  size_t chunk_head;	/* chunks[chunk_head] starts at ring_base. */
+  size_t nchunks;
+  size_t max_chunks;
+  uintmax_t ring_base;
+  uintmax_t ring_valid;	/* Nothing before this is in the ring. */
+  time_t ring_idle;	/* Shrink after this many idle seconds. */
+  time_t last_ingest;
+  /* Compressed history behind the ring; see nanny_log_ring.c. */
+  struct nanny_log_segment *history, *history_tail;
+  size_t history_max;
+  size_t history_bytes;		/* Compressed. */
+  uintmax_t history_raw;	/* What that expands to. */
+  char *history_pending;	/* Evicted, not yet compressed. */
+  size_t history_pending_len;
+  uintmax_t history_pending_offset;
+
+  /* Rotated file compression and retention; see nanny_log_archive.c. */
+  int compress_level;
+  uintmax_t retain_bytes;
+  int retain_files;
+  time_t retain_age;
+  uintmax_t archived_files;
+  uintmax_t archived_bytes_in;
+  uintmax_t archived_bytes_out;
+  uintmax_t reclaimed_bytes;
+  uintmax_t deleted_files;
+
+  /* Arrival times, delta-encoded; see nanny_log_stamp.c. */
+  unsigned char *stamps;
+  size_t stamps_len;
+  size_t stamps_size;
+  uintmax_t stamp_first_offset;
+  time_t stamp_first_time;
+  uintmax_t stamp_last_offset;
+  time_t stamp_last_time;
+  int file_stamps;	/* Prefix each line on disk with its arrival time. */
+  int file_bol;		/* Next byte on disk starts a line. */
+
+  /* Collector forwarding; see nanny_log_forward.c. */
+  int forward_id;
+  char *forward_stream;	/* NULL:  not forwarded. */
+  uintmax_t forward_offset;
+  uintmax_t forwarded_bytes;
+  uintmax_t forward_dropped;
+
+  /* Binary event records; see nanny_log_event.c. */
+  struct nanny_log_event *events;
+  size_t events_max;
+  uintmax_t events_total;
+  char **event_args;
+  int event_nargs;
+  struct nanny_log_event event_recent[NANNY_LOG_EVENT_RECENT];
+  int event_recent_len[NANNY_LOG_EVENT_RECENT];	/* Rendered; 0 = not yet. */
+  int event_repeats;
+
+  /* Repeated-line suppression; see nanny_log_dedup.c. */
+  int dedup;
+  int dedup_valid;		/* The previous line is complete. */
+  int dedup_midline;		/* ... or still arriving. */
+  char *dedup_line;
+  size_t dedup_len;
+  uint64_t dedup_hash;
+  uintmax_t dedup_run;		/* Repeats not yet reported. */
+  struct timer *dedup_timer;
+  uintmax_t dedup_lines;
+  uintmax_t dedup_bytes;
+  uintmax_t dedup_marker_bytes;
+
+  /* Rules extracting metrics from lines; see nanny_log_metrics.c. */
+  struct nanny_log_metric *metrics;
+  char *metric_partial;		/* Start of an unfinished line. */
+  size_t metric_partial_len;
+
+  /* In-process readers; see nanny_log_subscribe.c. */
+  struct nanny_log_subscription *subscribers;
+  int publishing;
+  uintmax_t subscriber_lost;
+
+  /* Rate limit; see nanny_log_limit.c. */
+  uintmax_t limit_rate;
+  uintmax_t limit_burst;
+  uintmax_t limit_tokens;
+  time_t limit_refill;
+  int limit_ring;	/* Limit the ring too, not just the disk. */
+  int limit_sample;	/* Keep 1 in N lines over the limit. */
+  uintmax_t limit_over;	/* Lines over the limit, for sampling. */
+  int limit_state;	/* Fate of the line in progress. */
+  struct timer *limit_timer;
+  uintmax_t suppressed_bytes;
+  uintmax_t suppressed_lines;
+  uintmax_t sampled_lines;
+  uintmax_t limit_unreported_bytes;
+  uintmax_t limit_unreported_lines;
+  uintmax_t limit_unreported_sampled;
+  struct nanny_log *notify;	/* Where to report drops; NULL = here. */
+  char *label;
+
+  /* Durability; see nanny_log_sync.c. */
+  enum nanny_log_sync_mode sync_mode;
+  time_t sync_interval;
+  struct timer *sync_timer;
+  int sync_inflight;
+  uintmax_t disk_bytes;		/* Written to files, all time. */
+  uintmax_t sync_requested;	/* disk_bytes at the last sync queued. */
+  uintmax_t synced_bytes;	/* Known to be on stable storage. */
+  time_t unsynced_since;	/* Oldest write not yet synced; 0 = none. */
+  uintmax_t sync_count;
+  uintmax_t sync_errors;
+  long sync_latency_last;	/* Microseconds. */
+  long sync_latency_max;
+  uintmax_t sync_latency_total;
+
+  /* Page cache; also nanny_log_sync.c. */
+  int cache_drop;		/* Drop written data from the cache. */
+  uintmax_t cache_extent;	/* Preallocation unit; 0 = none. */
+  uintmax_t cache_mark;		/* Current file dropped up to here. */
+  uintmax_t prealloc_end;
+  uintmax_t cache_dropped_bytes;
+  uintmax_t preallocated_bytes;
+};
+
+struct nanny_log_stamp_iter {
+  struct nanny_log *nlog;
+  size_t pos;
+  uintmax_t offset;
+  time_t time;
+};
+
+/* Locate stream offset 'offset' in the ring; returns contiguous length. */
+size_t nanny_log_ring_peek(struct nanny_log *, uintmax_t, const char **);
+/* Add data at the end of the stream. */
+void nanny_log_ring_append(struct nanny_log *, const char *, size_t);
+/* Or write it in place:  free space in the newest chunk, then commit. */
+char *nanny_log_ring_tail(struct nanny_log *, size_t *);
+void nanny_log_ring_commit(struct nanny_log *, size_t);
+/* Return all but the newest 'keep' chunks to the pool. */
+void nanny_log_ring_shrink(struct nanny_log *, size_t);
+time_t nanny_log_ring_deadline(struct nanny_log *);
+/* Oldest offset in the ring itself, not counting history. */
+uintmax_t nanny_log_ring_oldest(struct nanny_log *);
+void nanny_log_history_free(struct nanny_log *);
+void nanny_log_ring_idle(struct nanny_log *, time_t);
+/* Queue output for the collector. */
+void nanny_log_forward(struct nanny_log *, const char *, size_t);
+/* Is output going to a collector, or to the consolidated file? */
+int nanny_log_forwarding(struct nanny_log *);
+int nanny_log_consolidated(struct nanny_log *);
+/* Open the current log file, or start a new one. */
+void nanny_log_open_file(struct nanny_log *);
+/* In consolidated mode, write to the shared file instead; see there. */
+int nanny_log_consolidate_write(struct nanny_log *, const char *, size_t);
+/* Append to the current log file, opening or rotating as needed. */
+void nanny_log_write_file(struct nanny_log *, const char *, size_t);
+void nanny_log_json_events(struct http_request *, struct nanny_log *,
+			   const char *);
+void nanny_log_events_free(struct nanny_log *);
+/* Hand new ring data to subscribers. */
+void nanny_log_publish(struct nanny_log *);
+void nanny_log_subscribers_free(struct nanny_log *);
+void nanny_log_json_subscribers(struct http_request *, struct nanny_log *,
+				const char *);
+/* Apply metric rules to fresh input. */
+void nanny_log_metrics(struct nanny_log *, const char *, size_t);
+void nanny_log_metrics_free(struct nanny_log *);
+/* Repeated-line suppression. */
+char *nanny_log_dedup(struct nanny_log *, const char *, size_t *);
+void nanny_log_dedup_arm(struct nanny_log *);
+void nanny_log_dedup_free(struct nanny_log *);
+void nanny_log_event_flush(struct nanny_log *);
+/* A record rendered as the line it would have been. */
+size_t nanny_log_event_text(struct nanny_log *, uintmax_t, uintmax_t *,
+			    char *, size_t);
+/* Queue an fdatasync() of the current file. */
+void nanny_log_sync(struct nanny_log *);
+/* The file is about to be closed (and finished, if rotating). */
+void nanny_log_sync_close(struct nanny_log *, int);
+/* Page cache handling around the current file's life. */
+void nanny_log_cache_open(struct nanny_log *);
+void nanny_log_cache_reserve(struct nanny_log *, size_t);
+void nanny_log_cache_written(struct nanny_log *);
+void nanny_log_cache_close(struct nanny_log *, int);
+void nanny_log_json_sync(struct http_request *, struct nanny_log *,
+			 const char *);
+/* Re-arm the log's rotation/idle timer. */
+void nanny_log_schedule(struct nanny_log *);
+/* Newest-first, NULL-terminated list of this log's rotated files. */
+char **nanny_log_rotated_files(struct nanny_log *);
+/* A log file was closed:  compress and expire old files. */
+void nanny_log_archive(struct nanny_log *);
+/* Bring a reader's cursor into range, telling the reader if it moved. */
+uintmax_t nanny_log_clamp_cursor(struct http_request *, struct nanny_log *,
+				 uintmax_t);
+/* Record the arrival time of data about to be appended. */
+void nanny_log_stamp(struct nanny_log *);
+void nanny_log_stamp_iter_init(struct nanny_log *,
+			       struct nanny_log_stamp_iter *);
+time_t nanny_log_stamp_lookup(struct nanny_log_stamp_iter *, uintmax_t);
+ssize_t nanny_log_write_stamped(struct nanny_log *, const char *, size_t);
+/* Apply the rate limit to fresh input; returns what to keep. */
+const char *nanny_log_admit(struct nanny_log *, char *, size_t *, int);
@@ -0,0 +1,444 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include "nanny.h"
+#include "nanny_log.h"
+#include "nanny_timer.h"
+
+/*
+ * Archiving of rotated log files.
+ *
+ * Each time a log file is rotated out, we look over that log's old
+ * files:  anything not yet compressed is queued for compression, and
+ * anything beyond the log's retention limits is deleted.  Compression
+ * happens in a forked worker running at the lowest CPU and I/O
+ * priority and throttled to a fixed input rate, so it never competes
+ * with the children.  The worker reports back over a pipe, which is
+ * how the compression statistics make it into the log.
+ *
+ * Both are off until configured:  by default rotated files are kept
+ * forever, uncompressed, as they always were.
+ */
+
+/* Wait this long after a rotation so simultaneous rotations share a worker. */
+#define ARCHIVE_BATCH_DELAY 5
+/* Worker reads and compresses this much at a time. */
+#define ARCHIVE_BLOCK 65536
+
+struct archive_job {
+  struct archive_job *next;
+  struct nanny_log *nlog;
+  char *path;
+  int level;
+};
+
+/* Jobs waiting for the next worker, and jobs the current worker owns. */
+static struct archive_job *archive_pending;
+static struct archive_job *archive_running;
+static int archive_worker_fd = -1;
+static struct timer *archive_timer;
+static uintmax_t archive_rate = 8 * 1024 * 1024;
+/* Partial line of worker output. */
+static char archive_reply[256];
+static size_t archive_reply_len;
+
+static void archive_start(void *, time_t);
+
+/*
+ * Limit the worker's input rate, in bytes per second.
+ */
+void
+nanny_log_archive_set_rate(uintmax_t bytes_per_second)
+{
+  archive_rate = bytes_per_second;
+}
+
+void
+nanny_log_set_compression(struct nanny_log *nlog, int level)
+{
+  if (level > 9)
+    level = 9;
+  nlog->compress_level = level;
+}
+
+void
+nanny_log_set_retention(struct nanny_log *nlog, uintmax_t max_bytes,
+			int max_files, time_t max_age)
+{
+  nlog->retain_bytes = max_bytes;
+  nlog->retain_files = max_files;
+  nlog->retain_age = max_age;
+}
+
+static int
+archive_queued(const char *path)
+{
+  struct archive_job *job;
+
+  for (job = archive_pending; job != NULL; job = job->next)
+    if (strcmp(job->path, path) == 0)
+      return (1);
+  for (job = archive_running; job != NULL; job = job->next)
+    if (strcmp(job->path, path) == 0)
+      return (1);
+  return (0);
+}
+
+static void
+archive_queue(struct nanny_log *nlog, const char *path)
+{
+  struct archive_job *job;
+
+  if (archive_queued(path))
+    return;
+  job = malloc(sizeof(*job));
+  if (job == NULL)
+    return;
+  if ((job->path = strdup(path)) == NULL) {
+    free(job);
+    return;
+  }
+  job->nlog = nlog;
+  nanny_log_retain(nlog);
+  job->level = nlog->compress_level;
+  job->next = archive_pending;
+  archive_pending = job;
+  if (archive_timer == NULL && archive_worker_fd < 0)
+    archive_timer = nanny_timer_add(nanny_globals.now + ARCHIVE_BATCH_DELAY,
+				    archive_start, NULL);
+}
+
+static int
+archive_suffix(const char *path, const char *suffix)
+{
+  size_t l = strlen(path), s = strlen(suffix);
+
+  return (l >= s && strcmp(path + l - s, suffix) == 0);
+}
+
+/*
+ * Remove the index of a deleted consolidated file, if it has one.
+ */
+static void
+archive_unlink_index(const char *path)
+{
+  char idx[1024];
+  size_t l = strlen(path);
+
+  if (archive_suffix(path, ".gz"))
+    l -= 3;
+  if (l + 5 > sizeof(idx))
+    return;
+  memcpy(idx, path, l);
+  strlcpy(idx + l, ".idx", sizeof(idx) - l);
+  unlink(idx);
+}
+
+/*
+ * Called whenever a log file has been closed.  Queue compression of
+ * old files and enforce the retention limits, newest files first.
+ */
+void
+nanny_log_archive(struct nanny_log *nlog)
+{
+  char **files;
+  struct stat st;
+  uintmax_t bytes = 0;
+  int i, count = 0, expired = 0;
+
+  if (nlog->compress_level <= 0 && nlog->retain_bytes == 0
+      && nlog->retain_files <= 0 && nlog->retain_age <= 0)
+    return;
+  files = nanny_log_rotated_files(nlog);
+  for (i = 0; files != NULL && files[i] != NULL; ++i) {
+    if (archive_suffix(files[i], ".tmp")
+	|| (nlog->filename != NULL && strcmp(files[i], nlog->filename) == 0)
+	|| lstat(files[i], &st) != 0 || !S_ISREG(st.st_mode)) {
+      free(files[i]);
+      continue;
+    }
+    ++count;
+    bytes += st.st_size;
+    /* Once one file is over a limit, so is everything older. */
+    if ((nlog->retain_files > 0 && count > nlog->retain_files)
+	|| (nlog->retain_bytes > 0 && bytes > nlog->retain_bytes)
+	|| (nlog->retain_age > 0
+	    && st.st_mtime < nanny_globals.now - nlog->retain_age))
+      expired = 1;
+    if (expired && !archive_queued(files[i])) {
+      if (unlink(files[i]) == 0) {
+	nlog->reclaimed_bytes += st.st_size;
+	nlog->deleted_files += 1;
+	++nlog->generation;
+	archive_unlink_index(files[i]);
+      }
+    } else if (nlog->compress_level > 0 && !archive_suffix(files[i], ".gz"))
+      archive_queue(nlog, files[i]);
+    free(files[i]);
+  }
+  free(files);
+}
+
+/*
+ * Worker side:  gzip 'path' to 'path.gz', throttled to archive_rate.
+ * Returns 0 on success and reports the input and output sizes.
+ */
+static int
+archive_compress(const char *path, int level, struct timeval *start,
+		 uintmax_t *done, uintmax_t *in, uintmax_t *out)
+{
+  unsigned char ibuff[ARCHIVE_BLOCK], obuff[ARCHIVE_BLOCK];
+  char tmp[1100], gz[1100];
+  struct stat st;
+  struct timeval now, tv[2];
+  z_stream zs;
+  ssize_t n;
+  double ahead;
+  int ifd, ofd, flush, ret = -1;
+
+  snprintf(gz, sizeof(gz), "%s.gz", path);
+  snprintf(tmp, sizeof(tmp), "%s.gz.tmp", path);
+  if ((ifd = open(path, O_RDONLY)) < 0)
+    return (-1);
+  if (fstat(ifd, &st) != 0
+      || (ofd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+    close(ifd);
+    return (-1);
+  }
+  memset(&zs, 0, sizeof(zs));
+  /* windowBits + 16 selects a gzip wrapper so zcat et al. work. */
+  if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8,
+		   Z_DEFAULT_STRATEGY) != Z_OK) {
+    close(ifd);
+    close(ofd);
+    unlink(tmp);
+    return (-1);
+  }
+  *in = *out = 0;
+  do {
+    n = read(ifd, ibuff, sizeof(ibuff));
+    if (n < 0)
+      goto done;
+    *in += n;
+    *done += n;
+    flush = (n == 0) ? Z_FINISH : Z_NO_FLUSH;
+    zs.next_in = ibuff;
+    zs.avail_in = n;
+    do {
+      zs.next_out = obuff;
+      zs.avail_out = sizeof(obuff);
+      deflate(&zs, flush);
+      n = sizeof(obuff) - zs.avail_out;
+      if (n > 0 && write(ofd, obuff, n) != n)
+	goto done;
+      *out += n;
+    } while (zs.avail_out == 0);
+    /* Sleep off any time we're ahead of the permitted rate. */
+    if (archive_rate > 0) {
+      gettimeofday(&now, NULL);
+      ahead = (double)*done / archive_rate
+	- ((now.tv_sec - start->tv_sec)
+	   + (now.tv_usec - start->tv_usec) / 1000000.0);
+      if (ahead > 0)
+	usleep(ahead * 1000000);
+    }
+  } while (flush != Z_FINISH);
+
+  /* Keep the original timestamp so age-based retention still works. */
+  tv[0].tv_sec = st.st_atime;
+  tv[0].tv_usec = 0;
+  tv[1].tv_sec = st.st_mtime;
+  tv[1].tv_usec = 0;
+  /* Nobody reads archives soon; don't leave them in the page cache. */
+  if (fdatasync(ofd) == 0)
+    posix_fadvise(ofd, 0, 0, POSIX_FADV_DONTNEED);
+  if (close(ofd) == 0 && rename(tmp, gz) == 0) {
+    ofd = -1;
+    utimes(gz, tv);
+    unlink(path);
+    ret = 0;
+  }
+done:
+  deflateEnd(&zs);
+  close(ifd);
+  if (ret != 0) {
+    if (ofd >= 0)
+      close(ofd);
+    unlink(tmp);
+  }
+  return (ret);
+}
+
+/*
+ * Worker side:  compress every job in turn and report each result on
+ * fd as "<index> <bytes in> <bytes out>\n".
+ */
+static void
+archive_worker(int fd)
+{
+  struct archive_job *job;
+  struct timeval start;
+  uintmax_t done = 0, in, out;
+  char line[128];
+  int i, index;
+
+  /* Drop everything we inherited except the reply pipe. */
+  for (i = getdtablesize(); i >= 0; --i)
+    if (i != fd)
+      close(i);
+  setpriority(PRIO_PROCESS, 0, 19);
+#if defined(__linux__) && defined(SYS_ioprio_set)
+  /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE */
+  syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+
+  gettimeofday(&start, NULL);
+  for (job = archive_running, index = 0; job != NULL;
+       job = job->next, ++index) {
+    if (archive_compress(job->path, job->level, &start, &done, &in, &out))
+      continue;
+    snprintf(line, sizeof(line), "%d %ju %ju\n", index, in, out);
+    write(fd, line, strlen(line));
+  }
+  _exit(0);
+}
+
+static void
+archive_job_free(struct archive_job *job)
+{
+  nanny_log_release(job->nlog);
+  free(job->path);
+  free(job);
+}
+
+/*
+ * Parent side:  collect the worker's reports.  When the worker
+ * exits, release its jobs and start another if more work arrived.
+ */
+static void
+archive_worker_read(void *data)
+{
+  struct archive_job *job;
+  char *nl;
+  ssize_t n;
+  uintmax_t in, out;
+  int index;
+
+  n = read(archive_worker_fd, archive_reply + archive_reply_len,
+	   sizeof(archive_reply) - archive_reply_len - 1);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+  if (n <= 0) {
+    nanny_unregister_server(archive_worker_fd);
+    close(archive_worker_fd);
+    archive_worker_fd = -1;
+    archive_reply_len = 0;
+    while ((job = archive_running) != NULL) {
+      archive_running = job->next;
+      archive_job_free(job);
+    }
+    if (archive_pending != NULL && archive_timer == NULL)
+      archive_timer = nanny_timer_add(nanny_globals.now + ARCHIVE_BATCH_DELAY,
+				      archive_start, NULL);
+    return;
+  }
+  archive_reply_len += n;
+  archive_reply[archive_reply_len] = '\0';
+  while ((nl = strchr(archive_reply, '\n')) != NULL) {
+    *nl = '\0';
+    if (sscanf(archive_reply, "%d %ju %ju", &index, &in, &out) == 3) {
+      for (job = archive_running; job != NULL && index > 0; job = job->next)
+	--index;
+      if (job != NULL) {
+	job->nlog->archived_files += 1;
+	++job->nlog->generation;
+	job->nlog->archived_bytes_in += in;
+	job->nlog->archived_bytes_out += out;
+	if (in > out)
+	  job->nlog->reclaimed_bytes += in - out;
+      }
+    }
+    archive_reply_len -= nl + 1 - archive_reply;
+    memmove(archive_reply, nl + 1, archive_reply_len + 1);
+  }
+  if (archive_reply_len >= sizeof(archive_reply) - 1)
+    archive_reply_len = 0; /* Garbage; discard. */
+}
+
+/*
+ * Hand all pending jobs to a fresh worker process.
+ */
+static void
+archive_start(void *data, time_t now)
+{
+  int fds[2];
+  pid_t pid;
+
+  archive_timer = NULL;
+  if (archive_pending == NULL || archive_worker_fd >= 0)
+    return;
+  if (pipe(fds) != 0) {
+    archive_timer = nanny_timer_add(now + 60, archive_start, NULL);
+    return;
+  }
+  archive_running = archive_pending;
+  archive_pending = NULL;
+  pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    archive_worker(fds[1]);
+  }
+  close(fds[1]);
+  if (pid < 0) {
+    perror("fork");
+    close(fds[0]);
+    archive_pending = archive_running;
+    archive_running = NULL;
+    archive_timer = nanny_timer_add(now + 60, archive_start, NULL);
+    return;
+  }
+  archive_worker_fd = fds[0];
+  fcntl(archive_worker_fd, F_SETFL,
+	fcntl(archive_worker_fd, F_GETFL) | O_NONBLOCK);
+  nanny_register_server(archive_worker_read, archive_worker_fd, NULL);
+}
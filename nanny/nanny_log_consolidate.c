@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Consolidated log file.
+ *
+ * With many children, three rotated files apiece means a lot of open
+ * descriptors and a lot of file creation.  In consolidated mode every
+ * tagged log (see nanny_log_set_forward()) writes into one shared,
+ * rotated file instead, each write framed with a header line:
+ *
+ *   NANNY <id> <stream> <stream offset> <time> <length>\n<data>
+ *
+ * The header uses the same fields as the collector protocol.  Next
+ * to each data file is an index, <file>.idx, with one fixed-size
+ * binary record per frame so one child's output can be pulled out
+ * without reading everything else.  The shared file is an ordinary
+ * struct nanny_log, so rotation, archiving, retention and durability
+ * are configured on it like on any other log.
+ */
+
+#define	CONSOLIDATE_PAYLOAD	65536
+#define	CONSOLIDATE_HEADER	128
+
+/* One index record; host byte order. */
+struct consolidate_index {
+  uint64_t file_offset;		/* Of the frame header. */
+  uint64_t stream_offset;
+  int64_t time;
+  uint32_t id;
+  uint32_t length;		/* Of the data. */
+  char stream[8];
+};
+
+static struct nanny_log *shared;
+static char *index_name;	/* Data file the open index belongs to. */
+static int index_fd = -1;
+static char record[CONSOLIDATE_HEADER + CONSOLIDATE_PAYLOAD];
+
+/*
+ * Follow the shared log onto a new data file.
+ */
+static void
+consolidate_index_open(void)
+{
+  char path[1024];
+
+  if (index_fd >= 0)
+    close(index_fd);
+  free(index_name);
+  index_name = strdup(shared->filename);
+  if (index_name == NULL) {
+    fprintf(stderr, "nanny_log_consolidate: strdup failure\n");
+    exit(1);
+  }
+  snprintf(path, sizeof(path), "%s.idx", shared->filename);
+  index_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (index_fd < 0)
+    perror(path);
+  else
+    fcntl(index_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/*
+ * Does this log write to the shared file?
+ */
+int
+nanny_log_consolidated(struct nanny_log *nlog)
+{
+  return (shared != NULL && nlog != shared && nlog->forward_stream != NULL);
+}
+
+/*
+ * Write a tagged log's output to the shared file.  Returns nonzero if
+ * it was taken care of here (even if it could not be written), zero
+ * if the log should write its own file.
+ */
+int
+nanny_log_consolidate_write(struct nanny_log *nlog, const char *p, size_t n)
+{
+  struct consolidate_index entry;
+  uintmax_t offset = nlog->total_bytes;
+  size_t len, slen;
+  int hlen;
+
+  if (!nanny_log_consolidated(nlog))
+    return (0);
+  while (n > 0) {
+    if (shared->file_fd < 0) {
+      nanny_log_open_file(shared);
+      if (shared->file_fd < 0)
+	return (1);
+    }
+    if (index_name == NULL || strcmp(index_name, shared->filename) != 0)
+      consolidate_index_open();
+
+    len = (n > CONSOLIDATE_PAYLOAD) ? CONSOLIDATE_PAYLOAD : n;
+    hlen = snprintf(record, CONSOLIDATE_HEADER, "NANNY %d %s %ju %ld %zu\n",
+		    nlog->forward_id, nlog->forward_stream, offset,
+		    (long)nanny_globals.now, len);
+    if (hlen < 0 || hlen >= CONSOLIDATE_HEADER)
+      return (1);
+    memcpy(record + hlen, p, len);
+
+    if (index_fd >= 0) {
+      memset(&entry, 0, sizeof(entry));
+      entry.file_offset = shared->file_bytes;
+      entry.stream_offset = offset;
+      entry.time = nanny_globals.now;
+      entry.id = nlog->forward_id;
+      entry.length = len;
+      slen = strlen(nlog->forward_stream);
+      memcpy(entry.stream, nlog->forward_stream,
+	     slen < sizeof(entry.stream) ? slen : sizeof(entry.stream));
+      write(index_fd, &entry, sizeof(entry));
+    }
+    /* May rotate; the next frame notices the new file. */
+    nanny_log_write_file(shared, record, hlen + len);
+    p += len;
+    n -= len;
+    offset += len;
+  }
+  nlog->last_write = nanny_globals.now;
+  return (1);
+}
+
+/*
+ * Start writing all tagged logs to 'path' (a symlink to the current
+ * file, like any log's filename).  Returns the shared log so its
+ * rotation and retention can be tuned.
+ */
+struct nanny_log *
+nanny_log_consolidate(const char *path)
+{
+  if (shared == NULL) {
+    shared = nanny_log_alloc(0);
+    /* One file for everyone, so a larger one. */
+    nanny_log_set_rotation(shared, 64 * 1024 * 1024, 3600);
+    nanny_log_set_idle_close(shared, 0);
+  }
+  nanny_log_set_filename(shared, "%s", path);
+  return (shared);
+}
@@ -0,0 +1,217 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+#include "nanny_timer.h"
+
+/*
+ * Repeated-line suppression.
+ *
+ * A child stuck in a loop tends to print the same line over and over.
+ * With dedup enabled, each complete line read from the child is hashed
+ * and compared with the previous one; repeats are dropped from both
+ * the ring and the file and, once the run ends, replaced with
+ *
+ *   last line repeated N times
+ *
+ * If the marker would be longer than the lines it stands for, the
+ * lines are simply put back.  A long run gets a marker every
+ * DEDUP_FLUSH seconds so readers can see it's still going on.
+ * Events get the same treatment in nanny_log_event.c.
+ *
+ * A line that arrives in pieces across reads is always kept (its
+ * start has gone out before we see its end) but still counts as the
+ * previous line for the next one.  Lines up to DEDUP_LINE_MAX bytes
+ * are kept for an exact comparison; longer ones are compared by
+ * length and hash alone.
+ */
+
+#define	DEDUP_LINE_MAX	512
+#define	DEDUP_FLUSH	30
+#define	DEDUP_MARKER	64	/* Longest marker line. */
+
+#define	FNV_INIT	0xcbf29ce484222325ULL
+#define	FNV_PRIME	0x100000001b3ULL
+
+/* Input plus room for one marker left over from the previous read. */
+static char dedup_out[65536 + DEDUP_MARKER];
+
+static uint64_t
+fnv(uint64_t h, const char *p, size_t n)
+{
+  while (n-- > 0) {
+    h ^= (unsigned char)*p++;
+    h *= FNV_PRIME;
+  }
+  return (h);
+}
+
+/*
+ * The current run has ended:  put a marker (or the lines themselves)
+ * at 'o'.  Returns the number of bytes written.
+ */
+static size_t
+dedup_flush(struct nanny_log *nlog, char *o)
+{
+  uintmax_t i;
+  size_t n = 0;
+  int len;
+
+  if (nlog->dedup_run == 0)
+    return (0);
+  len = snprintf(o, DEDUP_MARKER, "last line repeated %ju times\n",
+		 nlog->dedup_run);
+  if (nlog->dedup_run * nlog->dedup_len > (uintmax_t)len) {
+    n = len;
+    nlog->dedup_marker_bytes += len;
+  } else {
+    for (i = 0; i < nlog->dedup_run; i++) {
+      memcpy(o + n, nlog->dedup_line, nlog->dedup_len);
+      n += nlog->dedup_len;
+    }
+    nlog->dedup_bytes -= n;
+    nlog->dedup_lines -= nlog->dedup_run;
+  }
+  nlog->dedup_run = 0;
+  return (n);
+}
+
+/*
+ * Report a long-running run without ending it.
+ */
+static void
+dedup_timer(void *_nlog, time_t now)
+{
+  struct nanny_log *nlog = _nlog;
+  char marker[DEDUP_MARKER];
+  size_t n;
+
+  (void)now; /* UNUSED */
+  nlog->dedup_timer = NULL;
+  n = dedup_flush(nlog, marker);
+  if (n > 0) {
+    nanny_log_write_file(nlog, marker, n);
+    nanny_log_ring_append(nlog, marker, n);
+  }
+  nanny_log_event_flush(nlog);
+}
+
+/*
+ * A run has started; make sure it gets reported.
+ */
+void
+nanny_log_dedup_arm(struct nanny_log *nlog)
+{
+  if (nlog->dedup_timer == NULL)
+    nlog->dedup_timer = nanny_timer_add(nanny_globals.now + DEDUP_FLUSH,
+					dedup_timer, nlog);
+}
+
+/*
+ * Filter freshly read input, returning what's left (in a buffer valid
+ * until the next call) and updating *np.
+ */
+char *
+nanny_log_dedup(struct nanny_log *nlog, const char *p, size_t *np)
+{
+  const char *end = p + *np, *nl;
+  char *o = dedup_out;
+  uint64_t h;
+  size_t len;
+
+  if (nlog->dedup_line == NULL) {
+    nlog->dedup_line = malloc(DEDUP_LINE_MAX);
+    if (nlog->dedup_line == NULL) {
+      fprintf(stderr, "nanny_log_dedup: malloc failure\n");
+      exit(1);
+    }
+  }
+  while (p < end) {
+    nl = memchr(p, '\n', end - p);
+    len = (nl != NULL ? nl + 1 : end) - p;
+    if (nl != NULL && !nlog->dedup_midline && nlog->dedup_valid
+	&& len == nlog->dedup_len
+	&& fnv(FNV_INIT, p, len) == nlog->dedup_hash
+	&& (len > DEDUP_LINE_MAX || memcmp(p, nlog->dedup_line, len) == 0)) {
+      if (nlog->dedup_run++ == 0)
+	nanny_log_dedup_arm(nlog);
+      nlog->dedup_lines++;
+      nlog->dedup_bytes += len;
+      p += len;
+      continue;
+    }
+    o += dedup_flush(nlog, o);
+    memcpy(o, p, len);
+    o += len;
+
+    /* This is now the line to compare against. */
+    h = nlog->dedup_midline ? nlog->dedup_hash : FNV_INIT;
+    if (!nlog->dedup_midline)
+      nlog->dedup_len = 0;
+    if (nlog->dedup_len + len <= DEDUP_LINE_MAX)
+      memcpy(nlog->dedup_line + nlog->dedup_len, p, len);
+    nlog->dedup_hash = fnv(h, p, len);
+    nlog->dedup_len += len;
+    nlog->dedup_valid = (nl != NULL);
+    nlog->dedup_midline = (nl == NULL);
+    p += len;
+  }
+  *np = o - dedup_out;
+  return (dedup_out);
+}
+
+/*
+ * Turn repeated-line suppression on or off.
+ */
+void
+nanny_log_set_dedup(struct nanny_log *nlog, int enable)
+{
+  if (!enable && nlog->dedup_timer != NULL) {
+    nanny_timer_delete(nlog->dedup_timer);
+    dedup_timer(nlog, nanny_globals.now);
+  }
+  nlog->dedup = enable;
+  nlog->dedup_valid = 0;
+  nlog->dedup_midline = 0;
+}
+
+void
+nanny_log_dedup_free(struct nanny_log *nlog)
+{
+  nanny_timer_delete(nlog->dedup_timer);
+  nlog->dedup_timer = NULL;
+  free(nlog->dedup_line);
+  nlog->dedup_line = NULL;
+}
@@ -0,0 +1,480 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Binary event records.
+ *
+ * Child lifecycle events are stored as fixed-size records in a small
+ * ring beside the log's text, and are only formatted when someone
+ * looks:  an HTTP client, or the disk writer if the log has a file.
+ * Each record remembers the text offset at which it happened, so the
+ * two can be shown interleaved in their original order.  Command
+ * strings are interned per log so records stay fixed-size.
+ *
+ * With dedup enabled (see nanny_log_dedup.c), an event that matches
+ * one of the last few distinct events seen within EVENT_REPEAT_WINDOW
+ * seconds is only counted, so a crash loop or a failing health check
+ * settles into one cycle followed by a "repeated" record.  The pid
+ * and the running failure count don't make an event different.
+ */
+
+#define	EVENTS_MAX	256
+#define	EVENT_REPEAT_WINDOW	300
+
+static const char *event_names[NANNY_EVENT_TYPES] = {
+  "starting", "restarting", "stopping", "stopped", "sigterm", "sigkill",
+  "giveup", "health_start", "health_kill", "health_failed",
+  "health_failures", "repeated"
+};
+
+static int
+event_arg(struct nanny_log *nlog, const char *arg)
+{
+  int i;
+
+  if (arg == NULL)
+    return (-1);
+  for (i = 0; i < nlog->event_nargs; i++)
+    if (strcmp(nlog->event_args[i], arg) == 0)
+      return (i);
+  nlog->event_args = realloc(nlog->event_args,
+			     (i + 1) * sizeof(nlog->event_args[0]));
+  if (nlog->event_args == NULL
+      || (nlog->event_args[i] = strdup(arg)) == NULL) {
+    fprintf(stderr, "nanny_log_event: allocation failure\n");
+    exit(1);
+  }
+  nlog->event_nargs = i + 1;
+  return (i);
+}
+
+static struct nanny_log_event *
+event_get(struct nanny_log *nlog, uintmax_t seq)
+{
+  return (&nlog->events[seq % nlog->events_max]);
+}
+
+/* Sequence number of the oldest record still held. */
+static uintmax_t
+event_oldest(struct nanny_log *nlog)
+{
+  if (nlog->events_total < nlog->events_max)
+    return (0);
+  return (nlog->events_total - nlog->events_max);
+}
+
+/*
+ * Format a record as a line of text, as it would once have been
+ * printed into the log.
+ */
+static int
+event_render(struct nanny_log *nlog, const struct nanny_log_event *ev,
+	     char *buff, size_t size)
+{
+  const char *t = nanny_isotime(ev->time);
+  const char *arg = (ev->arg >= 0) ? nlog->event_args[ev->arg] : "";
+
+  switch (ev->type) {
+  case NANNY_EVENT_STARTING:
+  case NANNY_EVENT_RESTARTING:
+    return snprintf(buff, size, "%s: %s\tPID=%d\tCMD=%s\n", t,
+		    ev->type == NANNY_EVENT_STARTING
+		    ? "STARTING" : "RESTARTING", (int)ev->pid, arg);
+  case NANNY_EVENT_STOPPING:
+    if (ev->arg >= 0)
+      return snprintf(buff, size, "%s: STOPPING\tPID=%d\tCMD=%s\n",
+		      t, (int)ev->pid, arg);
+    return snprintf(buff, size, "%s: STOPPING\tPID=%d\tSIGNAL=%d\n",
+		    t, (int)ev->pid, ev->signal);
+  case NANNY_EVENT_STOPPED:
+    if (ev->signal != 0)
+      return snprintf(buff, size, "%s: STOPPED\tPID=%d\tSIGNAL=%d\n",
+		      t, (int)ev->pid, ev->signal);
+    return snprintf(buff, size, "%s: STOPPED\tPID=%d\tSTATUS=%d\n",
+		    t, (int)ev->pid, ev->status);
+  case NANNY_EVENT_SIGTERM:
+    return snprintf(buff, size, "%s: SENDING SIGTERM to PID=%d\n",
+		    t, (int)ev->pid);
+  case NANNY_EVENT_SIGKILL:
+    return snprintf(buff, size, "%s: SENDING SIGKILL to PID=%d\n",
+		    t, (int)ev->pid);
+  case NANNY_EVENT_GIVING_UP:
+    return snprintf(buff, size, "%s: GIVING UP ON PID=%d\n",
+		    t, (int)ev->pid);
+  case NANNY_EVENT_HEALTH_START:
+    return snprintf(buff, size, "%s: Started health check, pid=%d\n",
+		    t, (int)ev->pid);
+  case NANNY_EVENT_HEALTH_KILL:
+    return snprintf(buff, size, "%s: Killing health check, pid=%d\n",
+		    t, (int)ev->pid);
+  case NANNY_EVENT_HEALTH_FAILED:
+    if (ev->signal != 0)
+      return snprintf(buff, size, "%s: Health check exited on signal %d\n",
+		      t, ev->signal);
+    return snprintf(buff, size, "%s: Health check failed with exit code %d\n",
+		    t, ev->status);
+  case NANNY_EVENT_HEALTH_FAILURES:
+    return snprintf(buff, size, "%s: %d consecutive failures\n",
+		    t, ev->status);
+  case NANNY_EVENT_REPEATED:
+    return snprintf(buff, size, "%s: %d repeated events suppressed\n",
+		    t, ev->status);
+  }
+  return snprintf(buff, size, "%s: EVENT %d\n", t, ev->type);
+}
+
+static int
+event_same(const struct nanny_log_event *a, const struct nanny_log_event *b)
+{
+  return (a->type == b->type && a->arg == b->arg && a->signal == b->signal
+	  && (a->status == b->status
+	      || a->type == NANNY_EVENT_HEALTH_FAILURES));
+}
+
+/*
+ * Is this a repeat of a recent event?  If so count it; if not,
+ * remember it in place of the least recently seen one.
+ */
+static int
+event_repeat(struct nanny_log *nlog, const struct nanny_log_event *ev)
+{
+  struct nanny_log_event *r;
+  int i, lru = -1;
+
+  for (i = 0; i < NANNY_LOG_EVENT_RECENT; i++) {
+    r = &nlog->event_recent[i];
+    if (r->time != 0 && ev->time - r->time <= EVENT_REPEAT_WINDOW
+	&& event_same(r, ev)) {
+      r->time = ev->time;
+      if (nlog->event_repeats++ == 0)
+	nanny_log_dedup_arm(nlog);
+      /* Repeats render the same but for the odd digit; size it once. */
+      if (nlog->event_recent_len[i] == 0)
+	nlog->event_recent_len[i] = event_render(nlog, r, NULL, 0);
+      nlog->dedup_lines++;
+      nlog->dedup_bytes += nlog->event_recent_len[i];
+      ++nlog->generation;
+      return (1);
+    }
+    if (lru < 0 || r->time < nlog->event_recent[lru].time)
+      lru = i;
+  }
+  nanny_log_event_flush(nlog);
+  nlog->event_recent[lru] = *ev;
+  nlog->event_recent_len[lru] = 0;
+  return (0);
+}
+
+/*
+ * Close the current run of repeats with a record saying how many.
+ */
+void
+nanny_log_event_flush(struct nanny_log *nlog)
+{
+  int repeats = nlog->event_repeats;
+
+  if (repeats == 0)
+    return;
+  nlog->event_repeats = 0;
+  nanny_log_event(nlog, NANNY_EVENT_REPEATED, 0, repeats, 0, NULL);
+  nlog->dedup_marker_bytes +=
+    event_render(nlog, event_get(nlog, nlog->events_total - 1), NULL, 0);
+}
+
+/*
+ * Record an event.  'arg' is the relevant command line, if any;
+ * 'signal' is nonzero if the event concerns a signal rather than an
+ * exit status.
+ */
+void
+nanny_log_event(struct nanny_log *nlog, enum nanny_event_type type,
+		pid_t pid, int status, int signal, const char *arg)
+{
+  struct nanny_log_event *ev, rec;
+  char line[1024];
+  int len;
+
+  rec.offset = nlog->total_bytes;
+  rec.time = nanny_globals.now;
+  rec.pid = pid;
+  rec.type = type;
+  rec.arg = event_arg(nlog, arg);
+  rec.status = status;
+  rec.signal = signal;
+  if (nlog->dedup && type != NANNY_EVENT_REPEATED && event_repeat(nlog, &rec))
+    return;
+
+  if (nlog->events == NULL) {
+    nlog->events_max = EVENTS_MAX;
+    nlog->events = malloc(nlog->events_max * sizeof(*nlog->events));
+    if (nlog->events == NULL) {
+      fprintf(stderr, "nanny_log_event: malloc failure\n");
+      exit(1);
+    }
+  }
+  ev = event_get(nlog, nlog->events_total++);
+  *ev = rec;
+  ++nlog->generation;
+  if (nlog->subscribers != NULL)
+    nanny_log_publish(nlog);
+
+  /* Only pay for formatting if there's a file or collector to feed. */
+  if (nlog->filename_base != NULL || nanny_log_forwarding(nlog)
+      || nanny_log_consolidated(nlog)) {
+    len = event_render(nlog, ev, line, sizeof(line));
+    if (len >= (int)sizeof(line))
+      len = sizeof(line) - 1;
+    if (len > 0)
+      nanny_log_write_file(nlog, line, len);
+  }
+}
+
+/*
+ * Sequence number of the next event; the event analogue of
+ * nanny_log_cursor().
+ */
+uintmax_t
+nanny_log_event_cursor(struct nanny_log *nlog)
+{
+  return (nlog->events_total);
+}
+
+/*
+ * Sequence number of the oldest event still held.
+ */
+uintmax_t
+nanny_log_event_oldest(struct nanny_log *nlog)
+{
+  return (event_oldest(nlog));
+}
+
+/*
+ * Record 'seq' as a line of text, cut to fit 'buff', and the stream
+ * offset it happened at.  With no buffer, just how long the line is.
+ */
+size_t
+nanny_log_event_text(struct nanny_log *nlog, uintmax_t seq,
+		     uintmax_t *offset, char *buff, size_t size)
+{
+  const struct nanny_log_event *ev = event_get(nlog, seq);
+  int len;
+
+  if (offset != NULL)
+    *offset = ev->offset;
+  len = event_render(nlog, ev, buff, size);
+  if (len < 0)
+    return (0);
+  if (size > 0 && (size_t)len >= size)
+    len = size - 1;
+  return (len);
+}
+
+/*
+ * Parse a comma-separated list of event type names into a bitmask.
+ */
+unsigned
+nanny_log_event_mask(const char *list)
+{
+  unsigned mask = 0;
+  size_t len;
+  int i;
+
+  while (*list != '\0') {
+    len = strcspn(list, ",");
+    for (i = 0; i < NANNY_EVENT_TYPES; i++)
+      if (strlen(event_names[i]) == len
+	  && strncmp(list, event_names[i], len) == 0)
+	mask |= 1U << i;
+    list += len;
+    if (*list == ',')
+      list++;
+  }
+  return (mask);
+}
+
+static int
+event_selected(const struct nanny_log_event *ev, unsigned mask,
+	       time_t from, time_t to)
+{
+  return ((mask == 0 || (mask & (1U << ev->type)) != 0)
+	  && (from == 0 || ev->time >= from)
+	  && (to == 0 || ev->time <= to));
+}
+
+static void
+event_http_text(struct http_request *request, struct nanny_log *nlog,
+		const struct nanny_log_event *ev)
+{
+  char line[1024];
+  int len;
+
+  len = event_render(nlog, ev, line, sizeof(line));
+  if (len >= (int)sizeof(line))
+    len = sizeof(line) - 1;
+  if (len > 0)
+    http_write(request, line, len);
+}
+
+static void
+event_http_json(struct http_request *request, struct nanny_log *nlog,
+		uintmax_t seq, const char *indent, const char *sep)
+{
+  const struct nanny_log_event *ev = event_get(nlog, seq);
+  const char *p;
+
+  http_printf(request, "%s%s{\"seq\": %ju, \"time\": \"%s\", \"type\": \"%s\"",
+	      sep, indent, seq, nanny_isotime(ev->time),
+	      event_names[ev->type]);
+  if (ev->pid > 0)
+    http_printf(request, ", \"pid\": %d", (int)ev->pid);
+  if (ev->signal != 0)
+    http_printf(request, ", \"signal\": %d", ev->signal);
+  else if (ev->type == NANNY_EVENT_STOPPED
+	   || ev->type == NANNY_EVENT_HEALTH_FAILED
+	   || ev->type == NANNY_EVENT_HEALTH_FAILURES)
+    http_printf(request, ", \"status\": %d", ev->status);
+  if (ev->arg >= 0) {
+    http_printf(request, ", \"cmd\": \"");
+    for (p = nlog->event_args[ev->arg]; *p != '\0'; p++) {
+      if (*p == '"' || *p == '\\')
+	http_printf(request, "\\%c", *p);
+      else if ((unsigned char)*p < 32)
+	http_printf(request, "\\u%04X", 0xff & *p);
+      else
+	http_printf(request, "%c", *p);
+    }
+    http_printf(request, "\"");
+  }
+  http_printf(request, "}");
+}
+
+/*
+ * The records as a JSON array, for embedding in a status object.
+ */
+void
+nanny_log_json_events(struct http_request *request, struct nanny_log *nlog,
+		      const char *indent)
+{
+  uintmax_t seq;
+  const char *sep = "";
+
+  http_printf(request, "%s  \"events\": [\n", indent);
+  for (seq = event_oldest(nlog); seq < nlog->events_total; seq++) {
+    event_http_json(request, nlog, seq, "       ", sep);
+    sep = ",\n";
+  }
+  http_printf(request, "\n%s  ],\n", indent);
+}
+
+/*
+ * Dump an events log:  the text from offset 'since' interleaved with
+ * event records from sequence 'esince'.  If a type mask or time range
+ * is given only the matching records are shown, without the text.
+ * With 'json', matching records are returned as a JSON array.
+ */
+void
+nanny_log_http_dump_events(struct http_request *request,
+			   struct nanny_log *nlog, uintmax_t since,
+			   uintmax_t esince, unsigned mask,
+			   time_t from, time_t to, int json)
+{
+  uintmax_t end = nanny_log_cursor(nlog);
+  uintmax_t seq, oldest = event_oldest(nlog);
+  const struct nanny_log_event *ev;
+  const char *p, *sep = "";
+  size_t n;
+  int text = !json && mask == 0 && from == 0 && to == 0;
+
+  if (esince > nlog->events_total)
+    esince = oldest;	/* From the future:  nanny restarted. */
+  if (json) {
+    http_printf(request, "[\n");
+    for (seq = (esince > oldest) ? esince : oldest;
+	 seq < nlog->events_total; seq++) {
+      if (!event_selected(event_get(nlog, seq), mask, from, to))
+	continue;
+      event_http_json(request, nlog, seq, "  ", sep);
+      sep = ",\n";
+    }
+    http_printf(request, "\n]\n");
+    return;
+  }
+  /* The client's cursor has fallen off the ring.  A fetch without
+   * one starts at the oldest event, so never gets here. */
+  if (esince < oldest) {
+    http_printf(request, "# nanny: %ju events lost to ring wraparound\n",
+		oldest - esince);
+    esince = oldest;
+  }
+  if (!text) {
+    for (seq = esince; seq < nlog->events_total; seq++)
+      if (event_selected(event_get(nlog, seq), mask, from, to))
+	event_http_text(request, nlog, event_get(nlog, seq));
+    return;
+  }
+
+  since = nanny_log_clamp_cursor(request, nlog, since);
+  seq = esince;
+  for (;;) {
+    /* Records that happened before the next byte of text. */
+    while (seq < nlog->events_total
+	   && (since >= end || event_get(nlog, seq)->offset <= since))
+      event_http_text(request, nlog, event_get(nlog, seq++));
+    if (since >= end)
+      break;
+    n = nanny_log_ring_peek(nlog, since, &p);
+    if (n == 0)
+      break;
+    if (seq < nlog->events_total) {
+      ev = event_get(nlog, seq);
+      if (ev->offset < since + n)
+	n = ev->offset - since;
+    }
+    http_write(request, (void *)p, n);
+    since += n;
+  }
+}
+
+void
+nanny_log_events_free(struct nanny_log *nlog)
+{
+  int i;
+
+  free(nlog->events);
+  for (i = 0; i < nlog->event_nargs; i++)
+    free(nlog->event_args[i]);
+  free(nlog->event_args);
+}
@@ -0,0 +1,299 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE /* sendmmsg() */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+#include "nanny_timer.h"
+
+/*
+ * Forwarding to a log collector.
+ *
+ * Captured output can be sent as datagrams to a collector on a Unix
+ * datagram or UDP socket.  Each datagram starts with a header line
+ *     NANNY <child id> <stream> <offset> <time>\n
+ * followed by raw output; offset counts every byte offered for
+ * forwarding from that log, so a collector sees drops as gaps.
+ *
+ * Data is queued in a fixed set of slots, coalescing consecutive
+ * output from the same log, and sent in batches with sendmmsg() once
+ * the current pass through the event loop is done (or as soon as
+ * FWD_BATCH slots fill).  The socket is non-blocking and the queue
+ * is bounded:  if the collector can't keep up, new output is dropped
+ * and counted rather than stalling the loop.
+ */
+
+#define	FWD_DGRAM_MAX	8192
+#define	FWD_SLOTS	64
+#define	FWD_BATCH	16
+
+struct fwd_slot {
+  struct nanny_log *nlog;
+  uintmax_t next_offset;
+  size_t header;		/* Header length. */
+  size_t len;
+  char buff[FWD_DGRAM_MAX];
+};
+
+static int fwd_fd = -1;
+static struct sockaddr_storage fwd_addr;
+static socklen_t fwd_addrlen;
+static struct fwd_slot *fwd_slots;
+static size_t fwd_head;
+static size_t fwd_count;
+static struct timer *fwd_timer;
+
+#define	FWD_SLOT(i)	(&fwd_slots[(fwd_head + (i)) % FWD_SLOTS])
+
+static void
+fwd_pop(int sent)
+{
+  struct fwd_slot *slot = FWD_SLOT(0);
+
+  if (sent)
+    slot->nlog->forwarded_bytes += slot->len - slot->header;
+  else
+    slot->nlog->forward_dropped += slot->len - slot->header;
+  ++slot->nlog->generation;
+  nanny_log_release(slot->nlog);
+  slot->nlog = NULL;
+  fwd_head = (fwd_head + 1) % FWD_SLOTS;
+  fwd_count--;
+}
+
+static void fwd_flush_timer(void *, time_t);
+
+/*
+ * Send everything queued.  Stops early if the socket is full and
+ * tries again in a second; any other failure drops the datagram.
+ */
+static void
+fwd_flush(void)
+{
+#ifdef __linux__
+  struct mmsghdr msgs[FWD_SLOTS];
+  struct iovec iov[FWD_SLOTS];
+#endif
+  struct fwd_slot *slot;
+  size_t i, n;
+  int sent;
+
+  while (fwd_count > 0) {
+#ifdef __linux__
+    n = fwd_count;
+    memset(msgs, 0, n * sizeof(msgs[0]));
+    for (i = 0; i < n; i++) {
+      slot = FWD_SLOT(i);
+      iov[i].iov_base = slot->buff;
+      iov[i].iov_len = slot->len;
+      msgs[i].msg_hdr.msg_name = &fwd_addr;
+      msgs[i].msg_hdr.msg_namelen = fwd_addrlen;
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    sent = sendmmsg(fwd_fd, msgs, n, 0);
+#else
+    (void)n;
+    slot = FWD_SLOT(0);
+    sent = (sendto(fwd_fd, slot->buff, slot->len, 0,
+		   (struct sockaddr *)&fwd_addr, fwd_addrlen) < 0) ? -1 : 1;
+#endif
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+	if (fwd_timer == NULL)
+	  fwd_timer = nanny_timer_add(nanny_globals.now + 1,
+				      fwd_flush_timer, NULL);
+	return;
+      }
+      fwd_pop(0); /* No collector, or it rejected this one. */
+      continue;
+    }
+    for (i = 0; i < (size_t)sent; i++)
+      fwd_pop(1);
+  }
+}
+
+static void
+fwd_flush_timer(void *data, time_t now)
+{
+  (void)data; /* UNUSED */
+  (void)now; /* UNUSED */
+  fwd_timer = NULL;
+  fwd_flush();
+}
+
+/*
+ * Queue captured output for the collector.
+ */
+void
+nanny_log_forward(struct nanny_log *nlog, const char *p, size_t n)
+{
+  struct fwd_slot *slot;
+  size_t len;
+
+  if (!nanny_log_forwarding(nlog))
+    return;
+  while (n > 0) {
+    slot = (fwd_count > 0) ? FWD_SLOT(fwd_count - 1) : NULL;
+    if (slot == NULL || slot->nlog != nlog
+	|| slot->next_offset != nlog->forward_offset
+	|| slot->len == FWD_DGRAM_MAX) {
+      if (fwd_count == FWD_SLOTS) {
+	/* Collector is behind:  drop the rest. */
+	nlog->forward_dropped += n;
+	nlog->forward_offset += n;
+	++nlog->generation;
+	break;
+      }
+      slot = FWD_SLOT(fwd_count);
+      fwd_count++;
+      slot->nlog = nlog;
+      nanny_log_retain(nlog);
+      slot->next_offset = nlog->forward_offset;
+      slot->header = snprintf(slot->buff, FWD_DGRAM_MAX,
+			      "NANNY %d %s %ju %ld\n", nlog->forward_id,
+			      nlog->forward_stream, nlog->forward_offset,
+			      (long)nanny_globals.now);
+      slot->len = slot->header;
+    }
+    len = FWD_DGRAM_MAX - slot->len;
+    if (len > n)
+      len = n;
+    memcpy(slot->buff + slot->len, p, len);
+    slot->len += len;
+    slot->next_offset += len;
+    nlog->forward_offset += len;
+    p += len;
+    n -= len;
+  }
+  if (fwd_count >= FWD_BATCH)
+    fwd_flush();
+  else if (fwd_count > 0 && fwd_timer == NULL)
+    fwd_timer = nanny_timer_add(nanny_globals.now, fwd_flush_timer, NULL);
+}
+
+/*
+ * Is this log's output going to a collector right now?  Logs are
+ * tagged when they're created, collector or not, so check both.
+ */
+int
+nanny_log_forwarding(struct nanny_log *nlog)
+{
+  return (fwd_fd >= 0 && nlog->forward_stream != NULL);
+}
+
+/*
+ * Tag a log's forwarded output; a NULL stream stops forwarding it.
+ */
+void
+nanny_log_set_forward(struct nanny_log *nlog, int id, const char *stream)
+{
+  free(nlog->forward_stream);
+  nlog->forward_stream = (stream != NULL) ? strdup(stream) : NULL;
+  nlog->forward_id = id;
+}
+
+/*
+ * Start forwarding to a collector at "unix:<path>", "udp:<host>:<port>"
+ * or a bare path.  Returns 0 on success, -1 on failure.
+ */
+int
+nanny_log_forward_init(const char *target)
+{
+  struct sockaddr_un *sun;
+  struct addrinfo hints, *res;
+  char host[256];
+  const char *port;
+  int fd, err;
+
+  if (fwd_slots == NULL) {
+    fwd_slots = calloc(FWD_SLOTS, sizeof(*fwd_slots));
+    if (fwd_slots == NULL) {
+      fprintf(stderr, "nanny_log_forward_init: calloc failure\n");
+      return (-1);
+    }
+  }
+  memset(&fwd_addr, 0, sizeof(fwd_addr));
+  if (strncmp(target, "udp:", 4) == 0) {
+    target += 4;
+    port = strrchr(target, ':');
+    if (port == NULL || port - target >= (int)sizeof(host)) {
+      fprintf(stderr, "nanny_log_forward_init: bad target udp:%s\n", target);
+      return (-1);
+    }
+    memcpy(host, target, port - target);
+    host[port - target] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    err = getaddrinfo(host, port + 1, &hints, &res);
+    if (err != 0) {
+      fprintf(stderr, "nanny_log_forward_init: %s: %s\n",
+	      target, gai_strerror(err));
+      return (-1);
+    }
+    memcpy(&fwd_addr, res->ai_addr, res->ai_addrlen);
+    fwd_addrlen = res->ai_addrlen;
+    fd = socket(res->ai_family, SOCK_DGRAM, 0);
+    freeaddrinfo(res);
+  } else {
+    if (strncmp(target, "unix:", 5) == 0)
+      target += 5;
+    sun = (struct sockaddr_un *)&fwd_addr;
+    if (strlen(target) >= sizeof(sun->sun_path)) {
+      fprintf(stderr, "nanny_log_forward_init: path too long: %s\n", target);
+      return (-1);
+    }
+    sun->sun_family = AF_UNIX;
+    strlcpy(sun->sun_path, target, sizeof(sun->sun_path));
+    fwd_addrlen = sizeof(*sun);
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  }
+  if (fd < 0) {
+    perror("nanny_log_forward_init: socket");
+    return (-1);
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (fwd_fd >= 0) {
+    fwd_flush();
+    close(fwd_fd);
+  }
+  fwd_fd = fd;
+  return (0);
+}
@@ -0,0 +1,199 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+#include "nanny_timer.h"
+
+/*
+ * Rate limiting.
+ *
+ * Each log may have a token bucket that refills at limit_rate bytes
+ * per second up to limit_burst.  Input is always read from the pipe,
+ * so a child over its limit never blocks; whole lines that don't fit
+ * in the bucket are dropped, or one in limit_sample of them is kept
+ * anyway.  The limit applies to what goes to disk, and optionally to
+ * what goes into the ring as well.  Drops are counted exactly and
+ * summarised in the notify log (usually the child's events) every
+ * LIMIT_REPORT seconds while they continue.
+ */
+
+#define	LIMIT_REPORT	10
+
+enum { LIMIT_BOL, LIMIT_KEEPING, LIMIT_DROPPING };
+
+static char *scratch;
+static size_t scratch_size;
+
+static void
+nanny_log_limit_report(void *_nlog, time_t now)
+{
+  struct nanny_log *nlog = _nlog;
+
+  (void)now; /* UNUSED */
+  nlog->limit_timer = NULL;
+  if (nlog->limit_unreported_bytes == 0)
+    return;
+  nanny_log_printf(nlog->notify != NULL ? nlog->notify : nlog,
+		   "%s: %s%s%ju bytes (%ju lines) suppressed by rate limit,"
+		   " %ju lines sampled\n", nanny_isotime(0),
+		   nlog->label != NULL ? nlog->label : "",
+		   nlog->label != NULL ? ": " : "",
+		   nlog->limit_unreported_bytes, nlog->limit_unreported_lines,
+		   nlog->limit_unreported_sampled);
+  nlog->limit_unreported_bytes = 0;
+  nlog->limit_unreported_lines = 0;
+  nlog->limit_unreported_sampled = 0;
+}
+
+/*
+ * Apply the rate limit to 'n' freshly read bytes at 'p'.  Returns
+ * the bytes to keep and updates *np.  When everything fits this is
+ * just 'p'; otherwise the surviving lines are compacted, over 'p'
+ * itself if 'in_place' is set, else into a scratch buffer that is
+ * valid until the next call.
+ */
+const char *
+nanny_log_admit(struct nanny_log *nlog, char *p, size_t *np, int in_place)
+{
+  size_t n = *np, len, kept = 0;
+  char *q, *end = p + n, *out;
+  const char *nl;
+  int keep;
+
+  if (nlog->limit_refill != nanny_globals.now) {
+    if (nlog->limit_refill == 0)
+      nlog->limit_tokens = nlog->limit_burst;
+    else
+      nlog->limit_tokens += nlog->limit_rate
+	* (nanny_globals.now - nlog->limit_refill);
+    if (nlog->limit_tokens > nlog->limit_burst)
+      nlog->limit_tokens = nlog->limit_burst;
+    nlog->limit_refill = nanny_globals.now;
+  }
+
+  /* Common case:  it all fits. */
+  if (nlog->limit_state != LIMIT_DROPPING && nlog->limit_tokens >= n) {
+    nlog->limit_tokens -= n;
+    if (n > 0)
+      nlog->limit_state = (p[n - 1] == '\n') ? LIMIT_BOL : LIMIT_KEEPING;
+    return (p);
+  }
+
+  if (in_place)
+    out = p;
+  else {
+    if (scratch_size < n) {
+      scratch = realloc(scratch, n);
+      if (scratch == NULL) {
+	fprintf(stderr, "nanny_log_admit: realloc failure\n");
+	exit(1);
+      }
+      scratch_size = n;
+    }
+    out = scratch;
+  }
+
+  for (q = p; q < end; q += len) {
+    nl = memchr(q, '\n', end - q);
+    len = (nl != NULL) ? (size_t)(nl + 1 - q) : (size_t)(end - q);
+    if (nlog->limit_state != LIMIT_BOL)
+      keep = (nlog->limit_state == LIMIT_KEEPING);
+    else if (nlog->limit_tokens >= len)
+      keep = 1;
+    else if (nlog->limit_sample > 0
+	     && ++nlog->limit_over % nlog->limit_sample == 0) {
+      keep = 1;
+      nlog->sampled_lines++;
+      nlog->limit_unreported_sampled++;
+    } else {
+      keep = 0;
+      nlog->suppressed_lines++;
+      nlog->limit_unreported_lines++;
+    }
+    if (keep) {
+      nlog->limit_tokens -= (nlog->limit_tokens < len)
+	? nlog->limit_tokens : len;
+      memmove(out + kept, q, len);
+      kept += len;
+    } else {
+      nlog->suppressed_bytes += len;
+      nlog->limit_unreported_bytes += len;
+    }
+    if (nl != NULL)
+      nlog->limit_state = LIMIT_BOL;
+    else
+      nlog->limit_state = keep ? LIMIT_KEEPING : LIMIT_DROPPING;
+  }
+
+  if (nlog->limit_unreported_bytes > 0 && nlog->limit_timer == NULL)
+    nlog->limit_timer = nanny_timer_add(nanny_globals.now + LIMIT_REPORT,
+					nanny_log_limit_report, nlog);
+  *np = kept;
+  return (out);
+}
+
+/*
+ * Limit the log to 'rate' bytes/second with bursts up to 'burst'
+ * (default one second's worth).  A rate of zero removes the limit.
+ * With 'ring' set the ring is limited too; otherwise only the disk.
+ * A nonzero 'sample' keeps one in that many lines over the limit.
+ */
+void
+nanny_log_set_limit(struct nanny_log *nlog, uintmax_t rate, uintmax_t burst,
+		    int ring, int sample)
+{
+  nlog->limit_rate = rate;
+  nlog->limit_burst = (burst > 0) ? burst : rate;
+  nlog->limit_ring = ring;
+  nlog->limit_sample = (sample > 0) ? sample : 0;
+  nlog->limit_refill = 0;
+  nlog->limit_state = LIMIT_BOL;
+}
+
+/*
+ * Report rate limiting to 'notify' rather than to the log itself,
+ * tagging reports with 'label'.
+ */
+void
+nanny_log_set_notify(struct nanny_log *nlog, struct nanny_log *notify,
+		     const char *label)
+{
+  if (notify != NULL)
+    nanny_log_retain(notify);
+  if (nlog->notify != NULL)
+    nanny_log_release(nlog->notify);
+  nlog->notify = notify;
+  free(nlog->label);
+  nlog->label = (label != NULL) ? strdup(label) : NULL;
+}
@@ -0,0 +1,395 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE /* memmem(), memrchr() */
+#include <sys/types.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Metrics from log output.
+ *
+ * A rule pairs a name with a pattern that is looked for in each line
+ * as it's ingested.  Patterns are literal text plus two wildcards:
+ * '*' matches anything and '#' matches a number, the first of which
+ * is the rule's value.  A leading '^' ties the pattern to the start
+ * of the line; otherwise it may appear anywhere, and must begin with
+ * some literal text.  For example:
+ *
+ *   "requests served"		count matching lines
+ *   "^GET * #ms"		latency of each GET
+ *
+ * Each rule is one of:
+ *   count	number of matching lines
+ *   sum	total of the values
+ *   gauge	most recent value
+ *   histogram	count, sum, min, max and power-of-two buckets
+ *
+ * Rather than trying every rule at every line, each rule's leading
+ * literal is found with memmem() across the whole read, and only the
+ * lines containing it are matched in full.  A line split across reads
+ * is put back together (up to METRIC_LINE_MAX bytes) first.
+ */
+
+#define	METRIC_LINE_MAX		1024
+#define	METRIC_BUCKETS		32	/* <1, <2, <4 ... */
+
+enum metric_kind { METRIC_COUNT, METRIC_SUM, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+static const char *metric_kinds[] = { "count", "sum", "gauge", "histogram" };
+
+struct nanny_log_metric {
+  struct nanny_log_metric *next;
+  char *name;
+  char *pattern;
+  enum metric_kind kind;
+  int anchored;			/* '^':  only at the start of a line. */
+  const char *lead;		/* Leading literal, within 'pattern'. */
+  size_t lead_len;
+  const char *rest;		/* Everything after it. */
+  uintmax_t count;
+  double sum, min, max, last;
+  uintmax_t buckets[METRIC_BUCKETS];
+};
+
+/*
+ * Parse a number at p, no further than end.  Returns the end of it,
+ * or NULL if there isn't one.
+ */
+static const char *
+metric_number(const char *p, const char *end, double *value)
+{
+  double v = 0, scale = 1;
+  int neg = 0, digits = 0;
+
+  if (p < end && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+  while (p < end && *p >= '0' && *p <= '9') {
+    v = v * 10 + (*p++ - '0');
+    digits++;
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; p++) {
+      scale /= 10;
+      v += (*p - '0') * scale;
+      digits++;
+    }
+  }
+  if (digits == 0)
+    return (NULL);
+  *value = neg ? -v : v;
+  return (p);
+}
+
+/*
+ * Match pattern 'pat' against [p, end).  The first '#' sets *value.
+ */
+static int
+metric_match(const char *pat, const char *p, const char *end,
+	     double *value, int *have_value)
+{
+  const char *q;
+  double v;
+
+  for (; *pat != '\0'; pat++) {
+    switch (*pat) {
+    case '*':
+      /* Shortest first, skipping straight to the next literal. */
+      if (pat[1] == '\0')
+	return (1);
+      for (q = p; q <= end; q++) {
+	if (pat[1] != '#' && pat[1] != '*'
+	    && (q = memchr(q, pat[1], end - q)) == NULL)
+	  return (0);
+	if (metric_match(pat + 1, q, end, value, have_value))
+	  return (1);
+      }
+      return (0);
+    case '#':
+      if ((q = metric_number(p, end, &v)) == NULL)
+	return (0);
+      if (!*have_value) {
+	*value = v;
+	*have_value = 1;
+	if (metric_match(pat + 1, q, end, value, have_value))
+	  return (1);
+	*have_value = 0;
+	return (0);
+      }
+      p = q;
+      break;
+    default:
+      if (p >= end || *p != *pat)
+	return (0);
+      p++;
+    }
+  }
+  return (1);
+}
+
+static void
+metric_update(struct nanny_log_metric *m, double v)
+{
+  int b;
+
+  if (m->count == 0 || v < m->min)
+    m->min = v;
+  if (m->count == 0 || v > m->max)
+    m->max = v;
+  m->count++;
+  m->sum += v;
+  m->last = v;
+  if (m->kind == METRIC_HISTOGRAM) {
+    /* Bucket b counts values below 2^b. */
+    b = 0;
+    if (v >= 1)
+      frexp(v, &b);
+    if (b > METRIC_BUCKETS - 1)
+      b = METRIC_BUCKETS - 1;
+    m->buckets[b]++;
+  }
+}
+
+/*
+ * Try rule 'm' on the line [line, end), where the leading literal has
+ * been found at 'at'.  If that occurrence doesn't match, later ones on
+ * the same line might:  "took #ms" should find "took over; took 5ms".
+ */
+static void
+metric_line(struct nanny_log_metric *m, const char *line, const char *at,
+	    const char *end)
+{
+  double v;
+  int have_value;
+
+  if (m->anchored && at != line)
+    return;
+  do {
+    v = 0;
+    have_value = 0;
+    if (metric_match(m->rest, at + m->lead_len, end, &v, &have_value)
+	&& (m->kind == METRIC_COUNT || have_value)) {
+      metric_update(m, have_value ? v : 1);
+      return;
+    }
+  } while (!m->anchored && m->lead_len > 0
+	   && (at = memmem(at + 1, end - (at + 1), m->lead, m->lead_len))
+	   != NULL);
+}
+
+/*
+ * Apply every rule to each complete line in [p, end).
+ */
+static void
+metric_scan(struct nanny_log *nlog, const char *p, const char *end)
+{
+  struct nanny_log_metric *m;
+  const char *at, *line, *eol, *from;
+
+  for (m = nlog->metrics; m != NULL; m = m->next) {
+    from = p;
+    while (from < end
+	   && (at = memmem(from, end - from, m->lead, m->lead_len)) != NULL) {
+      line = memrchr(p, '\n', at - p);
+      line = (line == NULL) ? p : line + 1;
+      eol = memchr(at, '\n', end - at);
+      if (eol == NULL)
+	eol = end;
+      metric_line(m, line, at, eol);
+      from = eol + 1;
+    }
+  }
+}
+
+/*
+ * One line only; used for lines that were split across reads.
+ */
+static void
+metric_scan_line(struct nanny_log *nlog, const char *p, const char *end)
+{
+  struct nanny_log_metric *m;
+  const char *at;
+
+  for (m = nlog->metrics; m != NULL; m = m->next)
+    if ((at = memmem(p, end - p, m->lead, m->lead_len)) != NULL)
+      metric_line(m, p, at, end);
+}
+
+/*
+ * Feed freshly read input to the log's rules.
+ */
+void
+nanny_log_metrics(struct nanny_log *nlog, const char *p, size_t n)
+{
+  const char *end = p + n, *nl, *last;
+  size_t len;
+
+  /* Finish a line left over from the last read. */
+  if (nlog->metric_partial_len > 0) {
+    nl = memchr(p, '\n', n);
+    len = (nl != NULL ? nl : end) - p;
+    if (len > METRIC_LINE_MAX - nlog->metric_partial_len)
+      len = METRIC_LINE_MAX - nlog->metric_partial_len;
+    memcpy(nlog->metric_partial + nlog->metric_partial_len, p, len);
+    nlog->metric_partial_len += len;
+    if (nl == NULL)
+      return;
+    metric_scan_line(nlog, nlog->metric_partial,
+		     nlog->metric_partial + nlog->metric_partial_len);
+    nlog->metric_partial_len = 0;
+    p = nl + 1;
+  }
+
+  /* Whole lines. */
+  last = memrchr(p, '\n', end - p);
+  if (last != NULL) {
+    metric_scan(nlog, p, last);
+    p = last + 1;
+  }
+
+  /* Keep the start of an unfinished line. */
+  if (p < end) {
+    if (nlog->metric_partial == NULL
+	&& (nlog->metric_partial = malloc(METRIC_LINE_MAX)) == NULL) {
+      fprintf(stderr, "nanny_log_metrics: malloc failure\n");
+      exit(1);
+    }
+    len = end - p;
+    if (len > METRIC_LINE_MAX)
+      len = METRIC_LINE_MAX;
+    memcpy(nlog->metric_partial, p, len);
+    nlog->metric_partial_len = len;
+  }
+}
+
+/*
+ * Add a rule.  Returns 0, or -1 if the kind or pattern is no good.
+ */
+int
+nanny_log_add_metric(struct nanny_log *nlog, const char *name,
+		     const char *kind, const char *pattern)
+{
+  struct nanny_log_metric *m, **mp;
+  size_t i;
+
+  m = malloc(sizeof(*m));
+  if (m == NULL) {
+    fprintf(stderr, "nanny_log_add_metric: malloc failure\n");
+    exit(1);
+  }
+  memset(m, 0, sizeof(*m));
+  for (i = 0; i < sizeof(metric_kinds) / sizeof(metric_kinds[0]); i++)
+    if (strcmp(kind, metric_kinds[i]) == 0)
+      break;
+  if (i == sizeof(metric_kinds) / sizeof(metric_kinds[0])) {
+    free(m);
+    return (-1);
+  }
+  m->kind = i;
+  m->name = strdup(name);
+  m->pattern = strdup(pattern);
+  if (m->name == NULL || m->pattern == NULL) {
+    fprintf(stderr, "nanny_log_add_metric: strdup failure\n");
+    exit(1);
+  }
+  m->lead = m->pattern;
+  if (*m->lead == '^') {
+    m->anchored = 1;
+    m->lead++;
+  }
+  m->lead_len = strcspn(m->lead, "*#");
+  m->rest = m->lead + m->lead_len;
+  if (m->lead_len == 0) {
+    free(m->name);
+    free(m->pattern);
+    free(m);
+    return (-1);
+  }
+  for (mp = &nlog->metrics; *mp != NULL; mp = &(*mp)->next)
+    ;
+  *mp = m;
+  return (0);
+}
+
+void
+nanny_log_metrics_free(struct nanny_log *nlog)
+{
+  struct nanny_log_metric *m;
+
+  while ((m = nlog->metrics) != NULL) {
+    nlog->metrics = m->next;
+    free(m->name);
+    free(m->pattern);
+    free(m);
+  }
+  free(nlog->metric_partial);
+  nlog->metric_partial = NULL;
+  nlog->metric_partial_len = 0;
+}
+
+/*
+ * The log's metrics as the members of a JSON object.
+ */
+void
+nanny_log_http_dump_metrics(struct http_request *request,
+			    struct nanny_log *nlog, const char *indent)
+{
+  struct nanny_log_metric *m;
+  int b, sep;
+
+  for (m = nlog->metrics; m != NULL; m = m->next) {
+    http_printf(request, "%s\"%s\": {\"kind\": \"%s\", \"count\": %ju",
+		indent, m->name, metric_kinds[m->kind], m->count);
+    if (m->kind == METRIC_SUM || m->kind == METRIC_HISTOGRAM)
+      http_printf(request, ", \"sum\": %.17g", m->sum);
+    if (m->kind == METRIC_GAUGE && m->count > 0)
+      http_printf(request, ", \"value\": %.17g", m->last);
+    if (m->kind == METRIC_HISTOGRAM && m->count > 0) {
+      http_printf(request,
+		  ", \"min\": %.17g, \"max\": %.17g, \"buckets\": {",
+		  m->min, m->max);
+      for (b = 0, sep = 0; b < METRIC_BUCKETS; b++) {
+	if (m->buckets[b] == 0)
+	  continue;
+	if (b == METRIC_BUCKETS - 1)
+	  http_printf(request, "%s\"+Inf\": %ju", sep ? ", " : "",
+		      m->buckets[b]);
+	else
+	  http_printf(request, "%s\"%.0f\": %ju", sep ? ", " : "",
+		      ldexp(1, b), m->buckets[b]);
+	sep = 1;
+      }
+      http_printf(request, "}");
+    }
+    http_printf(request, "}%s\n", m->next != NULL ? "," : "");
+  }
+}
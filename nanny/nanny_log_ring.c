@@ -0,0 +1,500 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * The ring.
+ *
+ * A log's recent history is kept in fixed-size chunks drawn from a
+ * process-wide pool.  The chunks[] array is used circularly:  the
+ * chunk at chunk_head holds stream offsets starting at ring_base
+ * (always a multiple of NANNY_LOG_CHUNK), the one after it the next
+ * NANNY_LOG_CHUNK, and so on; new data goes at the end of the last
+ * chunk.  A ring takes chunks only as data arrives, up to max_chunks,
+ * after which the oldest chunk is recycled to the end just by moving
+ * chunk_head past it.
+ * A ring that has seen no input for ring_idle seconds gives all but
+ * its newest data back to the pool.
+ *
+ * Nothing is allocated until a log is first written, so a quiet
+ * child costs only its struct nanny_log.
+ *
+ * Optionally, chunks leaving the ring are kept as compressed history
+ * behind it, up to history_max compressed bytes.  Evicted data is
+ * gathered into HISTORY_SEGMENT-byte segments, each compressed on its
+ * own with zlib at its fastest level so any one can be expanded
+ * without the others.  nanny_log_oldest() and nanny_log_ring_peek()
+ * cover the history too, so readers see one longer stream.
+ */
+
+#define	CHUNK		NANNY_LOG_CHUNK
+#define	POOL_MAX	256	/* Idle chunks kept for reuse; 1MB. */
+#define	HISTORY_SEGMENT	(8 * CHUNK)
+
+/* The i'th oldest chunk in the ring. */
+#define	RING_CHUNK(nlog, i)	\
+  ((nlog)->chunks[((nlog)->chunk_head + (i)) % (nlog)->max_chunks])
+
+struct nanny_log_segment {
+  struct nanny_log_segment *next;
+  uintmax_t offset;
+  size_t len;			/* Uncompressed. */
+  size_t clen;
+  unsigned char data[1];
+};
+
+/* The most recently expanded segment, for sequential readers. */
+static const struct nanny_log_segment *expanded;
+static char expanded_data[HISTORY_SEGMENT];
+
+static void *pool;		/* Free chunks, linked through 1st word. */
+static size_t pool_count;
+
+static char *
+chunk_get(void)
+{
+  char *c;
+
+  if (pool != NULL) {
+    c = pool;
+    pool = *(void **)c;
+    pool_count--;
+    return (c);
+  }
+  c = malloc(CHUNK);
+  if (c == NULL) {
+    fprintf(stderr, "nanny_log: chunk allocation failure\n");
+    exit(1);
+  }
+  return (c);
+}
+
+static void
+chunk_put(char *c)
+{
+  if (pool_count >= POOL_MAX) {
+    free(c);
+    return;
+  }
+  *(void **)c = pool;
+  pool = c;
+  pool_count++;
+}
+
+static void
+history_drop_oldest(struct nanny_log *nlog)
+{
+  struct nanny_log_segment *seg = nlog->history;
+
+  nlog->history = seg->next;
+  if (nlog->history == NULL)
+    nlog->history_tail = NULL;
+  nlog->history_bytes -= seg->clen;
+  nlog->history_raw -= seg->len;
+  if (expanded == seg)
+    expanded = NULL;
+  free(seg);
+}
+
+/*
+ * Compress the pending data into a new segment at the end of the
+ * history, then trim the history to its budget.
+ */
+static void
+history_compress(struct nanny_log *nlog)
+{
+  struct nanny_log_segment *seg;
+  uLongf clen;
+
+  clen = compressBound(nlog->history_pending_len);
+  seg = malloc(sizeof(*seg) + clen);
+  if (seg == NULL) {
+    fprintf(stderr, "nanny_log: history allocation failure\n");
+    exit(1);
+  }
+  if (compress2(seg->data, &clen, (const Bytef *)nlog->history_pending,
+		nlog->history_pending_len, Z_BEST_SPEED) != Z_OK) {
+    free(seg);
+    nlog->history_pending_len = 0;
+    return;
+  }
+  seg = realloc(seg, sizeof(*seg) + clen);
+  seg->next = NULL;
+  seg->offset = nlog->history_pending_offset;
+  seg->len = nlog->history_pending_len;
+  seg->clen = clen;
+  if (nlog->history_tail != NULL)
+    nlog->history_tail->next = seg;
+  else
+    nlog->history = seg;
+  nlog->history_tail = seg;
+  nlog->history_bytes += clen;
+  nlog->history_raw += seg->len;
+  nlog->history_pending_offset += seg->len;
+  nlog->history_pending_len = 0;
+  while (nlog->history_bytes > nlog->history_max)
+    history_drop_oldest(nlog);
+}
+
+/*
+ * Forget all history.
+ */
+void
+nanny_log_history_free(struct nanny_log *nlog)
+{
+  while (nlog->history != NULL)
+    history_drop_oldest(nlog);
+  free(nlog->history_pending);
+  nlog->history_pending = NULL;
+  nlog->history_pending_len = 0;
+}
+
+/*
+ * The oldest chunk, which starts at ring_base, is leaving the ring;
+ * keep its contents as history.
+ */
+static void
+history_add(struct nanny_log *nlog, const char *chunk)
+{
+  uintmax_t start = nlog->ring_base;
+  const char *p;
+  size_t n, len;
+
+  if (nlog->history_max == 0)
+    return;
+  if (start < nlog->ring_valid)
+    start = nlog->ring_valid;
+  if (nlog->history_pending_offset + nlog->history_pending_len != start) {
+    /* Not contiguous with what we have (the ring restarted). */
+    nanny_log_history_free(nlog);
+    nlog->history_pending_offset = start;
+  }
+  if (nlog->history_pending == NULL) {
+    nlog->history_pending = malloc(HISTORY_SEGMENT);
+    if (nlog->history_pending == NULL) {
+      fprintf(stderr, "nanny_log: history allocation failure\n");
+      exit(1);
+    }
+  }
+  p = chunk + (start - nlog->ring_base);
+  n = nlog->ring_base + CHUNK - start;
+  while (n > 0) {
+    len = HISTORY_SEGMENT - nlog->history_pending_len;
+    if (len > n)
+      len = n;
+    memcpy(nlog->history_pending + nlog->history_pending_len, p, len);
+    nlog->history_pending_len += len;
+    p += len;
+    n -= len;
+    if (nlog->history_pending_len == HISTORY_SEGMENT)
+      history_compress(nlog);
+  }
+}
+
+/*
+ * Return the byte at 'offset' in the history and the number of
+ * contiguous bytes from there, expanding a segment if need be.
+ */
+static size_t
+history_peek(struct nanny_log *nlog, uintmax_t offset, const char **p)
+{
+  const struct nanny_log_segment *seg;
+  uLongf len;
+
+  if (offset >= nlog->history_pending_offset) {
+    if (offset >= nlog->history_pending_offset + nlog->history_pending_len)
+      return (0);
+    *p = nlog->history_pending + (offset - nlog->history_pending_offset);
+    return (nlog->history_pending_offset + nlog->history_pending_len
+	    - offset);
+  }
+  for (seg = nlog->history; seg != NULL; seg = seg->next)
+    if (offset < seg->offset + seg->len)
+      break;
+  if (seg == NULL || offset < seg->offset)
+    return (0);
+  if (expanded != seg) {
+    len = sizeof(expanded_data);
+    if (uncompress((Bytef *)expanded_data, &len, seg->data, seg->clen)
+	!= Z_OK || len != seg->len)
+      return (0);
+    expanded = seg;
+  }
+  *p = expanded_data + (offset - seg->offset);
+  return (seg->offset + seg->len - offset);
+}
+
+/*
+ * Give all but the newest 'keep' chunks back to the pool, moving
+ * their contents into the history unless the ring is being torn down.
+ */
+void
+nanny_log_ring_shrink(struct nanny_log *nlog, size_t keep)
+{
+  while (nlog->nchunks > keep) {
+    if (keep > 0)
+      history_add(nlog, RING_CHUNK(nlog, 0));
+    chunk_put(RING_CHUNK(nlog, 0));
+    nlog->chunk_head = (nlog->chunk_head + 1) % nlog->max_chunks;
+    nlog->nchunks--;
+    nlog->ring_base += CHUNK;
+  }
+}
+
+/*
+ * Chunks worth keeping once the ring has gone idle:  enough to hold
+ * the most recent CHUNK bytes.
+ */
+static size_t
+nanny_log_ring_idle_keep(struct nanny_log *nlog)
+{
+  if (nlog->nchunks == 0)
+    return (0);
+  if (nlog->total_bytes - nlog->ring_base
+      == nlog->nchunks * (uintmax_t)CHUNK)
+    return (1);	/* Newest chunk is full. */
+  return (2);
+}
+
+/*
+ * When the ring should next be shrunk, or 0 if there's no need.
+ */
+time_t
+nanny_log_ring_deadline(struct nanny_log *nlog)
+{
+  if (nlog->ring_idle == 0
+      || nlog->nchunks <= nanny_log_ring_idle_keep(nlog))
+    return (0);
+  return (nlog->last_ingest + nlog->ring_idle);
+}
+
+/*
+ * Called from the log's timer:  shrink the ring if it has gone idle.
+ */
+void
+nanny_log_ring_idle(struct nanny_log *nlog, time_t now)
+{
+  time_t deadline = nanny_log_ring_deadline(nlog);
+
+  if (deadline > 0 && now >= deadline) {
+    nanny_log_ring_shrink(nlog, nanny_log_ring_idle_keep(nlog));
+    ++nlog->generation;
+  }
+}
+
+/*
+ * Return the free space at the end of the newest chunk, starting,
+ * adding or recycling a chunk if there is none.  Nothing counts as
+ * part of the stream until it's committed.
+ */
+char *
+nanny_log_ring_tail(struct nanny_log *nlog, size_t *avail)
+{
+  size_t used;
+
+  if (nlog->max_chunks == 0) {
+    *avail = 0;
+    return (NULL);
+  }
+  if (nlog->nchunks == 0) {
+    /* Empty ring:  start a chunk at the current offset. */
+    nlog->ring_base = nlog->total_bytes - nlog->total_bytes % CHUNK;
+    nlog->ring_valid = nlog->total_bytes;
+    nlog->chunk_head = 0;
+    nlog->chunks[0] = chunk_get();
+    nlog->nchunks = 1;
+  }
+  used = nlog->total_bytes - nlog->ring_base
+    - (nlog->nchunks - 1) * (uintmax_t)CHUNK;
+  if (used == CHUNK) {
+    if (nlog->nchunks < nlog->max_chunks) {
+      RING_CHUNK(nlog, nlog->nchunks) = chunk_get();
+      nlog->nchunks++;
+      if (nlog->nchunks == 3)
+	nanny_log_schedule(nlog); /* Now worth shrinking when idle. */
+    } else {
+      /* Full:  the oldest chunk becomes the newest. */
+      history_add(nlog, RING_CHUNK(nlog, 0));
+      nlog->chunk_head = (nlog->chunk_head + 1) % nlog->max_chunks;
+      nlog->ring_base += CHUNK;
+    }
+    used = 0;
+  }
+  *avail = CHUNK - used;
+  return (RING_CHUNK(nlog, nlog->nchunks - 1) + used);
+}
+
+/*
+ * Data of length n has been placed at the ring's tail; make it part
+ * of the stream.
+ */
+void
+nanny_log_ring_commit(struct nanny_log *nlog, size_t n)
+{
+  nanny_log_stamp(nlog);
+  nlog->last_ingest = nanny_globals.now;
+  nlog->total_bytes += n;
+  ++nlog->generation;
+  if (nlog->subscribers != NULL)
+    nanny_log_publish(nlog);
+}
+
+/*
+ * Append data to the ring, advancing the end of the stream.
+ */
+void
+nanny_log_ring_append(struct nanny_log *nlog, const char *p, size_t n)
+{
+  size_t len;
+  char *c;
+
+  nanny_log_stamp(nlog);
+  nlog->last_ingest = nanny_globals.now;
+  ++nlog->generation;
+  if (nlog->max_chunks == 0) {
+    nlog->total_bytes += n;
+    if (nlog->subscribers != NULL)
+      nanny_log_publish(nlog);	/* Only to count what they missed. */
+    return;
+  }
+  while (n > 0) {
+    c = nanny_log_ring_tail(nlog, &len);
+    if (len > n)
+      len = n;
+    memcpy(c, p, len);
+    p += len;
+    n -= len;
+    nlog->total_bytes += len;
+  }
+  if (nlog->subscribers != NULL)
+    nanny_log_publish(nlog);
+}
+
+/*
+ * Offset of the oldest byte still held in memory, history included.
+ */
+uintmax_t
+nanny_log_oldest(struct nanny_log *nlog)
+{
+  if (nlog->history != NULL)
+    return (nlog->history->offset);
+  if (nlog->history_pending_len > 0)
+    return (nlog->history_pending_offset);
+  return (nanny_log_ring_oldest(nlog));
+}
+
+/*
+ * Offset of the oldest byte in the ring proper.
+ */
+uintmax_t
+nanny_log_ring_oldest(struct nanny_log *nlog)
+{
+  if (nlog->nchunks == 0)
+    return (nlog->total_bytes);
+  if (nlog->ring_base < nlog->ring_valid)
+    return (nlog->ring_valid);
+  return (nlog->ring_base);
+}
+
+/*
+ * Locate the ring byte at stream offset 'offset' and return the number
+ * of contiguous bytes available from there.  The offset must lie
+ * between nanny_log_oldest() and nanny_log_cursor().
+ */
+size_t
+nanny_log_ring_peek(struct nanny_log *nlog, uintmax_t offset, const char **p)
+{
+  uintmax_t rel;
+  size_t avail;
+
+  if (offset < nanny_log_oldest(nlog) || offset >= nlog->total_bytes)
+    return (0);
+  if (offset < nanny_log_ring_oldest(nlog))
+    return (history_peek(nlog, offset, p));
+  rel = offset - nlog->ring_base;
+  avail = CHUNK - rel % CHUNK;
+  if (avail > nlog->total_bytes - offset)
+    avail = nlog->total_bytes - offset;
+  *p = RING_CHUNK(nlog, rel / CHUNK) + rel % CHUNK;
+  return (avail);
+}
+
+/*
+ * Hold up to 'max_bytes' of recent data (rounded up to whole chunks)
+ * and shrink after 'idle' seconds without input; 0 never shrinks.
+ */
+void
+nanny_log_set_ring(struct nanny_log *nlog, size_t max_bytes, time_t idle)
+{
+  size_t max = (max_bytes + CHUNK - 1) / CHUNK;
+  char **chunks = NULL;
+  size_t i;
+
+  nanny_log_ring_shrink(nlog, max);
+  ++nlog->generation;
+  if (max == 0)
+    nanny_log_history_free(nlog);
+  else {
+    /* Lay the survivors out from the start of the new array. */
+    chunks = malloc(max * sizeof(chunks[0]));
+    if (chunks == NULL) {
+      fprintf(stderr, "nanny_log_set_ring: malloc failure\n");
+      exit(1);
+    }
+    for (i = 0; i < nlog->nchunks; i++)
+      chunks[i] = RING_CHUNK(nlog, i);
+  }
+  free(nlog->chunks);
+  nlog->chunks = chunks;
+  nlog->chunk_head = 0;
+  nlog->max_chunks = max;
+  nlog->ring_idle = idle;
+  nanny_log_schedule(nlog);
+}
+
+/*
+ * Keep up to 'max_bytes' of compressed history behind the ring;
+ * 0 turns it off.
+ */
+void
+nanny_log_set_history(struct nanny_log *nlog, size_t max_bytes)
+{
+  nlog->history_max = max_bytes;
+  if (max_bytes == 0)
+    nanny_log_history_free(nlog);
+  while (nlog->history != NULL && nlog->history_bytes > max_bytes)
+    history_drop_oldest(nlog);
+}
@@ -0,0 +1,473 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE /* memmem(), memrchr() */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Searching a log.
+ *
+ * The HTTP server answers from the supervising process's event loop,
+ * so a search is handed to a forked process (see http_detach()) and
+ * never runs in the loop itself.  The result and time limits are there
+ * so that a careless query can't tie up the host's disk or the
+ * client for long.
+ */
+
+/* Longest line we'll echo back for a single match. */
+#define SEARCH_LINE_MAX 1024
+/* Check the clock after scanning this many bytes of one file. */
+#define SEARCH_WINDOW (4 * 1024 * 1024)
+
+struct search {
+  struct http_request *request;
+  const char *needle;
+  size_t needle_len;
+  size_t matches;
+  size_t max_matches;
+  struct timeval deadline;
+  const char *stopped; /* Reason we stopped early, if any. */
+};
+
+static int
+search_expired(struct search *search)
+{
+  struct timeval now;
+
+  if (search->matches >= search->max_matches) {
+    search->stopped = "result limit reached";
+    return (1);
+  }
+  gettimeofday(&now, NULL);
+  if (timercmp(&now, &search->deadline, >)) {
+    search->stopped = "time limit reached";
+    return (1);
+  }
+  return (0);
+}
+
+/*
+ * Scan a contiguous block of log data.  Every line containing the
+ * needle is reported once, prefixed with 'source:offset:'.  Note
+ * that memmem() is vectorized in any libc worth using, so this runs
+ * at close to memory bandwidth.
+ */
+static void
+search_block(struct search *search, const char *source,
+	     const char *base, size_t size, uintmax_t base_offset)
+{
+  const char *p = base, *end = base + size, *window_end, *scan_end, *m;
+  const char *line, *eol;
+  size_t len;
+
+  while (p < end && search->stopped == NULL) {
+    /* Scan a window at a time so we can keep an eye on the clock. */
+    window_end = scan_end = end;
+    if ((size_t)(end - p) > SEARCH_WINDOW) {
+      window_end = p + SEARCH_WINDOW;
+      scan_end = window_end + search->needle_len - 1;
+      if (scan_end > end)
+	scan_end = end;
+    }
+    m = memmem(p, scan_end - p, search->needle, search->needle_len);
+    if (m == NULL || m >= window_end) {
+      p = window_end;
+      if (p < end)
+	search_expired(search);
+      continue;
+    }
+    /* Back up to the start of the line, forward to the end. */
+    for (line = m; line > base && line[-1] != '\n'
+	   && m - line < SEARCH_LINE_MAX; --line)
+      ;
+    eol = memchr(m, '\n', end - m);
+    if (eol == NULL)
+      eol = end;
+    len = eol - line;
+    if (len > SEARCH_LINE_MAX)
+      len = SEARCH_LINE_MAX;
+    http_printf(search->request, "%s:%ju: ", source,
+		base_offset + (uintmax_t)(line - base));
+    http_write(search->request, (void *)line, len);
+    http_printf(search->request, "\n");
+    ++search->matches;
+    p = eol + 1;
+    search_expired(search);
+  }
+}
+
+/*
+ * Copy the ring into a flat buffer so matches that straddle the
+ * wraparound point are found, then scan it.
+ */
+static void
+search_ring(struct search *search, struct nanny_log *nlog)
+{
+  uintmax_t offset = nanny_log_oldest(nlog), end = nanny_log_cursor(nlog);
+  const char *p;
+  char *flat;
+  size_t n, used = 0;
+
+  if (end == offset)
+    return;
+  flat = malloc(end - offset);
+  if (flat == NULL)
+    return;
+  while (offset + used < end) {
+    n = nanny_log_ring_peek(nlog, offset + used, &p);
+    if (n == 0)
+      break;
+    memcpy(flat + used, p, n);
+    used += n;
+  }
+  search_block(search, "ring", flat, used, offset);
+  free(flat);
+}
+
+/*
+ * Event records are kept apart from the ring's text (see
+ * nanny_log_event.c); search each one's rendered line, and report it
+ * by sequence number.  Only those from stream offset 'from' on:  with
+ * log files, the earlier ones are on disk along with the text.
+ */
+static void
+search_events(struct search *search, struct nanny_log *nlog, uintmax_t from)
+{
+  char line[SEARCH_LINE_MAX + 1];
+  uintmax_t seq, offset;
+  size_t len;
+
+  for (seq = nanny_log_event_oldest(nlog);
+       seq < nanny_log_event_cursor(nlog) && search->stopped == NULL; seq++) {
+    len = nanny_log_event_text(nlog, seq, &offset, line, sizeof(line));
+    if (offset >= from)
+      search_block(search, "event", line, len, seq);
+  }
+}
+
+/*
+ * Search a plain file, or only its first 'limit' bytes (up to the
+ * last whole line) if 'limit' is nonzero.
+ */
+static void
+search_file(struct search *search, const char *path, uintmax_t limit)
+{
+  struct stat st;
+  const char *end;
+  size_t size;
+  void *map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    close(fd);
+    return;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+  size = st.st_size;
+  if (limit > 0 && limit < size) {
+    end = memrchr(map, '\n', limit);
+    size = (end == NULL) ? 0 : (size_t)(end + 1 - (const char *)map);
+  }
+  search_block(search, path, map, size, 0);
+  munmap(map, st.st_size);
+}
+
+/*
+ * Compressed files are inflated a block at a time; any partial line
+ * at the end of a block is carried over to the next one.
+ */
+static void
+search_gzfile(struct search *search, const char *path)
+{
+  gzFile gz;
+  char *buff;
+  size_t carry = 0, total, upto;
+  uintmax_t offset = 0;
+  int n;
+
+  if ((gz = gzopen(path, "rb")) == NULL)
+    return;
+  buff = malloc(2 * SEARCH_WINDOW);
+  if (buff == NULL) {
+    gzclose(gz);
+    return;
+  }
+  while (search->stopped == NULL
+	 && (n = gzread(gz, buff + carry, SEARCH_WINDOW)) > 0) {
+    total = carry + n;
+    for (upto = total; upto > 0 && buff[upto - 1] != '\n'; --upto)
+      ;
+    if (upto == 0 || total - upto >= SEARCH_WINDOW)
+      upto = total; /* No line break in sight; take it all. */
+    search_block(search, path, buff, upto, offset);
+    offset += upto;
+    carry = total - upto;
+    memmove(buff, buff + upto, carry);
+    if (search->stopped == NULL)
+      search_expired(search);
+  }
+  if (carry > 0 && search->stopped == NULL)
+    search_block(search, path, buff, carry, offset);
+  free(buff);
+  gzclose(gz);
+}
+
+static int
+search_name_compare(const void *a, const void *b)
+{
+  /* Newest first; the timestamp suffix sorts lexically. */
+  return (strcmp(*(char * const *)b, *(char * const *)a));
+}
+
+/*
+ * Return a NULL-terminated, newest-first list of the rotated files
+ * that belong to this log.  Caller frees each entry and the list.
+ */
+char **
+nanny_log_rotated_files(struct nanny_log *nlog)
+{
+  char dirname[1024];
+  const char *base;
+  struct dirent *de;
+  DIR *dir;
+  char **names = NULL, **n;
+  size_t count = 0, alloc = 0, baselen, dirlen, l;
+
+  if (nlog->filename_base == NULL)
+    return (NULL);
+  base = strrchr(nlog->filename_base, '/');
+  if (base == NULL) {
+    strlcpy(dirname, ".", sizeof(dirname));
+    base = nlog->filename_base;
+  } else {
+    dirlen = base - nlog->filename_base;
+    if (dirlen >= sizeof(dirname))
+      return (NULL);
+    memcpy(dirname, nlog->filename_base, dirlen);
+    dirname[dirlen] = '\0';
+    if (dirlen == 0)
+      strlcpy(dirname, "/", sizeof(dirname));
+    ++base;
+  }
+  baselen = strlen(base);
+
+  if ((dir = opendir(dirname)) == NULL)
+    return (NULL);
+  while ((de = readdir(dir)) != NULL) {
+    if (strncmp(de->d_name, base, baselen) != 0
+	|| de->d_name[baselen] != '.')
+      continue;
+    /* Consolidated-file indexes go with their data files. */
+    l = strlen(de->d_name);
+    if (l > 4 && strcmp(de->d_name + l - 4, ".idx") == 0)
+      continue;
+    if (count + 2 > alloc) {
+      alloc = alloc == 0 ? 32 : alloc * 2;
+      n = realloc(names, alloc * sizeof(*names));
+      if (n == NULL)
+	break;
+      names = n;
+    }
+    names[count] = malloc(strlen(dirname) + strlen(de->d_name) + 2);
+    if (names[count] == NULL)
+      break;
+    sprintf(names[count], "%s/%s", dirname, de->d_name);
+    ++count;
+  }
+  closedir(dir);
+  if (names == NULL)
+    return (NULL);
+  names[count] = NULL;
+  qsort(names, count, sizeof(*names), search_name_compare);
+  return (names);
+}
+
+/*
+ * Search the in-memory ring and then the rotated files, newest first
+ * (including any the archiver has gzip'd), for lines containing
+ * 'needle'.  Stops after 'max_matches' matches or 'max_ms'
+ * milliseconds, whichever comes first.
+ */
+void
+nanny_log_http_search(struct http_request *request, struct nanny_log *nlog,
+		      const char *needle, size_t max_matches, long max_ms)
+{
+  struct search _search, *search = &_search;
+  struct timeval now, limit;
+  uintmax_t oldest = nanny_log_oldest(nlog), before_ring, seq, offset;
+  const char *current = NULL, *base;
+  char **files;
+  size_t i, l, len, searched = 0;
+
+  memset(search, 0, sizeof(*search));
+  search->request = request;
+  search->needle = needle;
+  search->needle_len = strlen(needle);
+  search->max_matches = max_matches;
+  gettimeofday(&now, NULL);
+  limit.tv_sec = max_ms / 1000;
+  limit.tv_usec = (max_ms % 1000) * 1000;
+  timeradd(&now, &limit, &search->deadline);
+
+  if (search->needle_len == 0 || max_matches == 0)
+    return;
+
+  search_ring(search, nlog);
+  /*
+   * The end of the file being written is also in the ring, which was
+   * just searched; look only at what came before the ring, if any.
+   * That's measured in stream bytes, so a stamped file is cut short.
+   * An events log's file also holds the records written out ahead of
+   * the ring; those still held count towards the cut, and the rest
+   * are searched in memory.
+   */
+  if (nlog->filename != NULL) {
+    current = strrchr(nlog->filename, '/');
+    current = (current == NULL) ? nlog->filename : current + 1;
+  }
+  before_ring = (oldest > nlog->file_start) ? oldest - nlog->file_start : 0;
+  if (nlog->events != NULL) {
+    search_events(search, nlog, nlog->filename_base != NULL ? oldest : 0);
+    for (seq = nanny_log_event_oldest(nlog);
+	 current != NULL && seq < nanny_log_event_cursor(nlog); seq++) {
+      len = nanny_log_event_text(nlog, seq, &offset, NULL, 0);
+      if (offset >= nlog->file_start && offset < oldest)
+	before_ring += len;
+    }
+  }
+  files = nanny_log_rotated_files(nlog);
+  for (i = 0; files != NULL && files[i] != NULL; ++i) {
+    base = strrchr(files[i], '/');
+    base = (base == NULL) ? files[i] : base + 1;
+    if (current != NULL && strcmp(base, current) == 0) {
+      if (before_ring > 0 && search->stopped == NULL
+	  && !search_expired(search)) {
+	search_file(search, files[i], before_ring);
+	++searched;
+      }
+    } else if (search->stopped == NULL && !search_expired(search)) {
+      l = strlen(files[i]);
+      if (l > 3 && strcmp(files[i] + l - 3, ".gz") == 0)
+	search_gzfile(search, files[i]);
+      else if (l <= 4 || strcmp(files[i] + l - 4, ".tmp") != 0)
+	search_file(search, files[i], 0);
+      ++searched;
+    }
+    free(files[i]);
+  }
+  free(files);
+
+  http_printf(request, "# %zu matches, ring and %zu files searched\n",
+	      search->matches, searched);
+  if (search->stopped != NULL)
+    http_printf(request, "# stopped early: %s\n", search->stopped);
+}
+
+/*
+ * List this log's rotated files as JSON or, if 'name' is given, send
+ * that file.  Only names that appear in the listing can be fetched.
+ * Files go out with sendfile(), so even large ones cost the nanny
+ * little more than the syscalls.
+ */
+int
+nanny_log_http_files(struct http_request *request, struct nanny_log *nlog,
+		     const char *name)
+{
+  struct stat st;
+  const char *base, *sep = "\n";
+  char **files;
+  size_t i, l, namelen;
+  int found = -1;
+
+  files = nanny_log_rotated_files(nlog);
+  /* Ignore any query string. */
+  namelen = name == NULL ? 0 : strcspn(name, "?");
+  if (namelen > 0) {
+    for (i = 0; files != NULL && files[i] != NULL; ++i) {
+      base = strrchr(files[i], '/');
+      base = base == NULL ? files[i] : base + 1;
+      if (strncmp(base, name, namelen) == 0 && base[namelen] == '\0') {
+	l = strlen(files[i]);
+	found = http_serve_file(request, files[i],
+				l > 3 && strcmp(files[i] + l - 3, ".gz") == 0
+				? "application/gzip" : "text/plain");
+	break;
+      }
+    }
+    if (found < 0) {
+      http_printf(request, "HTTP/1.0 404 NOT FOUND\x0d\x0a");
+      http_printf(request, "Content-Type: text/plain\x0d\x0a");
+      http_printf(request, "\x0d\x0a");
+      http_printf(request, "No such log file: %.*s\n", (int)namelen, name);
+    }
+  } else {
+    http_printf(request, "HTTP/1.0 200 OK\x0d\x0a");
+    http_printf(request, "Content-Type: application/json\x0d\x0a");
+    http_printf(request, "\x0d\x0a");
+    http_printf(request, "{\n \"files\": [");
+    for (i = 0; files != NULL && files[i] != NULL; ++i) {
+      l = strlen(files[i]);
+      if ((l > 4 && strcmp(files[i] + l - 4, ".tmp") == 0)
+	  || stat(files[i], &st) != 0)
+	continue;
+      base = strrchr(files[i], '/');
+      base = base == NULL ? files[i] : base + 1;
+      http_printf(request, "%s  {\"name\": \"%s\", \"size\": %jd, "
+		  "\"modified\": \"%s\"}", sep, base,
+		  (intmax_t)st.st_size, nanny_isotime(st.st_mtime));
+      sep = ",\n";
+    }
+    http_printf(request, "\n ]\n}\n");
+  }
+  for (i = 0; files != NULL && files[i] != NULL; ++i)
+    free(files[i]);
+  free(files);
+  return (0);
+}
@@ -0,0 +1,300 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Arrival timestamps for log data.
+ *
+ * The ring holds raw bytes; arrival times live beside it as a list
+ * of (offset, time) entries, each meaning "bytes from this offset on
+ * arrived at this time".  An entry is only added when data arrives
+ * in a new second, so a busy log costs one comparison per read, and
+ * entries are stored as varint deltas from their predecessor, which
+ * is typically two or three bytes apiece.  The oldest entry is kept
+ * unencoded in stamp_first_*, the newest in stamp_last_*.
+ *
+ * Entries for bytes that have left the ring are trimmed whenever the
+ * list needs room; if the ring spans more distinct seconds than
+ * STAMPS_MAX can describe, the oldest times are forgotten and those
+ * lines render as unknown.
+ */
+
+#define	STAMPS_INITIAL	256
+#define	STAMPS_MAX	16384
+#define	VARINT_MAX	10	/* 64 bits, 7 at a time. */
+
+static size_t
+varint_put(unsigned char *p, uintmax_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    p[n++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (unsigned char)v;
+  return (n);
+}
+
+/* Zig-zag encoding keeps a clock step backwards small, too. */
+static uintmax_t
+zigzag(intmax_t d)
+{
+  return (d < 0 ? ((uintmax_t)-(d + 1) << 1) | 1 : (uintmax_t)d << 1);
+}
+
+static intmax_t
+unzigzag(uintmax_t v)
+{
+  return ((v & 1) ? -(intmax_t)(v >> 1) - 1 : (intmax_t)(v >> 1));
+}
+
+static uintmax_t
+varint_get(const unsigned char *p, size_t *pos)
+{
+  uintmax_t v = 0;
+  int shift = 0;
+  unsigned char c;
+
+  do {
+    c = p[(*pos)++];
+    v |= (uintmax_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return (v);
+}
+
+/*
+ * Drop leading entries until the first one still covers 'oldest'
+ * and no more than 'max_len' encoded bytes remain.
+ */
+static void
+stamps_trim(struct nanny_log *nlog, uintmax_t oldest, size_t max_len)
+{
+  size_t pos = 0, keep = 0;
+  uintmax_t offset = nlog->stamp_first_offset;
+  time_t t = nlog->stamp_first_time;
+  uintmax_t next_offset;
+  time_t next_t;
+
+  while (pos < nlog->stamps_len) {
+    next_offset = offset + varint_get(nlog->stamps, &pos);
+    next_t = t + unzigzag(varint_get(nlog->stamps, &pos));
+    if (next_offset > oldest && nlog->stamps_len - keep <= max_len)
+      break;
+    offset = next_offset;
+    t = next_t;
+    keep = pos;
+  }
+  memmove(nlog->stamps, nlog->stamps + keep, nlog->stamps_len - keep);
+  nlog->stamps_len -= keep;
+  nlog->stamp_first_offset = offset;
+  nlog->stamp_first_time = t;
+}
+
+/*
+ * Note that the data about to be appended at the current end of the
+ * log arrived now.  Called once per ingest, before total_bytes moves.
+ */
+void
+nanny_log_stamp(struct nanny_log *nlog)
+{
+  time_t now = nanny_globals.now;
+  size_t size;
+
+  if (now == nlog->stamp_last_time)
+    return;
+  if (nlog->stamp_last_time == 0) {
+    nlog->stamp_first_offset = nlog->stamp_last_offset = nlog->total_bytes;
+    nlog->stamp_first_time = nlog->stamp_last_time = now;
+    return;
+  }
+  if (nlog->stamps_len + 2 * VARINT_MAX > nlog->stamps_size) {
+    stamps_trim(nlog, nanny_log_oldest(nlog), nlog->stamps_size);
+    if (nlog->stamps_len + 2 * VARINT_MAX > nlog->stamps_size) {
+      if (nlog->stamps_size < STAMPS_MAX) {
+	size = nlog->stamps_size ? nlog->stamps_size * 2 : STAMPS_INITIAL;
+	nlog->stamps = realloc(nlog->stamps, size);
+	if (nlog->stamps == NULL) {
+	  fprintf(stderr, "nanny_log_stamp: realloc failure\n");
+	  exit(1);
+	}
+	nlog->stamps_size = size;
+      } else
+	stamps_trim(nlog, 0, nlog->stamps_size / 2);
+    }
+  }
+  nlog->stamps_len += varint_put(nlog->stamps + nlog->stamps_len,
+				 nlog->total_bytes - nlog->stamp_last_offset);
+  nlog->stamps_len += varint_put(nlog->stamps + nlog->stamps_len,
+				 zigzag(now - nlog->stamp_last_time));
+  nlog->stamp_last_offset = nlog->total_bytes;
+  nlog->stamp_last_time = now;
+}
+
+/*
+ * Walk the timestamps forward; lookups must use ascending offsets.
+ */
+void
+nanny_log_stamp_iter_init(struct nanny_log *nlog,
+			  struct nanny_log_stamp_iter *it)
+{
+  it->nlog = nlog;
+  it->pos = 0;
+  it->offset = nlog->stamp_first_offset;
+  it->time = nlog->stamp_first_time;
+}
+
+/*
+ * Arrival time of the byte at 'offset', or 0 if it is not known.
+ */
+time_t
+nanny_log_stamp_lookup(struct nanny_log_stamp_iter *it, uintmax_t offset)
+{
+  struct nanny_log *nlog = it->nlog;
+  uintmax_t next_offset;
+  time_t next_time;
+  size_t pos;
+
+  if (it->time == 0 || offset < it->offset)
+    return (0);
+  while (it->pos < nlog->stamps_len) {
+    pos = it->pos;
+    next_offset = it->offset + varint_get(nlog->stamps, &pos);
+    next_time = it->time + unzigzag(varint_get(nlog->stamps, &pos));
+    if (next_offset > offset)
+      break;
+    it->pos = pos;
+    it->offset = next_offset;
+    it->time = next_time;
+  }
+  return (it->time);
+}
+
+/*
+ * Write to the log file with every line prefixed by its arrival
+ * time.  Everything in one read arrived together, so one prefix
+ * serves the whole batch and a single writev() covers it.
+ */
+ssize_t
+nanny_log_write_stamped(struct nanny_log *nlog, const char *p, size_t n)
+{
+  struct iovec iov[64];
+  char prefix[32];
+  const char *end = p + n;
+  const char *nl;
+  size_t prefix_len, len;
+  ssize_t total = 0, w;
+  int iovcnt = 0;
+
+  prefix_len = snprintf(prefix, sizeof(prefix), "%s ", nanny_isotime(0));
+  while (p < end) {
+    if (nlog->file_bol) {
+      iov[iovcnt].iov_base = prefix;
+      iov[iovcnt].iov_len = prefix_len;
+      iovcnt++;
+      nlog->file_bol = 0;
+    }
+    nl = memchr(p, '\n', end - p);
+    len = (nl != NULL) ? (size_t)(nl + 1 - p) : (size_t)(end - p);
+    if (nl != NULL)
+      nlog->file_bol = 1;
+    iov[iovcnt].iov_base = (void *)p;
+    iov[iovcnt].iov_len = len;
+    iovcnt++;
+    p += len;
+    if (iovcnt >= 62 || p >= end) {
+      w = writev(nlog->file_fd, iov, iovcnt);
+      if (w < 0)
+	return (w);
+      total += w;
+      iovcnt = 0;
+    }
+  }
+  return (total);
+}
+
+/*
+ * Dump whole lines from offset 'since' on, optionally prefixed with
+ * their arrival time and limited to lines that arrived within
+ * [from, to].  Zero leaves either end of the range open.  Returns
+ * the new cursor, which is always the end of the log.
+ */
+uintmax_t
+nanny_log_http_dump_lines(struct http_request *request,
+			  struct nanny_log *nlog, uintmax_t since,
+			  time_t from, time_t to, int stamps)
+{
+  struct nanny_log_stamp_iter it;
+  uintmax_t end = nanny_log_cursor(nlog);
+  const char *p, *nl;
+  size_t n, len;
+  int bol = 1, selected = 0;
+  time_t t;
+
+  since = nanny_log_clamp_cursor(request, nlog, since);
+  nanny_log_stamp_iter_init(nlog, &it);
+  while (since < end) {
+    n = nanny_log_ring_peek(nlog, since, &p);
+    if (n == 0)
+      break;
+    while (n > 0) {
+      if (bol) {
+	t = nanny_log_stamp_lookup(&it, since);
+	selected = (from == 0 || (t != 0 && t >= from))
+	  && (to == 0 || (t != 0 && t <= to));
+	if (selected && stamps) {
+	  if (t == 0)
+	    http_printf(request, "%-20s ", "-");
+	  else
+	    http_printf(request, "%s ", nanny_isotime(t));
+	}
+	bol = 0;
+      }
+      nl = memchr(p, '\n', n);
+      len = (nl != NULL) ? (size_t)(nl + 1 - p) : n;
+      if (nl != NULL)
+	bol = 1;
+      if (selected)
+	http_write(request, (void *)p, len);
+      p += len;
+      n -= len;
+      since += len;
+    }
+  }
+  return (since);
+}
@@ -0,0 +1,266 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Subscribers.
+ *
+ * Code inside nanny can watch a log stream without re-reading files:
+ * a subscriber's callback is handed each newly ingested span straight
+ * out of the ring, and returns how much of it it took.  Anything it
+ * doesn't take stays pending at its cursor and is offered again on
+ * the next ingest (or nanny_log_subscriber_resume()); if the ring
+ * overwrites it first, the subscriber's cursor jumps forward and the
+ * gap is counted as lost.  Spans point into the ring, so they're only
+ * valid for the duration of the call.
+ *
+ * A subscription handle belongs to whoever subscribed, and stays valid
+ * until nanny_log_unsubscribe(), even if the log goes away first:  the
+ * handler is then called once more with an empty span (p == NULL,
+ * n == 0) to say the stream has ended, and the handle is left detached
+ * for the owner to unsubscribe.
+ *
+ * On an events log, event records (kept apart from the ring; see
+ * nanny_log_event.c) are offered as their rendered lines, in order
+ * with the text at the offset they happened.  A record is offered
+ * whole, and only counts as taken if all of it is.
+ */
+
+struct nanny_log_subscription {
+  struct nanny_log_subscription *next;
+  struct nanny_log *nlog;
+  nanny_log_subscriber *handler;
+  void *data;
+  uintmax_t cursor;
+  uintmax_t event_cursor;	/* Next event record, by sequence. */
+  uintmax_t delivered;
+  uintmax_t lost;
+  int removed;
+};
+
+/*
+ * Offer one subscriber everything it hasn't taken yet.
+ */
+static void
+subscriber_deliver(struct nanny_log_subscription *sub)
+{
+  struct nanny_log *nlog = sub->nlog;
+  uintmax_t oldest, start = sub->cursor, estart = sub->event_cursor;
+  uintmax_t event_offset = 0;
+  const char *p;
+  char line[1024];
+  size_t n, taken, event_len;
+
+  while (!sub->removed) {
+    /* The next record, if any; any that fell off are skipped. */
+    event_len = 0;
+    if (nlog->events != NULL) {
+      oldest = nanny_log_event_oldest(nlog);
+      if (sub->event_cursor < oldest)
+	sub->event_cursor = oldest;
+      if (sub->event_cursor < nanny_log_event_cursor(nlog))
+	event_len = nanny_log_event_text(nlog, sub->event_cursor,
+					 &event_offset, line, sizeof(line));
+    }
+    if (event_len > 0 && (event_offset <= sub->cursor
+			  || sub->cursor >= nlog->total_bytes)) {
+      taken = sub->handler(sub->data, nlog, sub->cursor, line, event_len);
+      if (taken < event_len)
+	break;	/* Backpressure:  try again later. */
+      sub->event_cursor++;
+      sub->delivered += event_len;
+      continue;
+    }
+    if (sub->cursor >= nlog->total_bytes)
+      break;
+    oldest = nanny_log_oldest(nlog);
+    if (sub->cursor < oldest) {
+      sub->lost += oldest - sub->cursor;
+      nlog->subscriber_lost += oldest - sub->cursor;
+      sub->cursor = oldest;
+      continue;
+    }
+    if ((n = nanny_log_ring_peek(nlog, sub->cursor, &p)) == 0)
+      break;
+    /* Stop short of the next record. */
+    if (event_len > 0 && event_offset < sub->cursor + n)
+      n = event_offset - sub->cursor;
+    taken = sub->handler(sub->data, nlog, sub->cursor, p, n);
+    if (taken > n)
+      taken = n;
+    sub->cursor += taken;
+    sub->delivered += taken;
+    if (taken < n)
+      break;	/* Backpressure:  try again later. */
+  }
+  if (sub->cursor != start || sub->event_cursor != estart)
+    ++nlog->generation;	/* Lag has changed. */
+}
+
+static void
+subscribers_reap(struct nanny_log *nlog)
+{
+  struct nanny_log_subscription **sp, *sub;
+
+  for (sp = &nlog->subscribers; (sub = *sp) != NULL; ) {
+    if (sub->removed) {
+      *sp = sub->next;
+      free(sub);
+    } else
+      sp = &sub->next;
+  }
+}
+
+/*
+ * New data has been added to the ring, or a new event recorded.
+ */
+void
+nanny_log_publish(struct nanny_log *nlog)
+{
+  struct nanny_log_subscription *sub;
+
+  /* A handler that writes to its own log is caught up by the loop. */
+  if (nlog->publishing)
+    return;
+  nlog->publishing = 1;
+  for (sub = nlog->subscribers; sub != NULL; sub = sub->next)
+    subscriber_deliver(sub);
+  nlog->publishing = 0;
+  subscribers_reap(nlog);
+}
+
+/*
+ * Call 'handler' with each new span of the log from now on.
+ */
+struct nanny_log_subscription *
+nanny_log_subscribe(struct nanny_log *nlog, nanny_log_subscriber *handler,
+		    void *data)
+{
+  struct nanny_log_subscription *sub;
+
+  sub = malloc(sizeof(*sub));
+  if (sub == NULL) {
+    fprintf(stderr, "nanny_log_subscribe: malloc failure\n");
+    exit(1);
+  }
+  memset(sub, 0, sizeof(*sub));
+  sub->nlog = nlog;
+  sub->handler = handler;
+  sub->data = data;
+  sub->cursor = nlog->total_bytes;
+  sub->event_cursor = nlog->events_total;
+  sub->next = nlog->subscribers;
+  nlog->subscribers = sub;
+  return (sub);
+}
+
+/*
+ * Safe to call from within the subscriber's own handler.
+ */
+void
+nanny_log_unsubscribe(struct nanny_log_subscription *sub)
+{
+  struct nanny_log *nlog = sub->nlog;
+
+  if (nlog == NULL) {	/* Detached:  the log is already gone. */
+    free(sub);
+    return;
+  }
+  sub->removed = 1;
+  if (!nlog->publishing)
+    subscribers_reap(nlog);
+}
+
+/*
+ * A subscriber that pushed back is ready for more.
+ */
+void
+nanny_log_subscriber_resume(struct nanny_log_subscription *sub)
+{
+  if (sub->nlog != NULL && !sub->nlog->publishing)
+    subscriber_deliver(sub);
+}
+
+/*
+ * Where the subscriber is, and how far behind and how much it's lost.
+ */
+uintmax_t
+nanny_log_subscriber_cursor(struct nanny_log_subscription *sub,
+			    uintmax_t *lag, uintmax_t *lost)
+{
+  if (lag != NULL)
+    *lag = sub->nlog != NULL ? sub->nlog->total_bytes - sub->cursor : 0;
+  if (lost != NULL)
+    *lost = sub->lost;
+  return (sub->cursor);
+}
+
+void
+nanny_log_subscribers_free(struct nanny_log *nlog)
+{
+  struct nanny_log_subscription *sub;
+
+  while ((sub = nlog->subscribers) != NULL) {
+    nlog->subscribers = sub->next;
+    if (sub->removed) {
+      free(sub);
+      continue;
+    }
+    /* The owner still holds this; detach it and say we're done. */
+    sub->nlog = NULL;
+    sub->handler(sub->data, nlog, sub->cursor, NULL, 0);
+  }
+}
+
+void
+nanny_log_json_subscribers(struct http_request *request,
+			   struct nanny_log *nlog, const char *indent)
+{
+  struct nanny_log_subscription *sub;
+  uintmax_t lag = 0;
+  int count = 0;
+
+  for (sub = nlog->subscribers; sub != NULL; sub = sub->next) {
+    if (sub->removed)
+      continue;
+    count++;
+    if (nlog->total_bytes - sub->cursor > lag)
+      lag = nlog->total_bytes - sub->cursor;
+  }
+  http_printf(request, "%s  \"subscribers\": %d,\n", indent, count);
+  http_printf(request, "%s  \"subscriber_max_lag_bytes\": %ju,\n",
+	      indent, lag);
+  http_printf(request, "%s  \"subscriber_lost_bytes\": %ju,\n",
+	      indent, nlog->subscriber_lost);
+}
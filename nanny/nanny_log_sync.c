@@ -0,0 +1,440 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _GNU_SOURCE /* sync_file_range(), fallocate() */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+#include "nanny_timer.h"
+
+/*
+ * Durability.
+ *
+ * By default log files are left to the kernel to flush.  A log can
+ * instead ask for its file to be fdatasync()ed every sync_interval
+ * seconds, or whenever a file is finished by rotation.  Syncs can
+ * take a long time on a busy disk, so they're run by one background
+ * thread on a dup() of the descriptor; the main loop hands over jobs
+ * and collects the results through a pipe, and is the only one to
+ * touch struct nanny_log.
+ *
+ * Per-log metrics:  how many syncs, how long they took, and how far
+ * durable data lags behind what's been written (bytes and seconds).
+ *
+ * The same thread keeps log files from crowding the page cache.  Once
+ * a file has CACHE_WINDOW bytes behind the newest CACHE_WINDOW, and
+ * again when it's closed, the older range is written back and then
+ * dropped with posix_fadvise(DONTNEED), so only the tail that readers
+ * are likely to want stays cached.  Optionally files are preallocated
+ * in large extents (without changing their size) to keep them
+ * contiguous; the unused end is trimmed on rotation.
+ */
+
+#define	CACHE_WINDOW	(1024 * 1024)
+
+enum sync_op { SYNC_DATA, SYNC_DROP };
+
+struct sync_job {
+  struct sync_job *next;
+  struct nanny_log *nlog;
+  int fd;
+  enum sync_op op;
+  uintmax_t written;	/* Bytes covered once this sync finishes. */
+  off_t start, len;	/* Range to drop from the cache. */
+  time_t requested;
+  long latency_us;
+  int error;
+};
+
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+static struct sync_job *sync_pending;
+static struct sync_job *sync_done;
+static int sync_pipe[2] = { -1, -1 };
+
+/*
+ * Only clean pages can be dropped, so write the range back first.
+ */
+static int
+sync_drop(int fd, off_t start, off_t len)
+{
+#ifdef __linux__
+  if (sync_file_range(fd, start, len, SYNC_FILE_RANGE_WAIT_BEFORE
+		      | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+    return (errno);
+#else
+  if (fdatasync(fd) < 0)
+    return (errno);
+#endif
+  return (posix_fadvise(fd, start, len, POSIX_FADV_DONTNEED));
+}
+
+static void *
+sync_thread(void *arg)
+{
+  struct sync_job *job, **pp;
+  struct timeval start, end;
+
+  (void)arg; /* UNUSED */
+  for (;;) {
+    pthread_mutex_lock(&sync_lock);
+    while (sync_pending == NULL)
+      pthread_cond_wait(&sync_cond, &sync_lock);
+    job = sync_pending;
+    sync_pending = job->next;
+    pthread_mutex_unlock(&sync_lock);
+
+    gettimeofday(&start, NULL);
+    if (job->op == SYNC_DATA)
+      job->error = (fdatasync(job->fd) < 0) ? errno : 0;
+    else
+      job->error = sync_drop(job->fd, job->start, job->len);
+    gettimeofday(&end, NULL);
+    close(job->fd);
+    job->latency_us = (end.tv_sec - start.tv_sec) * 1000000L
+      + (end.tv_usec - start.tv_usec);
+
+    pthread_mutex_lock(&sync_lock);
+    for (pp = &sync_done; *pp != NULL; pp = &(*pp)->next)
+      ;
+    job->next = NULL;
+    *pp = job;
+    pthread_mutex_unlock(&sync_lock);
+    write(sync_pipe[1], "", 1);
+  }
+  return (NULL);
+}
+
+/*
+ * Registered server on the pipe:  fold finished syncs into the
+ * metrics of their logs.
+ */
+static void
+sync_collect(void *data)
+{
+  struct sync_job *job, *done;
+  struct nanny_log *nlog;
+  char buff[64];
+
+  (void)data; /* UNUSED */
+  read(sync_pipe[0], buff, sizeof(buff));
+  pthread_mutex_lock(&sync_lock);
+  done = sync_done;
+  sync_done = NULL;
+  pthread_mutex_unlock(&sync_lock);
+
+  while ((job = done) != NULL) {
+    done = job->next;
+    nlog = job->nlog;
+    if (job->op == SYNC_DROP) {
+      if (job->error == 0) {
+	nlog->cache_dropped_bytes += job->len;
+	++nlog->generation;
+      }
+      nanny_log_release(nlog);
+      free(job);
+      continue;
+    }
+    nlog->sync_inflight--;
+    ++nlog->generation;
+    if (job->error != 0) {
+      nlog->sync_errors++;
+      fprintf(stderr, "fdatasync %s: %s\n",
+	      nlog->filename_base, strerror(job->error));
+    } else {
+      nlog->sync_count++;
+      nlog->sync_latency_last = job->latency_us;
+      nlog->sync_latency_total += job->latency_us;
+      if (job->latency_us > nlog->sync_latency_max)
+	nlog->sync_latency_max = job->latency_us;
+      if (job->written > nlog->synced_bytes)
+	nlog->synced_bytes = job->written;
+      if (nlog->synced_bytes >= nlog->disk_bytes)
+	nlog->unsynced_since = 0;
+      else if (nlog->unsynced_since < job->requested)
+	nlog->unsynced_since = job->requested;
+    }
+    nanny_log_release(nlog);
+    free(job);
+  }
+}
+
+static int
+sync_start(void)
+{
+  pthread_t thread;
+  sigset_t all, old;
+  int err;
+
+  if (pipe(sync_pipe) < 0) {
+    perror("nanny_log_sync: pipe");
+    return (-1);
+  }
+  fcntl(sync_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(sync_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sync_pipe[1], F_SETFD, FD_CLOEXEC);
+  /* Leave all signal handling to the main thread. */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&thread, NULL, sync_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    fprintf(stderr, "nanny_log_sync: pthread_create: %s\n", strerror(err));
+    close(sync_pipe[0]);
+    close(sync_pipe[1]);
+    sync_pipe[0] = sync_pipe[1] = -1;
+    return (-1);
+  }
+  pthread_detach(thread);
+  nanny_register_server(sync_collect, sync_pipe[0], NULL);
+  return (0);
+}
+
+/*
+ * Hand the worker a job on a copy of the log's descriptor.
+ */
+static int
+sync_queue(struct nanny_log *nlog, enum sync_op op, off_t start, off_t len)
+{
+  struct sync_job *job, **pp;
+
+  if (nlog->file_fd < 0)
+    return (-1);
+  if (sync_pipe[0] < 0 && sync_start() < 0)
+    return (-1);
+  job = malloc(sizeof(*job));
+  if (job == NULL)
+    return (-1);
+  memset(job, 0, sizeof(*job));
+  job->fd = dup(nlog->file_fd);
+  if (job->fd < 0) {
+    free(job);
+    return (-1);
+  }
+  job->op = op;
+  job->nlog = nlog;
+  nanny_log_retain(nlog);
+  job->written = nlog->disk_bytes;
+  job->requested = nanny_globals.now;
+  job->start = start;
+  job->len = len;
+
+  pthread_mutex_lock(&sync_lock);
+  for (pp = &sync_pending; *pp != NULL; pp = &(*pp)->next)
+    ;
+  *pp = job;
+  pthread_cond_signal(&sync_cond);
+  pthread_mutex_unlock(&sync_lock);
+  return (0);
+}
+
+/*
+ * Queue a sync of everything written to the current file so far.
+ */
+void
+nanny_log_sync(struct nanny_log *nlog)
+{
+  if (sync_queue(nlog, SYNC_DATA, 0, 0) < 0)
+    return;
+  nlog->sync_requested = nlog->disk_bytes;
+  nlog->sync_inflight++;
+}
+
+/*
+ * Drop what's been written to the current file up to 'end' from the
+ * page cache.
+ */
+static void
+cache_drop(struct nanny_log *nlog, uintmax_t end)
+{
+  if (end > nlog->cache_mark
+      && sync_queue(nlog, SYNC_DROP, nlog->cache_mark,
+		    end - nlog->cache_mark) == 0)
+    nlog->cache_mark = end;
+}
+
+/*
+ * A new file has been started.
+ */
+void
+nanny_log_cache_open(struct nanny_log *nlog)
+{
+  nlog->cache_mark = 0;
+  nlog->prealloc_end = 0;
+}
+
+/*
+ * About to write n bytes:  extend the preallocation if needed.
+ */
+void
+nanny_log_cache_reserve(struct nanny_log *nlog, size_t n)
+{
+  uintmax_t end;
+
+  if (nlog->cache_extent == 0 || nlog->file_bytes + n <= nlog->prealloc_end)
+    return;
+  end = nlog->file_bytes + n + nlog->cache_extent;
+  end -= end % nlog->cache_extent;
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (fallocate(nlog->file_fd, FALLOC_FL_KEEP_SIZE, nlog->prealloc_end,
+		end - nlog->prealloc_end) == 0)
+    nlog->preallocated_bytes += end - nlog->prealloc_end;
+#endif
+  /* Don't retry on every write if the filesystem can't. */
+  nlog->prealloc_end = end;
+}
+
+/*
+ * Written to the file:  let go of anything well behind the tail.
+ */
+void
+nanny_log_cache_written(struct nanny_log *nlog)
+{
+  if (nlog->cache_drop
+      && nlog->file_bytes >= nlog->cache_mark + 2 * CACHE_WINDOW)
+    cache_drop(nlog, nlog->file_bytes - CACHE_WINDOW);
+}
+
+/*
+ * The file is about to be closed:  nobody's tailing it now, so drop
+ * the rest, and give back preallocated space if it's finished.
+ */
+void
+nanny_log_cache_close(struct nanny_log *nlog, int rotate)
+{
+  struct stat st;
+
+  if (nlog->cache_drop)
+    cache_drop(nlog, nlog->file_bytes);
+  if (rotate && nlog->prealloc_end > nlog->file_bytes
+      && fstat(nlog->file_fd, &st) == 0)
+    ftruncate(nlog->file_fd, st.st_size);
+}
+
+/*
+ * Page cache policy:  whether to drop written data from the cache,
+ * and the extent in which to preallocate files (0 = don't).
+ */
+void
+nanny_log_set_cache(struct nanny_log *nlog, int drop, uintmax_t extent)
+{
+  nlog->cache_drop = drop;
+  nlog->cache_extent = extent;
+}
+
+static void
+nanny_log_sync_timer(void *_nlog, time_t now)
+{
+  struct nanny_log *nlog = _nlog;
+
+  nlog->sync_timer = NULL;
+  if (nlog->sync_mode != NANNY_LOG_SYNC_PERIODIC)
+    return;
+  /* One sync at a time:  a slow disk shouldn't pile them up. */
+  if (nlog->sync_inflight == 0 && nlog->disk_bytes > nlog->sync_requested)
+    nanny_log_sync(nlog);
+  nlog->sync_timer = nanny_timer_add(now + nlog->sync_interval,
+				     nanny_log_sync_timer, nlog);
+}
+
+/*
+ * The log file is about to be closed; sync it first if the mode
+ * calls for it.
+ */
+void
+nanny_log_sync_close(struct nanny_log *nlog, int rotate)
+{
+  if (nlog->disk_bytes <= nlog->sync_requested)
+    return;
+  if (nlog->sync_mode == NANNY_LOG_SYNC_PERIODIC
+      || (nlog->sync_mode == NANNY_LOG_SYNC_ROTATE && rotate))
+    nanny_log_sync(nlog);
+}
+
+int
+nanny_log_set_sync(struct nanny_log *nlog, enum nanny_log_sync_mode mode,
+		   time_t interval)
+{
+  /* Callers from Python can pass any int. */
+  if ((unsigned)mode >= NANNY_LOG_SYNC_MODES)
+    return (-1);
+  nlog->sync_mode = mode;
+  nlog->sync_interval = (interval > 0) ? interval : 1;
+  nanny_timer_delete(nlog->sync_timer);
+  nlog->sync_timer = NULL;
+  if (mode == NANNY_LOG_SYNC_PERIODIC)
+    nlog->sync_timer = nanny_timer_add(time(NULL) + nlog->sync_interval,
+				       nanny_log_sync_timer, nlog);
+  return (0);
+}
+
+void
+nanny_log_json_sync(struct http_request *request, struct nanny_log *nlog,
+		    const char *indent)
+{
+  static const char *modes[NANNY_LOG_SYNC_MODES] =
+    { "none", "periodic", "rotate" };
+
+  http_printf(request, "%s  \"sync_mode\": \"%s\",\n", indent,
+	      (unsigned)nlog->sync_mode < NANNY_LOG_SYNC_MODES
+	      ? modes[nlog->sync_mode] : "unknown");
+  if (nlog->cache_drop || nlog->cache_dropped_bytes > 0)
+    http_printf(request, "%s  \"cache_dropped_bytes\": %ju,\n",
+		indent, nlog->cache_dropped_bytes);
+  if (nlog->cache_extent > 0)
+    http_printf(request, "%s  \"preallocated_bytes\": %ju,\n",
+		indent, nlog->preallocated_bytes);
+  if (nlog->sync_mode == NANNY_LOG_SYNC_NONE && nlog->sync_count == 0)
+    return;
+  http_printf(request, "%s  \"sync_count\": %ju,\n", indent, nlog->sync_count);
+  http_printf(request, "%s  \"sync_errors\": %ju,\n",
+	      indent, nlog->sync_errors);
+  http_printf(request, "%s  \"sync_latency_last_us\": %ld,\n",
+	      indent, nlog->sync_latency_last);
+  http_printf(request, "%s  \"sync_latency_max_us\": %ld,\n",
+	      indent, nlog->sync_latency_max);
+  if (nlog->sync_count > 0)
+    http_printf(request, "%s  \"sync_latency_avg_us\": %ju,\n",
+		indent, nlog->sync_latency_total / nlog->sync_count);
+  http_printf(request, "%s  \"sync_lag_bytes\": %ju,\n",
+	      indent, nlog->disk_bytes - nlog->synced_bytes);
+  http_printf(request, "%s  \"sync_lag_seconds\": %ld,\n", indent,
+	      nlog->unsynced_since > 0
+	      ? (long)(nanny_globals.now - nlog->unsynced_since) : 0L);
+}
@@ -51,6 +51,8 @@ default_http_page(struct http_request *request)
   http_printf(request, "<li>Time: %s\n", nanny_isotime(0));
   http_printf(request, "<li><a href=\"/status/\">Children</a><br/>\n");
   http_printf(request, "<li><a href=\"/environment\">Environment</a><br/>\n");
+  http_printf(request, "<li><a href=\"/http\">HTTP server</a><br/>\n");
+  http_printf(request, "<li><a href=\"/metrics\">Metrics</a><br/>\n");
   http_printf(request, "</ul>\n");
   http_printf(request, "</body>\n");
   http_printf(request, "</HTML>\n");
@@ -76,6 +78,15 @@ http_dispatcher(struct http_request *request)
       request->body_processor = nanny_http_environ_body;
       return;
     }
+    if (strcmp(request->uri, "/http") == 0) {
+      request->body_processor = http_server_stats_body;
+      return;
+    }
+    if (strncmp(request->uri, "/metrics", 8) == 0
+	&& (request->uri[8] == '\0' || request->uri[8] == '?')) {
+      request->body_processor = nanny_children_http_metrics;
+      return;
+    }
     if (strncmp(request->uri, "/status", 7) == 0) {
       request->body_processor = nanny_children_http_status;
       return;
@@ -150,10 +161,14 @@ static void
 nanny_usage(const char *prog)
 {
   printf("Usage: %s -s <start_cmd> [options]\n", prog);
+  printf(" -C <path>        Write all output to one consolidated log file\n");
   printf(" -d               Debug\n");
+  printf(" -F <collector>   Forward output to unix:<path> or udp:<host>:<port>\n");
+  printf(" -f               Fork a process for each HTTP connection\n");
   printf(" -h <shell cmd>   Health check\n");
   printf(" -S <shell cmd>   Stop command\n");
   printf(" -t <timed cmd>   Timed command\n");
+  printf(" -z <level>       HTTP compression level (0 = off, default 1)\n");
   printf("Example:\n");
   printf("  %s -s 'bin/server --no-background' -t '8h bin/reset $PID'\n", prog);
   printf("Note: start command must come first\n");
@@ -172,11 +187,21 @@ main(int argc, char **argv)
 
   /* Parse options. */
   health = start = stop = NULL;
-  while ((ch = getopt(argc, argv, "dh:S:s:t:")) != -1) {
+  while ((ch = getopt(argc, argv, "C:dF:fh:S:s:t:z:")) != -1) {
     switch (ch) {
+    case 'C':
+      nanny_log_consolidate(optarg);
+      break;
     case 'd':
       debug = 1;
       break;
+    case 'F':
+      if (nanny_log_forward_init(optarg) < 0)
+	exit(1);
+      break;
+    case 'f':
+      http_server_set_forking(1);
+      break;
     case 'h':
       nanny_child_set_health(child, optarg);
       break;
@@ -190,6 +215,9 @@ main(int argc, char **argv)
     case 't':
       nanny_child_add_periodic(child, optarg);
       break;
+    case 'z':
+      http_server_set_compression(atoi(optarg));
+      break;
     default:
       nanny_usage(argv[0]);
       exit(1);
@@ -55,11 +55,13 @@ nanny_timer_expiration(struct timer *t)
 
 
 /*
- * This array is really a heap.  See below.
+ * This array is really a heap.  See below.  It starts out with room
+ * for INITIAL_TIMERS and doubles whenever it fills up.
  */
-#define MAX_TIMERS 1024
-struct timer *timers[MAX_TIMERS];
+#define INITIAL_TIMERS 1024
+struct timer **timers;
 int nanny_timer_count = 0;
+static int nanny_timer_alloc = 0;
 
 /* This macro formulation both forces a trailing semicolon (makes it
  * more function like) and provides a code block in which you can
@@ -148,10 +150,18 @@ nanny_timer_add(time_t when, nanny_timer_handler *f, void *data)
   t->data = data;
   t->f = f;
 
+  /* Grow the heap if it's full. */
+  if (nanny_timer_count >= nanny_timer_alloc) {
+    struct timer **n;
+    int alloc = nanny_timer_alloc == 0 ? INITIAL_TIMERS : nanny_timer_alloc * 2;
+    n = realloc(timers, alloc * sizeof(*timers));
+    assert(n != NULL);
+    timers = n;
+    nanny_timer_alloc = alloc;
+  }
+
   /* Add timer at end and float it into the right place in the tree. */
-  /* TODO: Automatically resize the array (double it) when we hit the end. */
   nanny_timer_count++;
-  assert(nanny_timer_count < MAX_TIMERS);
   timers[nanny_timer_count - 1] = t;
   nanny_timer_adjust_position(nanny_timer_count - 1);
 
@@ -209,9 +219,11 @@ nanny_timer_next(struct timeval *interval, struct timeval *absolute)
     /* Rationalize the return: ensure 0 <= usec < 1000000. */
     while (interval->tv_usec > 999999) {
       interval->tv_usec -= 1000000;
+      interval->tv_sec++;
     }
     while (interval->tv_usec < 0) {
       interval->tv_usec += 1000000;
+      interval->tv_sec--;
     }
     /* Ensure we don't return a negative interval. */
     if (interval->tv_sec < 0) {
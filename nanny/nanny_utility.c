@@ -25,9 +25,11 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#define _GNU_SOURCE /* strptime(), timegm() */
 #include <sys/types.h>
 #include <netdb.h>
 #include <pwd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
@@ -80,3 +82,29 @@ nanny_isotime(time_t t)
   strftime(buff, sizeof(buff), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
   return buff;
 }
+
+/*
+ * Inverse of nanny_isotime(), also accepting plain epoch seconds
+ * and "-N" for N seconds ago.  Returns 0 if the string is unusable.
+ */
+time_t
+nanny_parse_time(const char *s)
+{
+  struct tm tm;
+  char *end;
+  long l;
+
+  if (s[0] == '-' || (s[0] >= '0' && s[0] <= '9' && strchr(s, '-') == NULL)) {
+    l = strtol(s, &end, 10);
+    if (*end != '\0')
+      return (0);
+    if (l < 0)
+      return (nanny_globals.now + l);
+    return ((time_t)l);
+  }
+  memset(&tm, 0, sizeof(tm));
+  end = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+  if (end == NULL || (*end != '\0' && strcmp(end, "Z") != 0))
+    return (0);
+  return (timegm(&tm));
+}
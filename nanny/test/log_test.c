@@ -0,0 +1,494 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Log machinery tests:  output is fed to the log modules directly,
+ * rather than through a child, and what they'd send to an HTTP client
+ * is captured by the http_printf() and http_write() below.  Files
+ * are never served.
+ */
+
+static char out[65536];
+static size_t out_len;
+
+void
+http_printf(struct http_request *request, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  out_len += vsnprintf(out + out_len, sizeof(out) - out_len, fmt, ap);
+  va_end(ap);
+  if (out_len >= sizeof(out))
+    out_len = sizeof(out) - 1;
+}
+
+ssize_t
+http_write(struct http_request *request, void *p, size_t n)
+{
+  if (n > sizeof(out) - 1 - out_len)
+    n = sizeof(out) - 1 - out_len;
+  memcpy(out + out_len, p, n);
+  out_len += n;
+  out[out_len] = '\0';
+  return (n);
+}
+
+int
+http_serve_file(struct http_request *request, const char *path,
+		const char *content_type)
+{
+  return (0);
+}
+
+static void
+expect_dedup(struct nanny_log *nlog, const char *in, const char *expected)
+{
+  size_t n = strlen(in);
+  char *p;
+
+  p = nanny_log_dedup(nlog, in, &n);
+  assert(n == strlen(expected) && memcmp(p, expected, n) == 0);
+}
+
+#define	LINE	"worker 7 failed to connect to db: connection refused\n"
+
+static void
+test_dedup(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(0);
+
+  nlog->dedup = 1;
+
+  /* A run collapses to one copy and a marker once it ends... */
+  expect_dedup(nlog, LINE LINE LINE LINE "done\n",
+	       LINE "last line repeated 3 times\n" "done\n");
+  assert(nlog->dedup_lines == 3);
+  /* ... even when it ends in a later read. */
+  expect_dedup(nlog, LINE LINE, LINE);
+  expect_dedup(nlog, LINE "next\n", "last line repeated 2 times\nnext\n");
+  assert(nlog->dedup_lines == 5);
+
+  /* Short repeats are put back rather than replaced by a longer marker. */
+  expect_dedup(nlog, "a\na\na\nb\n", "a\na\na\nb\n");
+  assert(nlog->dedup_lines == 5);
+
+  /* A partial line is never dropped. */
+  expect_dedup(nlog, "c\nc", "c\nc");
+  expect_dedup(nlog, "\n", "\n");
+  nanny_log_release(nlog);
+}
+
+static void
+feed_metrics(struct nanny_log *nlog, const char *p)
+{
+  nanny_log_metrics(nlog, p, strlen(p));
+}
+
+static void
+expect_metrics(struct nanny_log *nlog, const char *s)
+{
+  out_len = 0;
+  nanny_log_http_dump_metrics(NULL, nlog, "");
+  assert(strstr(out, s) != NULL);
+}
+
+static void
+test_metrics(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(0);
+
+  assert(nanny_log_add_metric(nlog, "served", "count", "served") == 0);
+  assert(nanny_log_add_metric(nlog, "get_ms", "histogram",
+			      "^GET * took #ms") == 0);
+  assert(nanny_log_add_metric(nlog, "took", "sum", "took #ms") == 0);
+  assert(nanny_log_add_metric(nlog, "bytes", "sum", "bytes=#") == 0);
+
+  feed_metrics(nlog, "request served\nnothing here\nserved again, served\n");
+  expect_metrics(nlog, "\"served\": {\"kind\": \"count\", \"count\": 2}");
+
+  /* Anchored, and the lead literal turning up again later in a line. */
+  feed_metrics(nlog, "GET /a took 5ms\nPOST /b; GET /c took 9ms\n");
+  feed_metrics(nlog, "took a while, took 12ms\n");
+  expect_metrics(nlog, "\"get_ms\": {\"kind\": \"histogram\", "
+		 "\"count\": 1, \"sum\": 5,");
+  expect_metrics(nlog, "\"took\": {\"kind\": \"sum\", \"count\": 3, "
+		 "\"sum\": 26}");
+
+  /* A line split across reads. */
+  feed_metrics(nlog, "GET /d took 3");
+  feed_metrics(nlog, "0ms\n");
+  expect_metrics(nlog, "\"took\": {\"kind\": \"sum\", \"count\": 4, "
+		 "\"sum\": 56}");
+
+  /* Large values print exactly. */
+  feed_metrics(nlog, "bytes=1234567890\nbytes=5\n");
+  expect_metrics(nlog, "\"bytes\": {\"kind\": \"sum\", \"count\": 2, "
+		 "\"sum\": 1234567895}");
+  nanny_log_release(nlog);
+}
+
+#define	CHUNK	NANNY_LOG_CHUNK
+
+/* The stream the ring tests write:  each byte is known by its offset. */
+static char
+stream_byte(uintmax_t offset)
+{
+  return ("abcdefghijklmnopqrstuvwxyz\n"[(offset * 7 + offset / 1000) % 27]);
+}
+
+static void
+feed_ring(struct nanny_log *nlog, size_t n, size_t piece)
+{
+  char buff[3000];
+  size_t i, len;
+
+  assert(piece <= sizeof(buff));
+  while (n > 0) {
+    len = n < piece ? n : piece;
+    for (i = 0; i < len; i++)
+      buff[i] = stream_byte(nlog->total_bytes + i);
+    nanny_log_ring_append(nlog, buff, len);
+    n -= len;
+  }
+}
+
+/*
+ * Everything from 'oldest' to the end reads back, in pieces that
+ * never run past a chunk; returns how many pieces it took.
+ */
+static int
+expect_stream(struct nanny_log *nlog, uintmax_t oldest)
+{
+  uintmax_t offset;
+  const char *p;
+  size_t i, n;
+  int pieces = 0;
+
+  assert(nanny_log_oldest(nlog) == oldest);
+  if (oldest > 0)
+    assert(nanny_log_ring_peek(nlog, oldest - 1, &p) == 0);
+  assert(nanny_log_ring_peek(nlog, nlog->total_bytes, &p) == 0);
+  for (offset = oldest; offset < nlog->total_bytes; offset += n) {
+    n = nanny_log_ring_peek(nlog, offset, &p);
+    assert(n > 0 && n <= nlog->total_bytes - offset);
+    for (i = 0; i < n; i++)
+      assert(p[i] == stream_byte(offset + i));
+    pieces++;
+  }
+  return (pieces);
+}
+
+static void
+test_ring(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(4 * CHUNK);
+  char *chunks[4];
+  uintmax_t generation;
+  size_t i, j;
+
+  /* Chunks are taken only as data arrives. */
+  assert(nlog->nchunks == 0);
+  feed_ring(nlog, 3 * CHUNK + CHUNK / 2, 1000);
+  assert(nlog->nchunks == 4);
+  assert(expect_stream(nlog, 0) == 4);
+  memcpy(chunks, nlog->chunks, sizeof(chunks));
+
+  /* Once full, the oldest chunk is recycled as the newest. */
+  feed_ring(nlog, 6 * CHUNK + 123, 2999);
+  assert(nlog->nchunks == 4);
+  assert(nlog->chunk_head != 0);
+  assert(expect_stream(nlog, 6 * CHUNK) == 4);
+  for (i = 0; i < 4; i++) {
+    for (j = 0; j < 4 && nlog->chunks[i] != chunks[j]; j++)
+      ;
+    assert(j < 4);
+  }
+
+  /* Idle:  nothing happens before the deadline, then all but the
+   * chunks holding the newest CHUNK bytes go back to the pool. */
+  nanny_log_ring_idle(nlog, nlog->last_ingest + 599);
+  assert(nlog->nchunks == 4);
+  generation = nlog->generation;
+  nanny_log_ring_idle(nlog, nlog->last_ingest + 600);
+  assert(nlog->nchunks == 2);
+  assert(nlog->generation > generation);
+  assert(expect_stream(nlog, 8 * CHUNK) == 2);
+
+  /* And it grows and wraps again from wherever its head now is. */
+  feed_ring(nlog, 5 * CHUNK + 1, 777);
+  assert(nlog->nchunks == 4);
+  assert(expect_stream(nlog, 11 * CHUNK) == 4);
+
+  /* Resizing a wrapped ring keeps the newest data, in order. */
+  nanny_log_set_ring(nlog, 2 * CHUNK, 600);
+  assert(nlog->chunk_head == 0);
+  assert(expect_stream(nlog, 13 * CHUNK) == 2);
+  feed_ring(nlog, CHUNK, 1000);
+  assert(expect_stream(nlog, 14 * CHUNK) == 2);
+  nanny_log_release(nlog);
+}
+
+static void
+test_history(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(4 * CHUNK);
+
+  /* Chunks leaving the ring are compressed into 8-chunk segments,
+   * and the stream reads straight through them into the ring. */
+  nanny_log_set_history(nlog, 1024 * 1024);
+  feed_ring(nlog, 20 * CHUNK + 500, 3000);
+  assert(nlog->history_raw == 16 * CHUNK);
+  assert(nlog->history_pending_len > 0);
+  assert(expect_stream(nlog, 0) == 2 + 1 + 4);
+
+  /* Shrinking when idle keeps what it evicts as history. */
+  nanny_log_ring_idle(nlog, nlog->last_ingest + 600);
+  assert(nlog->nchunks == 2);
+  expect_stream(nlog, 0);
+
+  /* Over budget, whole segments go, oldest first. */
+  nanny_log_set_history(nlog, nlog->history_bytes - 1);
+  expect_stream(nlog, 8 * CHUNK);
+
+  /* And none at all leaves just the ring. */
+  nanny_log_set_history(nlog, 0);
+  expect_stream(nlog, nanny_log_ring_oldest(nlog));
+  assert(nanny_log_ring_oldest(nlog) == 19 * CHUNK);
+  nanny_log_release(nlog);
+}
+
+static void
+feed_at(struct nanny_log *nlog, time_t now, const char *p)
+{
+  nanny_globals.now = now;
+  nanny_log_ring_append(nlog, p, strlen(p));
+}
+
+static void
+test_stamps(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(4 * CHUNK);
+  struct nanny_log_stamp_iter it;
+  time_t t0 = 1000000000;
+  char line[101], expected[64];
+  int i;
+
+  feed_at(nlog, t0, "one\n");
+  feed_at(nlog, t0, "two\n");
+  feed_at(nlog, t0 + 5, "three\n");
+  feed_at(nlog, t0 + 3, "four\n");	/* The clock stepped back. */
+  nanny_log_stamp_iter_init(nlog, &it);
+  assert(nanny_log_stamp_lookup(&it, 0) == t0);
+  assert(nanny_log_stamp_lookup(&it, 7) == t0);
+  assert(nanny_log_stamp_lookup(&it, 8) == t0 + 5);
+  assert(nanny_log_stamp_lookup(&it, 14) == t0 + 3);
+
+  /* Whole lines within a time range, prefixed with their times. */
+  out_len = 0;
+  assert(nanny_log_http_dump_lines(NULL, nlog, 0, t0 + 4, t0 + 5, 1) == 19);
+  snprintf(expected, sizeof(expected), "%s three\n", nanny_isotime(t0 + 5));
+  assert(out_len == strlen(expected) && memcmp(out, expected, out_len) == 0);
+  nanny_log_release(nlog);
+
+  /* A line a second through a small ring:  the stamps for what has
+   * left the ring are trimmed, and every line still in it keeps its
+   * own time. */
+  nlog = nanny_log_alloc(4 * CHUNK);
+  memset(line, 'x', sizeof(line) - 2);
+  line[sizeof(line) - 2] = '\n';
+  line[sizeof(line) - 1] = '\0';
+  for (i = 0; i < 2000; i++)
+    feed_at(nlog, t0 + i, line);
+  assert(nlog->stamps_size <= 1024);
+  nanny_log_stamp_iter_init(nlog, &it);
+  for (i = (nanny_log_oldest(nlog) + 99) / 100; i < 2000; i++)
+    assert(nanny_log_stamp_lookup(&it, i * 100) == t0 + i);
+  nanny_log_release(nlog);
+  nanny_globals.now = time(NULL);
+}
+
+static void
+expect_admit(struct nanny_log *nlog, const char *in, const char *expected,
+	     int in_place)
+{
+  char buff[256];
+  const char *p;
+  size_t n = strlen(in);
+
+  assert(n < sizeof(buff));
+  memcpy(buff, in, n + 1);
+  p = nanny_log_admit(nlog, buff, &n, in_place);
+  assert(n == strlen(expected) && memcmp(p, expected, n) == 0);
+  if (in_place)
+    assert(p == buff);
+  else if (strcmp(in, expected) != 0)
+    assert(p != buff && strcmp(buff, in) == 0);
+}
+
+static void
+test_limit(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(0);
+
+  nanny_globals.now = 1000000000;
+  nanny_log_set_limit(nlog, 10, 20, 0, 0);
+
+  /* Lines that fit are kept, and compacted over those that don't. */
+  expect_admit(nlog, "aaaa\nbbbbbbbbb\ncccccccccccc\nd\n",
+	       "aaaa\nbbbbbbbbb\nd\n", 1);
+  assert(nlog->suppressed_lines == 1 && nlog->suppressed_bytes == 13);
+
+  /* A line's fate is settled by its start, even across reads. */
+  expect_admit(nlog, "ee", "ee", 1);
+  expect_admit(nlog, "eeeeeeeeee\n", "eeeeeeeeee\n", 1);
+  expect_admit(nlog, "fffffff", "", 1);
+  nanny_globals.now++;
+  expect_admit(nlog, "ff\ngg\n", "gg\n", 1);
+  assert(nlog->suppressed_lines == 2 && nlog->suppressed_bytes == 23);
+
+  /* Out of place, the input is left alone. */
+  expect_admit(nlog, "hhhhhh\niiiiiiiiiiiiiii\n", "hhhhhh\n", 0);
+
+  /* Sampling keeps one in N of the lines over the limit. */
+  nanny_log_set_limit(nlog, 1, 1, 0, 2);
+  expect_admit(nlog, "1\n22\n33\n44\n55\n", "22\n44\n", 1);
+  assert(nlog->sampled_lines == 2);
+  nanny_log_release(nlog);
+  nanny_globals.now = time(NULL);
+}
+
+/*
+ * Dump from 'since' and check the output is 'note' followed by the
+ * stream from 'from' to the end.
+ */
+static void
+expect_since(struct nanny_log *nlog, uintmax_t since, const char *note,
+	     uintmax_t from)
+{
+  size_t i, len = strlen(note);
+
+  out_len = 0;
+  assert(nanny_log_http_dump_since(NULL, nlog, since) == nlog->total_bytes);
+  assert(out_len == len + (nlog->total_bytes - from));
+  assert(memcmp(out, note, len) == 0);
+  for (i = len; i < out_len; i++)
+    assert(out[i] == stream_byte(from + i - len));
+}
+
+static void
+test_cursor(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(2 * CHUNK);
+  char note[128];
+
+  expect_since(nlog, 0, "", 0);
+  feed_ring(nlog, 1000, 1000);
+  expect_since(nlog, 0, "", 0);
+  expect_since(nlog, 500, "", 500);
+  expect_since(nlog, 1000, "", 1000);
+
+  /* A cursor the ring has moved past says how much was lost. */
+  feed_ring(nlog, 3 * CHUNK, 1000);
+  snprintf(note, sizeof(note),
+	   "# nanny: %d bytes lost to ring wraparound\n", 2 * CHUNK - 500);
+  expect_since(nlog, 500, note, 2 * CHUNK);
+  expect_since(nlog, 2 * CHUNK + 1, "", 2 * CHUNK + 1);
+
+  /* One from the future (a restarted nanny) starts again. */
+  snprintf(note, sizeof(note), "# nanny: cursor %d is past end of log %d;"
+	   " restarting from %d\n", 5 * CHUNK, 3 * CHUNK + 1000, 2 * CHUNK);
+  expect_since(nlog, 5 * CHUNK, note, 2 * CHUNK);
+  nanny_log_release(nlog);
+}
+
+static size_t
+collect(void *data, struct nanny_log *nlog, uintmax_t offset,
+	const char *p, size_t n)
+{
+  if (p != NULL)
+    http_write(NULL, (void *)p, n);
+  return (n);
+}
+
+/*
+ * Event records live outside the ring, but subscribers and search
+ * still see them, in order with the text.
+ */
+static void
+test_events(void)
+{
+  struct nanny_log *nlog = nanny_log_alloc(CHUNK);
+  struct nanny_log_subscription *sub;
+  char expected[256];
+
+  out_len = 0;
+  sub = nanny_log_subscribe(nlog, collect, NULL);
+  nanny_log_ring_append(nlog, "one\n", 4);
+  nanny_log_event(nlog, NANNY_EVENT_STARTING, 7, 0, 0, "x");
+  nanny_log_ring_append(nlog, "two\n", 4);
+  snprintf(expected, sizeof(expected), "one\n%s: STARTING\tPID=7\tCMD=x\n"
+	   "two\n", nanny_isotime(nanny_globals.now));
+  assert(strcmp(out, expected) == 0);
+
+  out_len = 0;
+  nanny_log_http_search(NULL, nlog, "PID=7", 10, 1000);
+  snprintf(expected, sizeof(expected), "event:0: %s: STARTING\tPID=7\tCMD=x\n"
+	   "# 1 matches, ring and 0 files searched\n",
+	   nanny_isotime(nanny_globals.now));
+  assert(strcmp(out, expected) == 0);
+
+  nanny_log_unsubscribe(sub);
+  nanny_log_release(nlog);
+}
+
+int
+main(int argc, char **argv)
+{
+  nanny_globals.now = time(NULL);
+  test_cursor();
+  test_dedup();
+  test_metrics();
+  test_ring();
+  test_history();
+  test_stamps();
+  test_limit();
+  test_events();
+  printf("log_test: ok\n");
+  return (0);
+}
@@ -0,0 +1,112 @@
+/*-
+ * Copyright (c) 2009 Metaweb Technologies, Inc.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of Metaweb Technologies nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDES AND CONTRIBUTORS ``AS IS''
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nanny.h"
+#include "nanny_log.h"
+
+/*
+ * Ingestion throughput with and without metric rules.
+ *
+ * Feeds the same synthetic service output through the ring alone,
+ * and through the metric rules and then the ring, in 64KB reads as
+ * the input server would, and reports MB/s for each.
+ */
+
+#define	READ_SIZE	65536
+#define	TOTAL		(256 * 1024 * 1024)
+
+static char input[READ_SIZE];
+static size_t input_len;
+
+static void
+make_input(void)
+{
+  static const char *fmt[] = {
+    "GET /api/items/%d 200 took %dms\n",
+    "INFO worker %d processed batch of %d records\n",
+    "POST /api/orders 201 took %dms size=%d\n",
+    "DEBUG cache hit ratio %d.%02d\n",
+  };
+  int i = 0, n;
+
+  while (1) {
+    n = snprintf(input + input_len, sizeof(input) - input_len,
+		 fmt[i % 4], i * 7 % 1000, i * 13 % 500);
+    if (n < 0 || (size_t)n >= sizeof(input) - input_len)
+      break;
+    input_len += n;
+    i++;
+  }
+}
+
+static double
+run(const char *label, int nrules)
+{
+  static const char *rules[][3] = {
+    { "get_ms", "histogram", "^GET * took #ms" },
+    { "batches", "count", "processed batch" },
+    { "records", "sum", "batch of # records" },
+    { "post_ms", "histogram", "POST * took #ms" },
+  };
+  struct nanny_log *nlog = nanny_log_alloc(64 * 1024);
+  struct timeval start, end;
+  size_t done;
+  double secs, rate;
+  int i;
+
+  for (i = 0; i < nrules; i++)
+    nanny_log_add_metric(nlog, rules[i][0], rules[i][1], rules[i][2]);
+  gettimeofday(&start, NULL);
+  for (done = 0; done < TOTAL; done += input_len) {
+    if (nrules > 0)
+      nanny_log_metrics(nlog, input, input_len);
+    nanny_log_ring_append(nlog, input, input_len);
+  }
+  gettimeofday(&end, NULL);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+  rate = done / secs / (1024 * 1024);
+  printf("%-24s %8.1f MB/s\n", label, rate);
+  nanny_log_release(nlog);
+  return (rate);
+}
+
+int
+main(int argc, char **argv)
+{
+  make_input();
+  run("ring only", 0);
+  run("1 rule", 1);
+  run("4 rules", 4);
+  return (0);
+}
@@ -88,25 +88,25 @@ main(int argc, char **argv)
    * a second late), and the rest should fire with relatively low
    * error.
    */
-  timer_add(now + 10, t1, NULL);
-  timer_add(now + 7, t1, NULL);
-  timer_add(now + 3, t1, NULL);
-  timer_add(now + 1, t1, NULL);
-  timer_add(now - 1, t1, NULL);
-  timer_add(now + 6, t1, NULL);
-  timer_add(now + 5, t1, NULL);
-  timer_add(now + 0, t1, NULL);
-  timer_add(now + 4, t1, NULL);
-  timer_add(now + 2, t1, NULL);
-  timer_add(now + 8, t1, NULL);
-  timer_add(now + 9, t1, NULL);
+  nanny_timer_add(now + 10, t1, NULL);
+  nanny_timer_add(now + 7, t1, NULL);
+  nanny_timer_add(now + 3, t1, NULL);
+  nanny_timer_add(now + 1, t1, NULL);
+  nanny_timer_add(now - 1, t1, NULL);
+  nanny_timer_add(now + 6, t1, NULL);
+  nanny_timer_add(now + 5, t1, NULL);
+  nanny_timer_add(now + 0, t1, NULL);
+  nanny_timer_add(now + 4, t1, NULL);
+  nanny_timer_add(now + 2, t1, NULL);
+  nanny_timer_add(now + 8, t1, NULL);
+  nanny_timer_add(now + 9, t1, NULL);
   /* Add then remove an extra timer at +4s. */
-  t = timer_add(now + 4, t1, NULL);
+  t = nanny_timer_add(now + 4, t1, NULL);
 
-  timer_delete(t);
+  nanny_timer_delete(t);
 
   for (;;) {
-    timer_next(&tv, NULL);
+    nanny_timer_next(&tv, NULL);
     assert(timer_count < 13); /* We only set 12 timers; if 13 go off, we lose. */
     fprintf(stderr, "Interval: %ld.%06ld\n",
 	    (long int)tv.tv_sec, (long int)tv.tv_usec);
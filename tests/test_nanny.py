@@ -1,7 +1,12 @@
 import urllib
+import json
 import os
+import shutil
 import signal
+import socket
+import tempfile
 import time
+import zlib
 
 from ctypes import *
 from nanny import Nanny, NannyChild, TIMEVAL, NANNY_HTTP_DISPATCHER, NANNY_HTTP_BODY_PROCESSOR
@@ -145,3 +150,140 @@ def test_nanny_webserver():
         # clean up the child process
         os.kill(childpid, signal.SIGTERM)
         assert 'status' in dat
+
+
+def _http_serve(n, dispatcher):
+    """ Fork a process running the nanny event loop; returns its pid. """
+    global running
+    running = True
+
+    def handler(signum, frame):
+        global running
+        running = False
+
+    signal.signal(signal.SIGTERM, handler)
+    http_server_init = n.http_server_init
+    http_server_init.restype = None
+    http_server_init(None, 0, dispatcher)
+    childpid = os.fork()
+    if childpid == 0:
+        tv = TIMEVAL()
+        while running:
+            n.nanny_oversee_children()
+            n.nanny_timer_next(byref(tv), None)
+            n.nanny_select(byref(tv))
+        os._exit(0)
+    time.sleep(2)
+    return childpid
+
+
+def _http_exchange(port, requests):
+    """ Send requests down one connection, all at once, and return the
+    (status, headers, body) of each response, split by Content-Length. """
+    s = socket.create_connection(("localhost", port))
+    s.sendall("".join(requests))
+    dat = ""
+    while True:
+        more = s.recv(65536)
+        if not more:
+            break
+        dat += more
+    s.close()
+    responses = []
+    while dat:
+        head, dat = dat.split("\r\n\r\n", 1)
+        lines = head.split("\r\n")
+        headers = {}
+        for line in lines[1:]:
+            key, value = line.split(":", 1)
+            headers[key.lower()] = value.strip()
+        length = int(headers.get("content-length", len(dat)))
+        responses.append((int(lines[0].split()[1]), headers, dat[:length]))
+        dat = dat[length:]
+    return responses
+
+
+def _http_get(port, path, headers=(), close=True):
+    request = "GET %s HTTP/1.1\r\nHost: localhost\r\n" % path
+    for header in headers:
+        request += header + "\r\n"
+    if close:
+        request += "Connection: close\r\n"
+    return request + "\r\n"
+
+
+def test_nanny_http11():
+    """ Test persistent connections, compression and file serving """
+    n = Nanny()
+    n.globals.nanny_pid = os.getpid()
+    logdir = tempfile.mkdtemp()
+
+    child = n.create_child("seq 1 2000; exec sleep 5")
+    child.set_logpath(logdir)
+    child_id = child._child_struct.contents.id
+
+    def http_dispatcher(request):
+        if request.contents.uri.startswith("/status"):
+            request.contents.body_processor = status_body_proc
+            return
+        request.contents.body_processor = env_body_proc
+
+    status_body_proc = NANNY_HTTP_BODY_PROCESSOR(n.nanny_children_http_status)
+    env_body_proc = NANNY_HTTP_BODY_PROCESSOR(n.nanny_http_environ_body)
+    dispatcher = NANNY_HTTP_DISPATCHER(http_dispatcher)
+
+    childpid = _http_serve(n, dispatcher)
+    port = n.globals.http_port
+    files = "/status/%d/stdout/files" % child_id
+    try:
+        # Pipelined requests on one connection, each framed exactly.
+        r = _http_exchange(port, [_http_get(port, "/environment", close=False),
+                                  _http_get(port, "/status/", close=False),
+                                  _http_get(port, "/environment")])
+        assert [status for status, headers, body in r] == [200, 200, 200]
+        for status, headers, body in r:
+            assert int(headers["content-length"]) == len(body)
+        assert r[0][2] == r[2][2]
+        plain = r[0][2]
+
+        # gzip round trip.
+        r = _http_exchange(port, [_http_get(port, "/environment",
+                                            ["Accept-Encoding: gzip"])])
+        status, headers, body = r[0]
+        assert status == 200
+        assert headers["content-encoding"] == "gzip"
+        assert int(headers["content-length"]) == len(body)
+        assert zlib.decompress(body, 16 + zlib.MAX_WBITS) == plain
+
+        # Range requests against a log file.
+        name = json.loads(_http_exchange(port, [_http_get(port, files)])[0][2])
+        name = name["files"][0]["name"]
+        f = open(os.path.join(logdir, name))
+        content = f.read()
+        f.close()
+        r = _http_exchange(port, [_http_get(port, files + "/" + name,
+                                            ["Range: bytes=0-9"])])
+        status, headers, body = r[0]
+        assert status == 206
+        assert body == content[:10]
+        assert headers["content-range"] == "bytes 0-9/%d" % len(content)
+        r = _http_exchange(port, [_http_get(port, files + "/" + name,
+                            ["Range: bytes=%d-" % (len(content) + 100)])])
+        assert r[0][0] == 416
+
+        # Only the log's own files are served.
+        r = _http_exchange(port, [_http_get(port,
+                                            files + "/../../../../etc/passwd")])
+        assert r[0][0] == 404
+
+        # A matching ETag gets a 304 and no body.
+        r = _http_exchange(port, [_http_get(port, files + "/" + name)])
+        etag = r[0][1]["etag"]
+        r = _http_exchange(port, [_http_get(port, files + "/" + name,
+                                            ["If-None-Match: " + etag])])
+        assert r[0][0] == 304
+        assert r[0][2] == ""
+    finally:
+        os.kill(childpid, signal.SIGTERM)
+        os.waitpid(childpid, 0)
+        shutil.rmtree(logdir)